@@ -12,23 +12,26 @@ public class triangle {
 	// X,Y,Z of 3 triangle corners and the face normal 
 	public Vector3 P1,P2,P3,facenorm;
 	public float absorbtionCoeff;
+	public float scatteringCoeff;
 	public int objectType;
 	public triangle() {}
-	public triangle(Vector3 n_p1,Vector3 n_p2,Vector3 n_p3, Vector3 n_fn,int n_ls,float abs){
+	public triangle(Vector3 n_p1,Vector3 n_p2,Vector3 n_p3, Vector3 n_fn,int n_ls,float abs,float scat){
 		P1 = n_p1;
 		P2 = n_p2;
 		P3 = n_p3;
 		facenorm = n_fn;
 		objectType = n_ls;
 		absorbtionCoeff = abs;
+		scatteringCoeff = scat;
 	}
-	public void setData(Vector3 n_p1,Vector3 n_p2,Vector3 n_p3,Vector3 n_fn,int n_ls,float abs) {
+	public void setData(Vector3 n_p1,Vector3 n_p2,Vector3 n_p3,Vector3 n_fn,int n_ls,float abs,float scat) {
 		P1 = n_p1;
 		P2 = n_p2;
 		P3 = n_p3;
 		facenorm = n_fn;
 		objectType = n_ls;
 		absorbtionCoeff = abs;
+		scatteringCoeff = scat;
 	}
 }
 	
@@ -13,6 +13,9 @@ public class meshTransport : MonoBehaviour {
 	public int maxPathLength = 100;
 	public int maxNumReflecs = 75;
 	public float absCoeff = 0.5f;
+	public bool listenerTrace = false;
+	public float detectionRadius = 0.5f;
+	public int imageSourceOrder = 2;
 	public int numTriPerLeaf = 10;
 	public bool debugEnable = false;
 	public bool rescanFlag = false;
@@ -27,7 +30,7 @@ public class meshTransport : MonoBehaviour {
 	private float[] rayLengths;
 
 	[DllImport("AudioPluginSpatializerTemplate")]
-	private static extern void marshalGeomeTree (int numNodes,int numTri, int depth,int bbl, float[] boundingBoxes,int tl,float[] triangles, int lsl,int[] leafSizes,int tidl,int[] triangleIds,int tml,float[] triangleMatList);
+	private static extern void marshalGeomeTree (int numNodes,int numTri, int depth,int bbl, float[] boundingBoxes,int tl,float[] triangles, int lsl,int[] leafSizes,int tidl,int[] triangleIds,int tml,float[] triangleMatList,int tsl,float[] triangleScatterList);
 
 	[DllImport("AudioPluginSpatializerTemplate")]
 	private static extern void debugToggle (bool state);
@@ -35,6 +38,12 @@ public class meshTransport : MonoBehaviour {
 	[DllImport("AudioPluginSpatializerTemplate")]
 	private static extern void setTraceParam (int numberOfRays,int maxLen,int maxReflec,float absorbtionCoeff);
 
+	[DllImport("AudioPluginSpatializerTemplate")]
+	private static extern void setListenerTrace (bool enabled,float radius);
+
+	[DllImport("AudioPluginSpatializerTemplate")]
+	private static extern void setImageSourceOrder (int order);
+
 	[DllImport("AudioPluginSpatializerTemplate")]
 	private static extern void getRayData (out int length, out IntPtr array);
 
@@ -51,6 +60,8 @@ public class meshTransport : MonoBehaviour {
 	void Start () {
 		debugToggle (debugEnable);
 		setTraceParam (Mathf.FloorToInt (Mathf.Sqrt (numRays)),maxPathLength, maxNumReflecs,absCoeff);
+		setListenerTrace (listenerTrace, detectionRadius);
+		setImageSourceOrder (imageSourceOrder);
 		GeomeTree KDTree = calcTree ();
 		sendTree (KDTree);
 	}
@@ -88,7 +99,7 @@ public class meshTransport : MonoBehaviour {
 		CombineInstance[] combine = new CombineInstance[includedObjects.Length];
 
 		for (int i = 0; i < includedObjects.Length; i++) {
-			float coeff;
+			float coeff, scatter;
 			Mesh tempMesh;
 			if (includedObjects [i].name.Equals ("Right") || includedObjects [i].name.Equals ("Left")) {
 				
@@ -98,6 +109,7 @@ public class meshTransport : MonoBehaviour {
 			}
 
 			coeff = includedObjects [i].GetComponent<raytraceMaterial> ().absorbitonCoeff;
+			scatter = includedObjects [i].GetComponent<raytraceMaterial> ().scatteringCoeff;
 			Color[] colors = new Color[tempMesh.vertices.Length];
 				
 			for (int j = 0; j < colors.Length; j++) {
@@ -108,7 +120,8 @@ public class meshTransport : MonoBehaviour {
 						colors [j] = new Color (0, 0, 1,1);
 					} else {
 
-					colors [j] = new Color (coeff, 0, 0,1);
+					// The scattering coefficient travels in the alpha channel
+					colors [j] = new Color (coeff, 0, 0,scatter);
 					}
 				}
 			}
@@ -150,7 +163,7 @@ public class meshTransport : MonoBehaviour {
 				}
 			}
 
-			outputArray[i] = new triangle(P1,P2,P3,faceNorm,listenerTag,inputMesh.colors [triIdx[i*3]].r);
+			outputArray[i] = new triangle(P1,P2,P3,faceNorm,listenerTag,inputMesh.colors [triIdx[i*3]].r,inputMesh.colors [triIdx[i*3]].a);
 		}
 		return outputArray;
 	}
@@ -170,6 +183,7 @@ public class meshTransport : MonoBehaviour {
 		float[] triangleList = new float[numTris * 12];
 		int[] triangleIdList = new int[numTris];
 		float[] triangleMatList = new float[numTris];
+		float[] triangleScatterList = new float[numTris];
 		int triListIdx = 0;
 		for(int i = 0; i < nodeList.Length; i++) {
 			Bounds tempBounds = nodeList [i].getBB ();
@@ -189,6 +203,7 @@ public class meshTransport : MonoBehaviour {
 					triangleIdList [triListIdx] = nodeTriangles [j].objectType;
 					print (triangleIdList [triListIdx].ToString());
 					triangleMatList [triListIdx] = nodeTriangles [j].absorbtionCoeff;
+					triangleScatterList [triListIdx] = nodeTriangles [j].scatteringCoeff;
 					triangleList [triListIdx*12] = nodeTriangles [j].P1.x;
 					triangleList [(triListIdx*12)+1] = nodeTriangles [j].P1.y;
 					triangleList [(triListIdx*12)+2] = nodeTriangles [j].P1.z;
@@ -205,7 +220,7 @@ public class meshTransport : MonoBehaviour {
 				}
 			}
 		}
- 		marshalGeomeTree (numNodes,numTris, depth, boundingBoxList.Length,boundingBoxList,triangleList.Length, triangleList,leafSizeList.Length,leafSizeList,triangleIdList.Length,triangleIdList,triangleMatList.Length,triangleMatList); 
+ 		marshalGeomeTree (numNodes,numTris, depth, boundingBoxList.Length,boundingBoxList,triangleList.Length, triangleList,leafSizeList.Length,leafSizeList,triangleIdList.Length,triangleIdList,triangleMatList.Length,triangleMatList,triangleScatterList.Length,triangleScatterList); 
 	}
 
 	void OnDrawGizmos() {
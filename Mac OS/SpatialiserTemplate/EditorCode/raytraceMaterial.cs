@@ -3,4 +3,5 @@ using System.Collections;
 
 public class raytraceMaterial : MonoBehaviour {
 	public float absorbitonCoeff = 0.5f;
+	public float scatteringCoeff = 0.1f;
 }
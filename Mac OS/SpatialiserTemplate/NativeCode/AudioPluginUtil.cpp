@@ -1,7 +1,40 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
 #include "AudioPluginUtil.h"
 #include <stdarg.h>
+#include <time.h>
+#include <thread>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#   define ENABLE_SIMD_X86 1
+#   include <immintrin.h>
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#       define SIMD_TARGET(isa)
+#   else
+#       define SIMD_TARGET(isa) __attribute__((target(isa)))
+#   endif
+// AVX-512 intrinsics are only available from Visual Studio 2017 on
+#   if defined(_MSC_VER) && _MSC_VER < 1910
+#       define ENABLE_SIMD_AVX512 0
+#   else
+#       define ENABLE_SIMD_AVX512 1
+#   endif
+#else
+#   define ENABLE_SIMD_X86 0
+#   define ENABLE_SIMD_AVX512 0
+#endif
 
-#define ENABLE_TESTS ((UNITY_WIN || UNITY_OSX) && 1)
+// Offline tools that only need the DSP code build with ENABLE_EFFECTS=0, which leaves out the effect definitions (and
+// with them the references to the plugins in PluginList.h) as well as the unit tests.
+#ifndef ENABLE_EFFECTS
+#define ENABLE_EFFECTS 1
+#endif
+
+#define ENABLE_TESTS ((UNITY_WIN || UNITY_OSX) && ENABLE_EFFECTS && 1)
+#define ENABLE_BENCHMARKS ((UNITY_WIN || UNITY_OSX) && 0)
+#define ENABLE_SLOW_TESTS (ENABLE_TESTS && 0) // Tests that would hold up loading the plugin, such as ones that start many threads
 
 char* strnew(const char* src)
 {
@@ -22,8 +55,10 @@ char* tmpstr(int index, const char* fmtstr, ...)
 
 template<typename T> void UnitySwap(T& a, T& b) { T t = a; a = b; b = t; }
 
-template<typename T>
-static void FFTProcess(UnityComplexNumber* data, int numsamples, bool forward)
+// Bit reversal permutation of a transform of numsamples points, which must be a power of two. The tables are created on
+// first use and shared by all threads; if two threads create the same table at once, the one that publishes it second
+// deletes its own.
+static const unsigned int* GetReverseTable(int numsamples)
 {
 	unsigned int count = 1, numbits = 0;
 	while (count < numsamples)
@@ -32,8 +67,8 @@ static void FFTProcess(UnityComplexNumber* data, int numsamples, bool forward)
 		++numbits;
 	}
 	
-	static unsigned int* reversetable[32] = { NULL };
-	unsigned int* tbl = reversetable[numbits];
+	static std::atomic<unsigned int*> reversetable[32];
+	unsigned int* tbl = reversetable[numbits].load(std::memory_order_acquire);
 	if (tbl == NULL)
 	{
 		tbl = new unsigned int [numsamples];
@@ -55,9 +90,20 @@ static void FFTProcess(UnityComplexNumber* data, int numsamples, bool forward)
 			assert (tbl[tbl[n]] == n);
 		}
 #endif
-		reversetable[numbits] = tbl;
+		unsigned int* expected = NULL;
+		if (!reversetable[numbits].compare_exchange_strong(expected, tbl, std::memory_order_acq_rel))
+		{
+			delete[] tbl;
+			tbl = expected;
+		}
 	}
-	
+	return tbl;
+}
+
+template<typename T>
+static void FFTProcess(UnityComplexNumber* data, int numsamples, bool forward)
+{
+	const unsigned int* tbl = GetReverseTable(numsamples);
 	for (unsigned int i = 0; i < numsamples; i++)
 	{
 		unsigned int j = tbl[i];
@@ -90,6 +136,12 @@ static void FFTProcess(UnityComplexNumber* data, int numsamples, bool forward)
     }
 }
 
+void FFT::Prepare(int numsamples)
+{
+	for (int n = 1; n <= numsamples; n += n)
+		GetReverseTable(n);
+}
+
 void FFT::Forward(UnityComplexNumber* data, int numsamples, bool highprecision)
 {
 	if (highprecision)
@@ -113,6 +165,1293 @@ void FFT::Backward(UnityComplexNumber* data, int numsamples, bool highprecision)
 	}	
 }
 
+void FFT::SplitStereo(const UnityComplexNumber* packed, float* re1, float* im1, float* re2, float* im2, int numsamples)
+{
+    // X1[k] = (Z[k] + conj(Z[N-k])) / 2, X2[k] = (Z[k] - conj(Z[N-k])) / 2i
+    const int mask = numsamples - 1;
+    for (int n = 0; n < numsamples; n++)
+    {
+        const UnityComplexNumber& a = packed[n];
+        const UnityComplexNumber& b = packed[(numsamples - n) & mask];
+        re1[n] = (a.re + b.re) * 0.5f;
+        im1[n] = (a.im - b.im) * 0.5f;
+        re2[n] = (a.im + b.im) * 0.5f;
+        im2[n] = (b.re - a.re) * 0.5f;
+    }
+}
+
+void FFT::ForwardReal(const float* input, UnityComplexNumber* work, float* re, float* im, int numsamples)
+{
+    const int half = numsamples / 2;
+    for (int n = 0; n < half; n++)
+        work[n].Set(input[n * 2], input[n * 2 + 1]);
+    FFT::Forward(work, half, false);
+
+    // E[k] = (Z[k] + conj(Z[N/2-k])) / 2, O[k] = (Z[k] - conj(Z[N/2-k])) / 2i, X[k] = E[k] + W^k O[k] with W = exp(-2 pi i / N)
+    const double step = -2.0 * kPI_double / (double)numsamples;
+    double wr = 1.0, wi = 0.0, dr = cos(step), di = sin(step);
+    for (int k = 0; k <= half / 2; k++)
+    {
+        int j = (half - k) & (half - 1);
+        float zr = work[k].re, zi = work[k].im, cr = work[j].re, ci = -work[j].im;
+        float er = 0.5f * (zr + cr), ei = 0.5f * (zi + ci);
+        float or_ = 0.5f * (zi - ci), oi = -0.5f * (zr - cr);
+        float tr = (float)wr * or_ - (float)wi * oi, ti = (float)wr * oi + (float)wi * or_;
+        re[k] = er + tr;
+        im[k] = ei + ti;
+        re[k + half] = er - tr;
+        im[k + half] = ei - ti;
+
+        // The mirrored bin N/2 - k uses the same pair of packed bins
+        if (k != 0 && j != k)
+        {
+            float ejr = er, eji = -ei, ojr = or_, oji = -oi;
+            double wjr = -wr, wji = wi; // W^(N/2-k) = -conj(W^k)
+            float tjr = (float)wjr * ojr - (float)wji * oji, tji = (float)wjr * oji + (float)wji * ojr;
+            re[j] = ejr + tjr;
+            im[j] = eji + tji;
+            re[j + half] = ejr - tjr;
+            im[j + half] = eji - tji;
+        }
+
+        double t = wr * dr - wi * di;
+        wi = wr * di + wi * dr;
+        wr = t;
+    }
+}
+
+void FFT::MergeStereo(const float* re1, const float* im1, const float* re2, const float* im2, UnityComplexNumber* packed, int numsamples)
+{
+    // Z[k] = X1[k] + i * X2[k]
+    for (int n = 0; n < numsamples; n++)
+    {
+        packed[n].re = re1[n] - im2[n];
+        packed[n].im = im1[n] + re2[n];
+    }
+}
+
+static void SplitComplexMul_Scalar(const float* are, const float* aim, const float* bre, const float* bim, float* rre, float* rim, int numsamples)
+{
+    for (int n = 0; n < numsamples; n++)
+    {
+        float re = are[n] * bre[n] - aim[n] * bim[n];
+        float im = are[n] * bim[n] + aim[n] * bre[n];
+        rre[n] = re;
+        rim[n] = im;
+    }
+}
+
+static void SplitComplexMulAdd_Scalar(const float* are, const float* aim, const float* bre, const float* bim, float* rre, float* rim, int numsamples)
+{
+    for (int n = 0; n < numsamples; n++)
+    {
+        float re = are[n] * bre[n] - aim[n] * bim[n];
+        float im = are[n] * bim[n] + aim[n] * bre[n];
+        rre[n] += re;
+        rim[n] += im;
+    }
+}
+
+static void Blend4_Scalar(const float* const* src, const float* weights, float* result, int numsamples)
+{
+    const float* s0 = src[0], *s1 = src[1], *s2 = src[2], *s3 = src[3];
+    const float w0 = weights[0], w1 = weights[1], w2 = weights[2], w3 = weights[3];
+    for (int n = 0; n < numsamples; n++)
+        result[n] = s0[n] * w0 + s1[n] * w1 + s2[n] * w2 + s3[n] * w3;
+}
+
+static void FIR_Scalar(const float* input, const float* coeffs, float* output, int numsamples, int numtaps)
+{
+    for (int n = 0; n < numsamples; n++)
+    {
+        float sum = 0.0f;
+        for (int k = 0; k < numtaps; k++)
+            sum += coeffs[k] * input[n + k];
+        output[n] = sum;
+    }
+}
+
+static void SparseFIR_Scalar(const float* input, const int* offsets, const float* coeffs, float* output, int numsamples, int numtaps)
+{
+    for (int n = 0; n < numsamples; n++)
+    {
+        float sum = 0.0f;
+        for (int k = 0; k < numtaps; k++)
+            sum += coeffs[k] * input[offsets[k] + n];
+        output[n] = sum;
+    }
+}
+
+// coeffs holds a1, a2, b0, b1, b2 and state holds z1, z2 for all bands (see OctaveFilterBank). The squared outputs are added to sumsq.
+static void BiquadBank_Scalar(const float* coeffs, float* state, const float* input, int stride, float* sumsq, float* output, int numsamples)
+{
+    const int B = OctaveFilterBank::NUMBANDS;
+    const float* a1 = coeffs, *a2 = coeffs + B, *b0 = coeffs + B * 2, *b1 = coeffs + B * 3, *b2 = coeffs + B * 4;
+    float* z1 = state, *z2 = state + B;
+    for (int n = 0; n < numsamples; n++)
+    {
+        float x = input[n * stride];
+        for (int b = 0; b < B; b++)
+        {
+            float iir = x - a1[b] * z1[b] - a2[b] * z2[b];
+            float y = b0[b] * iir + b1[b] * z1[b] + b2[b] * z2[b];
+            z2[b] = z1[b];
+            z1[b] = iir;
+            sumsq[b] += y * y;
+            if (output != NULL)
+                output[n * B + b] = y;
+        }
+    }
+}
+
+// Absorption filters and Hadamard mixing of the feedback delay network for numsamples frames of NUMLINES line samples.
+// coeffs holds b0, b1, a1 of the low shelf and of the high shelf and state holds their z1 (see FeedbackDelayNetwork).
+// lines holds the delay line outputs and is filtered in place, feedback receives the mixed lines.
+static void FDN_Scalar(const float* coeffs, float* state, float* lines, float* feedback, int numsamples)
+{
+    const int L = FeedbackDelayNetwork::NUMLINES;
+    for (int n = 0; n < numsamples; n++)
+    {
+        float* x = lines + n * L;
+        float* y = feedback + n * L;
+        for (int i = 0; i < L; i++)
+        {
+            float lo = coeffs[i] * x[i] + state[i];
+            state[i] = coeffs[L + i] * x[i] - coeffs[L * 2 + i] * lo;
+            float hi = coeffs[L * 3 + i] * lo + state[L + i];
+            state[L + i] = coeffs[L * 4 + i] * lo - coeffs[L * 5 + i] * hi;
+            x[i] = hi;
+            y[i] = hi * 0.25f; // 1 / sqrt(L) makes the Hadamard matrix orthogonal
+        }
+        for (int stride = L / 2; stride >= 1; stride /= 2)
+        {
+            for (int i = 0; i < L; i += stride * 2)
+            {
+                for (int j = i; j < i + stride; j++)
+                {
+                    float a = y[j], b = y[j + stride];
+                    y[j] = a + b;
+                    y[j + stride] = a - b;
+                }
+            }
+        }
+    }
+}
+
+// Adds input scaled by gains ramped from prevgains over the block to the first numchannels of frames that are stride floats apart
+static void SHEncodeChannels_Scalar(const float* input, const float* prevgains, const float* gains, float* output, int numsamples, int numchannels, int stride)
+{
+    const float fadestep = 1.0f / (float)numsamples;
+    for (int n = 0; n < numsamples; n++)
+    {
+        const float t = (float)(n + 1) * fadestep;
+        float* y = output + n * stride;
+        for (int k = 0; k < numchannels; k++)
+            y[k] += input[n] * (prevgains[k] + (gains[k] - prevgains[k]) * t);
+    }
+}
+
+static void SHEncode_Scalar(const float* input, const float* prevgains, const float* gains, float* output, int numsamples, int numchannels)
+{
+    SHEncodeChannels_Scalar(input, prevgains, gains, output, numsamples, numchannels, numchannels);
+}
+
+#if ENABLE_SIMD_X86
+
+static void SplitComplexMul_SSE(const float* are, const float* aim, const float* bre, const float* bim, float* rre, float* rim, int numsamples)
+{
+    int n = 0;
+    for (; n <= numsamples - 4; n += 4)
+    {
+        __m128 ar = _mm_loadu_ps(are + n), ai = _mm_loadu_ps(aim + n);
+        __m128 br = _mm_loadu_ps(bre + n), bi = _mm_loadu_ps(bim + n);
+        _mm_storeu_ps(rre + n, _mm_sub_ps(_mm_mul_ps(ar, br), _mm_mul_ps(ai, bi)));
+        _mm_storeu_ps(rim + n, _mm_add_ps(_mm_mul_ps(ar, bi), _mm_mul_ps(ai, br)));
+    }
+    SplitComplexMul_Scalar(are + n, aim + n, bre + n, bim + n, rre + n, rim + n, numsamples - n);
+}
+
+static void SplitComplexMulAdd_SSE(const float* are, const float* aim, const float* bre, const float* bim, float* rre, float* rim, int numsamples)
+{
+    int n = 0;
+    for (; n <= numsamples - 4; n += 4)
+    {
+        __m128 ar = _mm_loadu_ps(are + n), ai = _mm_loadu_ps(aim + n);
+        __m128 br = _mm_loadu_ps(bre + n), bi = _mm_loadu_ps(bim + n);
+        __m128 re = _mm_sub_ps(_mm_mul_ps(ar, br), _mm_mul_ps(ai, bi));
+        __m128 im = _mm_add_ps(_mm_mul_ps(ar, bi), _mm_mul_ps(ai, br));
+        _mm_storeu_ps(rre + n, _mm_add_ps(_mm_loadu_ps(rre + n), re));
+        _mm_storeu_ps(rim + n, _mm_add_ps(_mm_loadu_ps(rim + n), im));
+    }
+    SplitComplexMulAdd_Scalar(are + n, aim + n, bre + n, bim + n, rre + n, rim + n, numsamples - n);
+}
+
+static void Blend4_SSE(const float* const* src, const float* weights, float* result, int numsamples)
+{
+    const float* s0 = src[0], *s1 = src[1], *s2 = src[2], *s3 = src[3];
+    __m128 w0 = _mm_set1_ps(weights[0]), w1 = _mm_set1_ps(weights[1]), w2 = _mm_set1_ps(weights[2]), w3 = _mm_set1_ps(weights[3]);
+    int n = 0;
+    for (; n <= numsamples - 4; n += 4)
+    {
+        __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(s0 + n), w0), _mm_mul_ps(_mm_loadu_ps(s1 + n), w1));
+        __m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(s2 + n), w2), _mm_mul_ps(_mm_loadu_ps(s3 + n), w3));
+        _mm_storeu_ps(result + n, _mm_add_ps(a, b));
+    }
+    const float* tail[4] = { s0 + n, s1 + n, s2 + n, s3 + n };
+    Blend4_Scalar(tail, weights, result + n, numsamples - n);
+}
+
+static void FIR_SSE(const float* input, const float* coeffs, float* output, int numsamples, int numtaps)
+{
+    int n = 0;
+    for (; n <= numsamples - 4; n += 4)
+    {
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < numtaps; k++)
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(coeffs[k]), _mm_loadu_ps(input + n + k)));
+        _mm_storeu_ps(output + n, sum);
+    }
+    FIR_Scalar(input + n, coeffs, output + n, numsamples - n, numtaps);
+}
+
+static void SparseFIR_SSE(const float* input, const int* offsets, const float* coeffs, float* output, int numsamples, int numtaps)
+{
+    int n = 0;
+    for (; n <= numsamples - 4; n += 4)
+    {
+        __m128 sum = _mm_setzero_ps();
+        for (int k = 0; k < numtaps; k++)
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(coeffs[k]), _mm_loadu_ps(input + offsets[k] + n)));
+        _mm_storeu_ps(output + n, sum);
+    }
+    SparseFIR_Scalar(input + n, offsets, coeffs, output + n, numsamples - n, numtaps);
+}
+
+static void BiquadBank_SSE(const float* coeffs, float* state, const float* input, int stride, float* sumsq, float* output, int numsamples)
+{
+    const int B = OctaveFilterBank::NUMBANDS;
+    __m128 a1[2], a2[2], b0[2], b1[2], b2[2], z1[2], z2[2], acc[2];
+    for (int h = 0; h < 2; h++)
+    {
+        a1[h] = _mm_loadu_ps(coeffs + h * 4);
+        a2[h] = _mm_loadu_ps(coeffs + B + h * 4);
+        b0[h] = _mm_loadu_ps(coeffs + B * 2 + h * 4);
+        b1[h] = _mm_loadu_ps(coeffs + B * 3 + h * 4);
+        b2[h] = _mm_loadu_ps(coeffs + B * 4 + h * 4);
+        z1[h] = _mm_loadu_ps(state + h * 4);
+        z2[h] = _mm_loadu_ps(state + B + h * 4);
+        acc[h] = _mm_setzero_ps();
+    }
+    for (int n = 0; n < numsamples; n++)
+    {
+        __m128 x = _mm_set1_ps(input[n * stride]);
+        for (int h = 0; h < 2; h++)
+        {
+            __m128 iir = _mm_sub_ps(_mm_sub_ps(x, _mm_mul_ps(a1[h], z1[h])), _mm_mul_ps(a2[h], z2[h]));
+            __m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(b0[h], iir), _mm_mul_ps(b1[h], z1[h])), _mm_mul_ps(b2[h], z2[h]));
+            z2[h] = z1[h];
+            z1[h] = iir;
+            acc[h] = _mm_add_ps(acc[h], _mm_mul_ps(y, y));
+            if (output != NULL)
+                _mm_storeu_ps(output + n * B + h * 4, y);
+        }
+    }
+    for (int h = 0; h < 2; h++)
+    {
+        _mm_storeu_ps(state + h * 4, z1[h]);
+        _mm_storeu_ps(state + B + h * 4, z2[h]);
+        _mm_storeu_ps(sumsq + h * 4, _mm_add_ps(_mm_loadu_ps(sumsq + h * 4), acc[h]));
+    }
+}
+
+static void FDN_SSE(const float* coeffs, float* state, float* lines, float* feedback, int numsamples)
+{
+    const int L = FeedbackDelayNetwork::NUMLINES;
+    __m128 lb0[4], lb1[4], la1[4], hb0[4], hb1[4], ha1[4], lz[4], hz[4], y[4];
+    for (int h = 0; h < 4; h++)
+    {
+        lb0[h] = _mm_loadu_ps(coeffs + h * 4);
+        lb1[h] = _mm_loadu_ps(coeffs + L + h * 4);
+        la1[h] = _mm_loadu_ps(coeffs + L * 2 + h * 4);
+        hb0[h] = _mm_loadu_ps(coeffs + L * 3 + h * 4);
+        hb1[h] = _mm_loadu_ps(coeffs + L * 4 + h * 4);
+        ha1[h] = _mm_loadu_ps(coeffs + L * 5 + h * 4);
+        lz[h] = _mm_loadu_ps(state + h * 4);
+        hz[h] = _mm_loadu_ps(state + L + h * 4);
+    }
+    const __m128 scale = _mm_set1_ps(0.25f);
+    const __m128 sign2 = _mm_setr_ps(1.0f, 1.0f, -1.0f, -1.0f), sign1 = _mm_setr_ps(1.0f, -1.0f, 1.0f, -1.0f);
+    for (int n = 0; n < numsamples; n++)
+    {
+        float* x = lines + n * L;
+        for (int h = 0; h < 4; h++)
+        {
+            __m128 in = _mm_loadu_ps(x + h * 4);
+            __m128 lo = _mm_add_ps(_mm_mul_ps(lb0[h], in), lz[h]);
+            lz[h] = _mm_sub_ps(_mm_mul_ps(lb1[h], in), _mm_mul_ps(la1[h], lo));
+            __m128 hi = _mm_add_ps(_mm_mul_ps(hb0[h], lo), hz[h]);
+            hz[h] = _mm_sub_ps(_mm_mul_ps(hb1[h], lo), _mm_mul_ps(ha1[h], hi));
+            _mm_storeu_ps(x + h * 4, hi);
+            y[h] = _mm_mul_ps(hi, scale);
+        }
+
+        // Butterflies with stride 8 and 4 between registers, then 2 and 1 within each register
+        for (int h = 0; h < 2; h++)
+        {
+            __m128 a = y[h], b = y[h + 2];
+            y[h] = _mm_add_ps(a, b);
+            y[h + 2] = _mm_sub_ps(a, b);
+        }
+        for (int h = 0; h < 4; h += 2)
+        {
+            __m128 a = y[h], b = y[h + 1];
+            y[h] = _mm_add_ps(a, b);
+            y[h + 1] = _mm_sub_ps(a, b);
+        }
+        for (int h = 0; h < 4; h++)
+        {
+            __m128 v = _mm_add_ps(_mm_movelh_ps(y[h], y[h]), _mm_mul_ps(_mm_movehl_ps(y[h], y[h]), sign2));
+            v = _mm_add_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 0, 0)), _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 1, 1)), sign1));
+            _mm_storeu_ps(feedback + n * L + h * 4, v);
+        }
+    }
+    for (int h = 0; h < 4; h++)
+    {
+        _mm_storeu_ps(state + h * 4, lz[h]);
+        _mm_storeu_ps(state + L + h * 4, hz[h]);
+    }
+}
+
+static void SHEncode_SSE(const float* input, const float* prevgains, const float* gains, float* output, int numsamples, int numchannels)
+{
+    const float fadestep = 1.0f / (float)numsamples;
+    const int numvector = numchannels & ~3;
+    for (int n = 0; n < numsamples; n++)
+    {
+        __m128 t = _mm_set1_ps((float)(n + 1) * fadestep), x = _mm_set1_ps(input[n]);
+        float* y = output + n * numchannels;
+        for (int k = 0; k < numvector; k += 4)
+        {
+            __m128 g0 = _mm_loadu_ps(prevgains + k);
+            __m128 g = _mm_add_ps(g0, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(gains + k), g0), t));
+            _mm_storeu_ps(y + k, _mm_add_ps(_mm_loadu_ps(y + k), _mm_mul_ps(g, x)));
+        }
+    }
+    SHEncodeChannels_Scalar(input, prevgains + numvector, gains + numvector, output + numvector, numsamples, numchannels - numvector, numchannels);
+}
+
+SIMD_TARGET("avx2,fma")
+static void SplitComplexMul_AVX2(const float* are, const float* aim, const float* bre, const float* bim, float* rre, float* rim, int numsamples)
+{
+    int n = 0;
+    for (; n <= numsamples - 8; n += 8)
+    {
+        __m256 ar = _mm256_loadu_ps(are + n), ai = _mm256_loadu_ps(aim + n);
+        __m256 br = _mm256_loadu_ps(bre + n), bi = _mm256_loadu_ps(bim + n);
+        _mm256_storeu_ps(rre + n, _mm256_fmsub_ps(ar, br, _mm256_mul_ps(ai, bi)));
+        _mm256_storeu_ps(rim + n, _mm256_fmadd_ps(ar, bi, _mm256_mul_ps(ai, br)));
+    }
+    SplitComplexMul_Scalar(are + n, aim + n, bre + n, bim + n, rre + n, rim + n, numsamples - n);
+}
+
+SIMD_TARGET("avx2,fma")
+static void SplitComplexMulAdd_AVX2(const float* are, const float* aim, const float* bre, const float* bim, float* rre, float* rim, int numsamples)
+{
+    int n = 0;
+    for (; n <= numsamples - 8; n += 8)
+    {
+        __m256 ar = _mm256_loadu_ps(are + n), ai = _mm256_loadu_ps(aim + n);
+        __m256 br = _mm256_loadu_ps(bre + n), bi = _mm256_loadu_ps(bim + n);
+        __m256 re = _mm256_fmadd_ps(ar, br, _mm256_loadu_ps(rre + n));
+        __m256 im = _mm256_fmadd_ps(ar, bi, _mm256_loadu_ps(rim + n));
+        _mm256_storeu_ps(rre + n, _mm256_fnmadd_ps(ai, bi, re));
+        _mm256_storeu_ps(rim + n, _mm256_fmadd_ps(ai, br, im));
+    }
+    SplitComplexMulAdd_Scalar(are + n, aim + n, bre + n, bim + n, rre + n, rim + n, numsamples - n);
+}
+
+SIMD_TARGET("avx2,fma")
+static void Blend4_AVX2(const float* const* src, const float* weights, float* result, int numsamples)
+{
+    const float* s0 = src[0], *s1 = src[1], *s2 = src[2], *s3 = src[3];
+    __m256 w0 = _mm256_set1_ps(weights[0]), w1 = _mm256_set1_ps(weights[1]), w2 = _mm256_set1_ps(weights[2]), w3 = _mm256_set1_ps(weights[3]);
+    int n = 0;
+    for (; n <= numsamples - 8; n += 8)
+    {
+        __m256 a = _mm256_fmadd_ps(_mm256_loadu_ps(s1 + n), w1, _mm256_mul_ps(_mm256_loadu_ps(s0 + n), w0));
+        __m256 b = _mm256_fmadd_ps(_mm256_loadu_ps(s3 + n), w3, _mm256_mul_ps(_mm256_loadu_ps(s2 + n), w2));
+        _mm256_storeu_ps(result + n, _mm256_add_ps(a, b));
+    }
+    const float* tail[4] = { s0 + n, s1 + n, s2 + n, s3 + n };
+    Blend4_Scalar(tail, weights, result + n, numsamples - n);
+}
+
+SIMD_TARGET("avx2,fma")
+static void FIR_AVX2(const float* input, const float* coeffs, float* output, int numsamples, int numtaps)
+{
+    int n = 0;
+    for (; n <= numsamples - 8; n += 8)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        for (int k = 0; k < numtaps; k++)
+            sum = _mm256_fmadd_ps(_mm256_set1_ps(coeffs[k]), _mm256_loadu_ps(input + n + k), sum);
+        _mm256_storeu_ps(output + n, sum);
+    }
+    FIR_Scalar(input + n, coeffs, output + n, numsamples - n, numtaps);
+}
+
+SIMD_TARGET("avx2,fma")
+static void SparseFIR_AVX2(const float* input, const int* offsets, const float* coeffs, float* output, int numsamples, int numtaps)
+{
+    int n = 0;
+    for (; n <= numsamples - 8; n += 8)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        for (int k = 0; k < numtaps; k++)
+            sum = _mm256_fmadd_ps(_mm256_set1_ps(coeffs[k]), _mm256_loadu_ps(input + offsets[k] + n), sum);
+        _mm256_storeu_ps(output + n, sum);
+    }
+    SparseFIR_Scalar(input + n, offsets, coeffs, output + n, numsamples - n, numtaps);
+}
+
+// All eight bands fit in one register, so this kernel is also used on AVX-512 capable CPUs
+SIMD_TARGET("avx2,fma")
+static void BiquadBank_AVX2(const float* coeffs, float* state, const float* input, int stride, float* sumsq, float* output, int numsamples)
+{
+    const int B = OctaveFilterBank::NUMBANDS;
+    __m256 a1 = _mm256_loadu_ps(coeffs), a2 = _mm256_loadu_ps(coeffs + B);
+    __m256 b0 = _mm256_loadu_ps(coeffs + B * 2), b1 = _mm256_loadu_ps(coeffs + B * 3), b2 = _mm256_loadu_ps(coeffs + B * 4);
+    __m256 z1 = _mm256_loadu_ps(state), z2 = _mm256_loadu_ps(state + B);
+    __m256 acc = _mm256_setzero_ps();
+    for (int n = 0; n < numsamples; n++)
+    {
+        __m256 x = _mm256_set1_ps(input[n * stride]);
+        __m256 iir = _mm256_fnmadd_ps(a2, z2, _mm256_fnmadd_ps(a1, z1, x));
+        __m256 y = _mm256_fmadd_ps(b2, z2, _mm256_fmadd_ps(b1, z1, _mm256_mul_ps(b0, iir)));
+        z2 = z1;
+        z1 = iir;
+        acc = _mm256_fmadd_ps(y, y, acc);
+        if (output != NULL)
+            _mm256_storeu_ps(output + n * B, y);
+    }
+    _mm256_storeu_ps(state, z1);
+    _mm256_storeu_ps(state + B, z2);
+    _mm256_storeu_ps(sumsq, _mm256_add_ps(_mm256_loadu_ps(sumsq), acc));
+}
+
+// Also used on AVX-512 capable CPUs, where the per-sample shuffles rather than the register width limit the speed
+SIMD_TARGET("avx2,fma")
+static void FDN_AVX2(const float* coeffs, float* state, float* lines, float* feedback, int numsamples)
+{
+    const int L = FeedbackDelayNetwork::NUMLINES;
+    __m256 lb0[2], lb1[2], la1[2], hb0[2], hb1[2], ha1[2], lz[2], hz[2], y[2];
+    for (int h = 0; h < 2; h++)
+    {
+        lb0[h] = _mm256_loadu_ps(coeffs + h * 8);
+        lb1[h] = _mm256_loadu_ps(coeffs + L + h * 8);
+        la1[h] = _mm256_loadu_ps(coeffs + L * 2 + h * 8);
+        hb0[h] = _mm256_loadu_ps(coeffs + L * 3 + h * 8);
+        hb1[h] = _mm256_loadu_ps(coeffs + L * 4 + h * 8);
+        ha1[h] = _mm256_loadu_ps(coeffs + L * 5 + h * 8);
+        lz[h] = _mm256_loadu_ps(state + h * 8);
+        hz[h] = _mm256_loadu_ps(state + L + h * 8);
+    }
+    const __m256 scale = _mm256_set1_ps(0.25f);
+    const __m256 sign4 = _mm256_setr_ps(1.0f, 1.0f, 1.0f, 1.0f, -1.0f, -1.0f, -1.0f, -1.0f);
+    const __m256 sign2 = _mm256_setr_ps(1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, -1.0f, -1.0f);
+    const __m256 sign1 = _mm256_setr_ps(1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f);
+    for (int n = 0; n < numsamples; n++)
+    {
+        float* x = lines + n * L;
+        for (int h = 0; h < 2; h++)
+        {
+            __m256 in = _mm256_loadu_ps(x + h * 8);
+            __m256 lo = _mm256_fmadd_ps(lb0[h], in, lz[h]);
+            lz[h] = _mm256_fnmadd_ps(la1[h], lo, _mm256_mul_ps(lb1[h], in));
+            __m256 hi = _mm256_fmadd_ps(hb0[h], lo, hz[h]);
+            hz[h] = _mm256_fnmadd_ps(ha1[h], hi, _mm256_mul_ps(hb1[h], lo));
+            _mm256_storeu_ps(x + h * 8, hi);
+            y[h] = _mm256_mul_ps(hi, scale);
+        }
+
+        // Butterfly with stride 8 between the registers, then 4, 2 and 1 within each register
+        __m256 a = y[0], b = y[1];
+        y[0] = _mm256_add_ps(a, b);
+        y[1] = _mm256_sub_ps(a, b);
+        for (int h = 0; h < 2; h++)
+        {
+            __m256 v = _mm256_fmadd_ps(_mm256_permute2f128_ps(y[h], y[h], 0x11), sign4, _mm256_permute2f128_ps(y[h], y[h], 0x00));
+            v = _mm256_fmadd_ps(_mm256_shuffle_ps(v, v, _MM_SHUFFLE(3, 2, 3, 2)), sign2, _mm256_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 1, 0)));
+            v = _mm256_fmadd_ps(_mm256_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 1, 1)), sign1, _mm256_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 0, 0)));
+            _mm256_storeu_ps(feedback + n * L + h * 8, v);
+        }
+    }
+    for (int h = 0; h < 2; h++)
+    {
+        _mm256_storeu_ps(state + h * 8, lz[h]);
+        _mm256_storeu_ps(state + L + h * 8, hz[h]);
+    }
+}
+
+SIMD_TARGET("avx2,fma")
+static void SHEncode_AVX2(const float* input, const float* prevgains, const float* gains, float* output, int numsamples, int numchannels)
+{
+    const float fadestep = 1.0f / (float)numsamples;
+    const int numvector = numchannels & ~7;
+    for (int n = 0; n < numsamples; n++)
+    {
+        __m256 t = _mm256_set1_ps((float)(n + 1) * fadestep), x = _mm256_set1_ps(input[n]);
+        float* y = output + n * numchannels;
+        for (int k = 0; k < numvector; k += 8)
+        {
+            __m256 g0 = _mm256_loadu_ps(prevgains + k);
+            __m256 g = _mm256_fmadd_ps(_mm256_sub_ps(_mm256_loadu_ps(gains + k), g0), t, g0);
+            _mm256_storeu_ps(y + k, _mm256_fmadd_ps(g, x, _mm256_loadu_ps(y + k)));
+        }
+    }
+    SHEncodeChannels_Scalar(input, prevgains + numvector, gains + numvector, output + numvector, numsamples, numchannels - numvector, numchannels);
+}
+
+#if ENABLE_SIMD_AVX512
+
+SIMD_TARGET("avx512f")
+static void SplitComplexMul_AVX512(const float* are, const float* aim, const float* bre, const float* bim, float* rre, float* rim, int numsamples)
+{
+    int n = 0;
+    for (; n <= numsamples - 16; n += 16)
+    {
+        __m512 ar = _mm512_loadu_ps(are + n), ai = _mm512_loadu_ps(aim + n);
+        __m512 br = _mm512_loadu_ps(bre + n), bi = _mm512_loadu_ps(bim + n);
+        _mm512_storeu_ps(rre + n, _mm512_fmsub_ps(ar, br, _mm512_mul_ps(ai, bi)));
+        _mm512_storeu_ps(rim + n, _mm512_fmadd_ps(ar, bi, _mm512_mul_ps(ai, br)));
+    }
+    SplitComplexMul_Scalar(are + n, aim + n, bre + n, bim + n, rre + n, rim + n, numsamples - n);
+}
+
+SIMD_TARGET("avx512f")
+static void SplitComplexMulAdd_AVX512(const float* are, const float* aim, const float* bre, const float* bim, float* rre, float* rim, int numsamples)
+{
+    int n = 0;
+    for (; n <= numsamples - 16; n += 16)
+    {
+        __m512 ar = _mm512_loadu_ps(are + n), ai = _mm512_loadu_ps(aim + n);
+        __m512 br = _mm512_loadu_ps(bre + n), bi = _mm512_loadu_ps(bim + n);
+        __m512 re = _mm512_fmadd_ps(ar, br, _mm512_loadu_ps(rre + n));
+        __m512 im = _mm512_fmadd_ps(ar, bi, _mm512_loadu_ps(rim + n));
+        _mm512_storeu_ps(rre + n, _mm512_fnmadd_ps(ai, bi, re));
+        _mm512_storeu_ps(rim + n, _mm512_fmadd_ps(ai, br, im));
+    }
+    SplitComplexMulAdd_Scalar(are + n, aim + n, bre + n, bim + n, rre + n, rim + n, numsamples - n);
+}
+
+SIMD_TARGET("avx512f")
+static void Blend4_AVX512(const float* const* src, const float* weights, float* result, int numsamples)
+{
+    const float* s0 = src[0], *s1 = src[1], *s2 = src[2], *s3 = src[3];
+    __m512 w0 = _mm512_set1_ps(weights[0]), w1 = _mm512_set1_ps(weights[1]), w2 = _mm512_set1_ps(weights[2]), w3 = _mm512_set1_ps(weights[3]);
+    int n = 0;
+    for (; n <= numsamples - 16; n += 16)
+    {
+        __m512 a = _mm512_fmadd_ps(_mm512_loadu_ps(s1 + n), w1, _mm512_mul_ps(_mm512_loadu_ps(s0 + n), w0));
+        __m512 b = _mm512_fmadd_ps(_mm512_loadu_ps(s3 + n), w3, _mm512_mul_ps(_mm512_loadu_ps(s2 + n), w2));
+        _mm512_storeu_ps(result + n, _mm512_add_ps(a, b));
+    }
+    const float* tail[4] = { s0 + n, s1 + n, s2 + n, s3 + n };
+    Blend4_Scalar(tail, weights, result + n, numsamples - n);
+}
+
+SIMD_TARGET("avx512f")
+static void FIR_AVX512(const float* input, const float* coeffs, float* output, int numsamples, int numtaps)
+{
+    int n = 0;
+    for (; n <= numsamples - 16; n += 16)
+    {
+        __m512 sum = _mm512_setzero_ps();
+        for (int k = 0; k < numtaps; k++)
+            sum = _mm512_fmadd_ps(_mm512_set1_ps(coeffs[k]), _mm512_loadu_ps(input + n + k), sum);
+        _mm512_storeu_ps(output + n, sum);
+    }
+    FIR_Scalar(input + n, coeffs, output + n, numsamples - n, numtaps);
+}
+
+SIMD_TARGET("avx512f")
+static void SparseFIR_AVX512(const float* input, const int* offsets, const float* coeffs, float* output, int numsamples, int numtaps)
+{
+    int n = 0;
+    for (; n <= numsamples - 16; n += 16)
+    {
+        __m512 sum = _mm512_setzero_ps();
+        for (int k = 0; k < numtaps; k++)
+            sum = _mm512_fmadd_ps(_mm512_set1_ps(coeffs[k]), _mm512_loadu_ps(input + offsets[k] + n), sum);
+        _mm512_storeu_ps(output + n, sum);
+    }
+    SparseFIR_Scalar(input + n, offsets, coeffs, output + n, numsamples - n, numtaps);
+}
+
+
+// A third-order field (16 channels) fills exactly one register
+SIMD_TARGET("avx512f")
+static void SHEncode_AVX512(const float* input, const float* prevgains, const float* gains, float* output, int numsamples, int numchannels)
+{
+    const float fadestep = 1.0f / (float)numsamples;
+    const int numvector = numchannels & ~15;
+    for (int n = 0; n < numsamples; n++)
+    {
+        __m512 t = _mm512_set1_ps((float)(n + 1) * fadestep), x = _mm512_set1_ps(input[n]);
+        float* y = output + n * numchannels;
+        for (int k = 0; k < numvector; k += 16)
+        {
+            __m512 g0 = _mm512_loadu_ps(prevgains + k);
+            __m512 g = _mm512_fmadd_ps(_mm512_sub_ps(_mm512_loadu_ps(gains + k), g0), t, g0);
+            _mm512_storeu_ps(y + k, _mm512_fmadd_ps(g, x, _mm512_loadu_ps(y + k)));
+        }
+    }
+    SHEncodeChannels_Scalar(input, prevgains + numvector, gains + numvector, output + numvector, numsamples, numchannels - numvector, numchannels);
+}
+
+#endif
+
+enum
+{
+    SIMD_SSE = 1 << 0,
+    SIMD_AVX2 = 1 << 1,
+    SIMD_AVX512 = 1 << 2
+};
+
+static int DetectSIMDSupport()
+{
+    int support = SIMD_SSE; // SSE2 is part of the x64 baseline and required by all our 32-bit targets
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxleaf = info[0];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool fma = (info[2] & (1 << 12)) != 0;
+    if (osxsave && maxleaf >= 7)
+    {
+        unsigned long long xcr0 = _xgetbv(0);
+        __cpuidex(info, 7, 0);
+        if (fma && (info[1] & (1 << 5)) != 0 && (xcr0 & 0x06) == 0x06)
+            support |= SIMD_AVX2;
+        if ((info[1] & (1 << 16)) != 0 && (xcr0 & 0xE6) == 0xE6)
+            support |= SIMD_AVX512;
+    }
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        support |= SIMD_AVX2;
+    if (__builtin_cpu_supports("avx512f"))
+        support |= SIMD_AVX512;
+#endif
+    return support;
+}
+
+#endif
+
+struct SIMDKernels
+{
+    typedef void (*KernelFunc)(const float* are, const float* aim, const float* bre, const float* bim, float* rre, float* rim, int numsamples);
+    typedef void (*BlendFunc)(const float* const* src, const float* weights, float* result, int numsamples);
+    typedef void (*FIRFunc)(const float* input, const float* coeffs, float* output, int numsamples, int numtaps);
+    typedef void (*SparseFIRFunc)(const float* input, const int* offsets, const float* coeffs, float* output, int numsamples, int numtaps);
+    typedef void (*BiquadBankFunc)(const float* coeffs, float* state, const float* input, int stride, float* sumsq, float* output, int numsamples);
+    typedef void (*FDNFunc)(const float* coeffs, float* state, float* lines, float* feedback, int numsamples);
+    typedef void (*SHEncodeFunc)(const float* input, const float* prevgains, const float* gains, float* output, int numsamples, int numchannels);
+    KernelFunc mul;
+    KernelFunc muladd;
+    BlendFunc blend4;
+    FIRFunc fir;
+    SparseFIRFunc sparsefir;
+    BiquadBankFunc biquadbank;
+    FDNFunc fdn;
+    SHEncodeFunc shencode;
+    const char* name;
+};
+
+static const SIMDKernels simdKernelTable[] =
+{
+    { SplitComplexMul_Scalar, SplitComplexMulAdd_Scalar, Blend4_Scalar, FIR_Scalar, SparseFIR_Scalar, BiquadBank_Scalar, FDN_Scalar, SHEncode_Scalar, "Scalar" },
+#if ENABLE_SIMD_X86
+    { SplitComplexMul_SSE, SplitComplexMulAdd_SSE, Blend4_SSE, FIR_SSE, SparseFIR_SSE, BiquadBank_SSE, FDN_SSE, SHEncode_SSE, "SSE" },
+    { SplitComplexMul_AVX2, SplitComplexMulAdd_AVX2, Blend4_AVX2, FIR_AVX2, SparseFIR_AVX2, BiquadBank_AVX2, FDN_AVX2, SHEncode_AVX2, "AVX2" },
+#if ENABLE_SIMD_AVX512
+    { SplitComplexMul_AVX512, SplitComplexMulAdd_AVX512, Blend4_AVX512, FIR_AVX512, SparseFIR_AVX512, BiquadBank_AVX2, FDN_AVX2, SHEncode_AVX512, "AVX-512" },
+#endif
+#endif
+};
+
+// Number of entries in simdKernelTable that can run on this CPU
+static int GetNumSupportedSIMDKernels()
+{
+#if ENABLE_SIMD_X86
+    int support = DetectSIMDSupport();
+    if (!(support & SIMD_AVX2))
+        return 2;
+#if ENABLE_SIMD_AVX512
+    if (support & SIMD_AVX512)
+        return 4;
+#endif
+    return 3;
+#else
+    return 1;
+#endif
+}
+
+static const SIMDKernels& GetSIMDKernels()
+{
+    static const SIMDKernels& kernels = simdKernelTable[GetNumSupportedSIMDKernels() - 1];
+    return kernels;
+}
+
+void SplitComplex::Mul(const float* are, const float* aim, const float* bre, const float* bim, float* resultre, float* resultim, int numsamples)
+{
+    GetSIMDKernels().mul(are, aim, bre, bim, resultre, resultim, numsamples);
+}
+
+void SplitComplex::MulAdd(const float* are, const float* aim, const float* bre, const float* bim, float* resultre, float* resultim, int numsamples)
+{
+    GetSIMDKernels().muladd(are, aim, bre, bim, resultre, resultim, numsamples);
+}
+
+void SplitComplex::Blend4(const float* const* src, const float* weights, float* result, int numsamples)
+{
+    GetSIMDKernels().blend4(src, weights, result, numsamples);
+}
+
+void SplitComplex::Deinterleave(const UnityComplexNumber* src, float* re, float* im, int numsamples)
+{
+    for (int n = 0; n < numsamples; n++)
+    {
+        re[n] = src[n].re;
+        im[n] = src[n].im;
+    }
+}
+
+void SplitComplex::Interleave(const float* re, const float* im, UnityComplexNumber* dst, int numsamples)
+{
+    for (int n = 0; n < numsamples; n++)
+    {
+        dst[n].re = re[n];
+        dst[n].im = im[n];
+    }
+}
+
+void FIR::Correlate(const float* input, const float* coeffs, float* output, int numsamples, int numtaps)
+{
+    GetSIMDKernels().fir(input, coeffs, output, numsamples, numtaps);
+}
+
+void FIR::SparseCorrelate(const float* input, const int* offsets, const float* coeffs, float* output, int numsamples, int numtaps)
+{
+    GetSIMDKernels().sparsefir(input, offsets, coeffs, output, numsamples, numtaps);
+}
+
+void FIR::DesignLowpass(float* coeffs, int numtaps, float cutoff)
+{
+    const double center = 0.5 * (double)(numtaps - 1);
+    double sum = 0.0;
+    for (int k = 0; k < numtaps; k++)
+    {
+        double t = (double)k - center;
+        double sinc = (fabs(t) < 1.0e-9) ? 2.0 * cutoff : sin(2.0 * kPI_double * cutoff * t) / (kPI_double * t);
+        double phase = 2.0 * kPI_double * (double)k / (double)(numtaps - 1);
+        double window = 0.42 - 0.5 * cos(phase) + 0.08 * cos(2.0 * phase);
+        coeffs[k] = (float)(sinc * window);
+        sum += coeffs[k];
+    }
+    for (int k = 0; k < numtaps; k++)
+        coeffs[k] = (float)(coeffs[k] / sum);
+}
+
+const char* SplitComplex::GetInstructionSetName()
+{
+    return GetSIMDKernels().name;
+}
+
+void OctaveFilterBank::Setup(float samplerate)
+{
+    BiquadFilter filter;
+    filter.SetupLowpass(63.0f, samplerate, 1.0f);
+    SetupBand(0, filter);
+    for (int b = 1; b < NUMBANDS - 1; b++)
+    {
+        filter.SetupBandpass(125.0f * (float)(1 << (b - 1)), samplerate, 1.0f);
+        SetupBand(b, filter);
+    }
+    filter.SetupHighpass(8000.0f, samplerate, 1.0f);
+    SetupBand(NUMBANDS - 1, filter);
+}
+
+void OctaveFilterBank::SetupBand(int band, BiquadFilter filter)
+{
+    float c[5], *p = c;
+    filter.StoreCoeffs(p); // b2, b1, b0, a2, a1
+    coeffs[0][band] = c[4];
+    coeffs[1][band] = c[3];
+    coeffs[2][band] = c[2];
+    coeffs[3][band] = c[1];
+    coeffs[4][band] = c[0];
+}
+
+void OctaveFilterBank::Reset()
+{
+    memset(state, 0, sizeof(state));
+}
+
+void OctaveFilterBank::Process(const float* input, int stride, float* rms, float* output, int numsamples)
+{
+    float sumsq[NUMBANDS] = { 0.0f };
+    GetSIMDKernels().biquadbank(coeffs[0], state[0], input, stride, sumsq, output, numsamples);
+    float scale = (numsamples > 0) ? 1.0f / (float)numsamples : 0.0f;
+    for (int b = 0; b < NUMBANDS; b++)
+        rms[b] = sqrtf(sumsq[b] * scale);
+}
+
+float OctaveFilterBank::GetPowerResponse(int band, float w) const
+{
+    float c1 = cosf(w), s1 = sinf(w), c2 = cosf(2.0f * w), s2 = sinf(2.0f * w);
+    float nre = coeffs[2][band] + coeffs[3][band] * c1 + coeffs[4][band] * c2;
+    float nim = coeffs[3][band] * s1 + coeffs[4][band] * s2;
+    float dre = 1.0f + coeffs[0][band] * c1 + coeffs[1][band] * c2;
+    float dim = coeffs[0][band] * s1 + coeffs[1][band] * s2;
+    return (nre * nre + nim * nim) / (dre * dre + dim * dim);
+}
+
+void BandEnergyAnalyzer::Cleanup()
+{
+    delete[] weights;
+    weights = NULL;
+}
+
+void BandEnergyAnalyzer::Init(int fftsize, float samplerate)
+{
+    Cleanup();
+    const int numbins = fftsize / 2 + 1;
+    weights = new float[numbins * NUMBANDS];
+    this->fftsize = fftsize;
+    this->samplerate = samplerate;
+    OctaveFilterBank bank;
+    bank.Setup(samplerate);
+    for (int k = 0; k < numbins; k++)
+        for (int b = 0; b < NUMBANDS; b++)
+            weights[k * NUMBANDS + b] = bank.GetPowerResponse(b, 2.0f * kPI * (float)k / (float)fftsize);
+}
+
+void BandEnergyAnalyzer::Process(const float* re, const float* im, int fftsize, int numsamples, float* rms)
+{
+    float sum[NUMBANDS] = { 0.0f };
+    if (weights != NULL && fftsize <= this->fftsize && (this->fftsize % fftsize) == 0)
+    {
+        // Parseval: the energy of the filtered block is the sum of the weighted bin powers divided by fftsize. Bins other than DC
+        // and Nyquist also stand for their negative frequency mirror, so they count twice. Bin k of a smaller transform has
+        // the frequency of bin k * stride of the one the weights were made for.
+        const int numbins = fftsize / 2 + 1;
+        const int stride = this->fftsize / fftsize;
+        for (int k = 0; k < numbins; k++)
+        {
+            float power = (re[k] * re[k] + im[k] * im[k]) * ((k == 0 || k == numbins - 1) ? 1.0f : 2.0f);
+            const float* w = weights + k * stride * NUMBANDS;
+            for (int b = 0; b < NUMBANDS; b++)
+                sum[b] += power * w[b];
+        }
+    }
+    float scale = (numsamples > 0) ? 1.0f / ((float)numsamples * (float)fftsize) : 0.0f;
+    for (int b = 0; b < NUMBANDS; b++)
+        rms[b] = sqrtf(sum[b] * scale);
+}
+
+static bool IsPrime(int n)
+{
+    if (n < 2)
+        return false;
+    for (int d = 2; d * d <= n; d++)
+        if (n % d == 0)
+            return false;
+    return true;
+}
+
+void FeedbackDelayNetwork::Init(float samplerate)
+{
+    Cleanup();
+    this->samplerate = samplerate;
+    writepos = 0;
+    memset(decay, 0, sizeof(decay));
+    memset(state, 0, sizeof(state));
+    for (int i = 0; i < NUMLINES; i++)
+    {
+        // Lengths spread geometrically from 20 to 60 ms and moved up to the next prime, so that no two lines share a period
+        int len = (int)(samplerate * 0.02f * powf(3.0f, (float)i / (float)(NUMLINES - 1)));
+        if (len < CHUNK)
+            len = CHUNK;
+        while (!IsPrime(len))
+            len++;
+        int size = 1;
+        while (size < len)
+            size *= 2;
+        length[i] = len;
+        mask[i] = size - 1;
+        data[i] = (float*)MemoryPool::Allocate(sizeof(float) * size);
+    }
+}
+
+void FeedbackDelayNetwork::Cleanup()
+{
+    for (int i = 0; i < NUMLINES; i++)
+    {
+        MemoryPool::Free(data[i]);
+        data[i] = NULL;
+    }
+}
+
+void FeedbackDelayNetwork::SetDecayTimes(const float* t60)
+{
+    if (memcmp(decay, t60, sizeof(decay)) == 0)
+        return;
+    memcpy(decay, t60, sizeof(decay));
+
+    // First-order shelves (bilinear transform, prewarped) with the transition centered on the crossover frequency
+    const float klow = tanf(kPI * 350.0f / samplerate), khigh = tanf(kPI * 2800.0f / samplerate);
+    for (int i = 0; i < NUMLINES; i++)
+    {
+        // Gain per pass through the line that adds up to 60 dB of attenuation after t60 seconds
+        float g[NUMBANDS];
+        for (int b = 0; b < NUMBANDS; b++)
+            g[b] = powf(10.0f, -3.0f * (float)length[i] / (FastMax(t60[b], 0.01f) * samplerate));
+
+        // Low shelf going from the low band gain to unity, relative to the mid band gain
+        float s = sqrtf(g[0] / g[1]), a0 = 1.0f + klow / s;
+        coeffs[0][i] = (1.0f + klow * s) / a0;
+        coeffs[1][i] = (klow * s - 1.0f) / a0;
+        coeffs[2][i] = (klow / s - 1.0f) / a0;
+
+        // High shelf going from the mid band gain to the high band gain
+        s = sqrtf(g[2] / g[1]);
+        a0 = 1.0f + khigh * s;
+        coeffs[3][i] = g[1] * s * (s + khigh) / a0;
+        coeffs[4][i] = g[1] * s * (khigh - s) / a0;
+        coeffs[5][i] = (khigh * s - 1.0f) / a0;
+    }
+}
+
+void FeedbackDelayNetwork::Process(const float* input, float* output, int numsamples)
+{
+    // Each channel feeds and is read from eight lines
+    const float gain = 0.35355339f;
+    for (int offset = 0; offset < numsamples; offset += CHUNK)
+    {
+        const int num = (numsamples - offset < CHUNK) ? (numsamples - offset) : CHUNK;
+
+        // No line is shorter than CHUNK, so the whole chunk can be read before anything is written back
+        for (int i = 0; i < NUMLINES; i++)
+        {
+            const float* src = data[i];
+            const int readpos = writepos - length[i], m = mask[i];
+            for (int n = 0; n < num; n++)
+                lines[n * NUMLINES + i] = src[(readpos + n) & m];
+        }
+
+        GetSIMDKernels().fdn(coeffs[0], state[0], lines, feedback, num);
+
+        for (int n = 0; n < num; n++)
+        {
+            const float* x = lines + n * NUMLINES;
+            float* y = feedback + n * NUMLINES;
+            const float inl = input[(offset + n) * 2] * gain, inr = input[(offset + n) * 2 + 1] * gain;
+            float outl = 0.0f, outr = 0.0f;
+            for (int i = 0; i < NUMLINES; i += 4)
+            {
+                // Alternating polarities keep the lines from starting out in phase
+                outl += x[i] - x[i + 2];
+                outr += x[i + 1] - x[i + 3];
+                y[i] += inl;
+                y[i + 1] += inr;
+                y[i + 2] -= inl;
+                y[i + 3] -= inr;
+            }
+            output[(offset + n) * 2] = outl * gain;
+            output[(offset + n) * 2 + 1] = outr * gain;
+        }
+
+        for (int i = 0; i < NUMLINES; i++)
+        {
+            float* dst = data[i];
+            const int m = mask[i];
+            for (int n = 0; n < num; n++)
+                dst[(writepos + n) & m] = feedback[n * NUMLINES + i];
+        }
+
+        // The last line is the longest, so its mask wraps the position without disturbing the shorter lines
+        writepos = (writepos + num) & mask[NUMLINES - 1];
+    }
+}
+
+void PartitionedConvolver::Init(int blocksize, int maxlength, int numchannels)
+{
+    Cleanup();
+    const int fftsize = blocksize * 2;
+    this->blocksize = blocksize;
+    this->numchannels = numchannels;
+    numpartitions = (maxlength + blocksize - 1) / blocksize;
+    if (numpartitions < 1)
+        numpartitions = 1;
+    numactive = 0;
+    fdlpos = 0;
+    const int numaccumulators = (numchannels + 1) & ~1; // An odd channel is paired with a silent one
+    buffer = new float[fftsize];
+    spectra = new float[numchannels * numpartitions * fftsize * 2];
+    fdl = new float[numpartitions * fftsize * 2];
+    acc = new float[numaccumulators * fftsize * 2];
+    work = new UnityComplexNumber[fftsize];
+    memset(buffer, 0, sizeof(float) * fftsize);
+    memset(fdl, 0, sizeof(float) * numpartitions * fftsize * 2);
+    memset(acc, 0, sizeof(float) * numaccumulators * fftsize * 2);
+    FFT::Prepare(fftsize);
+}
+
+void PartitionedConvolver::Cleanup()
+{
+    delete[] buffer;
+    delete[] spectra;
+    delete[] fdl;
+    delete[] acc;
+    delete[] work;
+    buffer = NULL;
+    spectra = NULL;
+    fdl = NULL;
+    acc = NULL;
+    work = NULL;
+}
+
+void PartitionedConvolver::SetImpulseResponse(const float* left, const float* right, int length)
+{
+    const float* responses[2] = { left, right };
+    SetImpulseResponses(responses, length);
+}
+
+void PartitionedConvolver::SetImpulseResponses(const float* const* responses, int length)
+{
+    numactive = PrepareSpectra(responses, length, spectra, work);
+}
+
+int PartitionedConvolver::GetSpectraSize() const
+{
+    return numchannels * numpartitions * blocksize * 4;
+}
+
+int PartitionedConvolver::PrepareSpectra(const float* const* responses, int length, float* result, UnityComplexNumber* work) const
+{
+    const int fftsize = blocksize * 2;
+    if (length > numpartitions * blocksize)
+        length = numpartitions * blocksize;
+    const int numprepared = (length + blocksize - 1) / blocksize;
+    float* scratch = (float*)(work + blocksize); // ForwardReal only uses the lower half of work
+    for (int c = 0; c < numchannels; c++)
+    {
+        const float* ir = responses[c];
+        for (int p = 0; p < numprepared; p++)
+        {
+            int num = length - p * blocksize;
+            if (num > blocksize)
+                num = blocksize;
+            memcpy(scratch, ir + p * blocksize, sizeof(float) * num);
+            memset(scratch + num, 0, sizeof(float) * (fftsize - num));
+            float* h = result + (c * numpartitions + p) * fftsize * 2;
+            FFT::ForwardReal(scratch, work, h, h + fftsize, fftsize);
+        }
+    }
+    return numprepared;
+}
+
+float* PartitionedConvolver::SwapSpectra(float* prepared, int numprepared)
+{
+    float* previous = spectra;
+    spectra = prepared;
+    numactive = numprepared;
+    return previous;
+}
+
+void PartitionedConvolver::Process(const float* input, float* left, float* right)
+{
+    float* outputs[2] = { left, right };
+    Process(input, outputs);
+}
+
+void PartitionedConvolver::Process(const float* input, float* const* outputs)
+{
+    const int fftsize = blocksize * 2;
+    memcpy(buffer, buffer + blocksize, sizeof(float) * blocksize);
+    memcpy(buffer + blocksize, input, sizeof(float) * blocksize);
+    float* x = fdl + fdlpos * fftsize * 2;
+    FFT::ForwardReal(buffer, work, x, x + fftsize, fftsize);
+
+    memset(acc, 0, sizeof(float) * numchannels * fftsize * 2);
+    for (int c = 0; c < numchannels; c++)
+    {
+        float* yre = acc + c * fftsize * 2, *yim = yre + fftsize;
+        for (int p = 0; p < numactive; p++)
+        {
+            const float* xp = fdl + ((fdlpos - p + numpartitions) % numpartitions) * fftsize * 2;
+            const float* h = spectra + (c * numpartitions + p) * fftsize * 2;
+            SplitComplex::MulAdd(xp, xp + fftsize, h, h + fftsize, yre, yim, fftsize);
+        }
+    }
+    fdlpos = (fdlpos + 1) % numpartitions;
+
+    // Two channels share each inverse transform
+    for (int c = 0; c < numchannels; c += 2)
+    {
+        const float* a = acc + c * fftsize * 2;
+        const float* b = a + fftsize * 2;
+        FFT::MergeStereo(a, a + fftsize, b, b + fftsize, work, fftsize);
+        FFT::Backward(work, fftsize, false);
+        float* left = outputs[c];
+        for (int n = 0; n < blocksize; n++)
+            left[n] = work[blocksize + n].re;
+        if (c + 1 < numchannels)
+        {
+            float* right = outputs[c + 1];
+            for (int n = 0; n < blocksize; n++)
+                right[n] = work[blocksize + n].im;
+        }
+    }
+}
+
+void SphericalHarmonics::Evaluate(int order, float x, float y, float z, float* result)
+{
+    result[0] = 1.0f;
+    if (order < 1)
+        return;
+    const float s3 = 1.7320508f;
+    result[1] = s3 * y;
+    result[2] = s3 * z;
+    result[3] = s3 * x;
+    if (order < 2)
+        return;
+    const float s15 = 3.8729833f, s5 = 2.2360680f;
+    result[4] = s15 * x * y;
+    result[5] = s15 * y * z;
+    result[6] = 0.5f * s5 * (3.0f * z * z - 1.0f);
+    result[7] = s15 * x * z;
+    result[8] = 0.5f * s15 * (x * x - y * y);
+    if (order < 3)
+        return;
+    const float s35_8 = 2.0916500f, s105 = 10.2469508f, s21_8 = 1.6201852f, s7 = 2.6457513f;
+    result[9] = s35_8 * y * (3.0f * x * x - y * y);
+    result[10] = s105 * x * y * z;
+    result[11] = s21_8 * y * (5.0f * z * z - 1.0f);
+    result[12] = 0.5f * s7 * z * (5.0f * z * z - 3.0f);
+    result[13] = s21_8 * x * (5.0f * z * z - 1.0f);
+    result[14] = 0.5f * s105 * z * (x * x - y * y);
+    result[15] = s35_8 * x * (x * x - 3.0f * y * y);
+}
+
+void SphericalHarmonics::Encode(const float* input, const float* prevgains, const float* gains, float* output, int numsamples, int numchannels)
+{
+    GetSIMDKernels().shencode(input, prevgains, gains, output, numsamples, numchannels);
+}
+
+// Element (m, n) of the block of order l, with m and n running from -l to l
+static inline float GetSHRotationElement(const SHRotation& r, int l, int m, int n)
+{
+    return r.matrix[l * l + l + m][l * l + l + n];
+}
+
+// The P term of the recursion: combines the order 1 block with the block of order l - 1
+static float GetSHRotationP(const SHRotation& r, int i, int l, int a, int b)
+{
+    const float ri1 = GetSHRotationElement(r, 1, i, 1);
+    const float rim1 = GetSHRotationElement(r, 1, i, -1);
+    if (b == l)
+        return ri1 * GetSHRotationElement(r, l - 1, a, l - 1) - rim1 * GetSHRotationElement(r, l - 1, a, -l + 1);
+    if (b == -l)
+        return ri1 * GetSHRotationElement(r, l - 1, a, -l + 1) + rim1 * GetSHRotationElement(r, l - 1, a, l - 1);
+    return GetSHRotationElement(r, 1, i, 0) * GetSHRotationElement(r, l - 1, a, b);
+}
+
+void SHRotation::Setup(int order, const float* rotation)
+{
+    this->order = order;
+    memset(matrix, 0, sizeof(matrix));
+    matrix[0][0] = 1.0f;
+    if (order < 1)
+        return;
+
+    // The order 1 channels are y, z and x
+    static const int axis[3] = { 1, 2, 0 };
+    for (int m = 0; m < 3; m++)
+        for (int n = 0; n < 3; n++)
+            matrix[1 + m][1 + n] = rotation[axis[m] * 3 + axis[n]];
+
+    for (int l = 2; l <= order; l++)
+    {
+        for (int m = -l; m <= l; m++)
+        {
+            const int am = (m < 0) ? -m : m;
+            for (int n = -l; n <= l; n++)
+            {
+                const float d = (n == l || n == -l) ? (float)(2 * l * (2 * l - 1)) : (float)((l + n) * (l - n));
+                const float u = sqrtf((float)((l + m) * (l - m)) / d);
+                float v = 0.5f * sqrtf((float)((m == 0 ? 2 : 1) * (l + am - 1) * (l + am)) / d) * ((m == 0) ? -1.0f : 1.0f);
+                float w = (m == 0) ? 0.0f : -0.5f * sqrtf((float)((l - am - 1) * (l - am)) / d);
+
+                float sum = 0.0f;
+                if (u != 0.0f)
+                    sum += u * GetSHRotationP(*this, 0, l, m, n);
+                if (v != 0.0f)
+                {
+                    float V;
+                    if (m == 0)
+                        V = GetSHRotationP(*this, 1, l, 1, n) + GetSHRotationP(*this, -1, l, -1, n);
+                    else if (m > 0)
+                        V = GetSHRotationP(*this, 1, l, m - 1, n) * ((m == 1) ? 1.4142136f : 1.0f) - ((m == 1) ? 0.0f : GetSHRotationP(*this, -1, l, -m + 1, n));
+                    else
+                        V = ((m == -1) ? 0.0f : GetSHRotationP(*this, 1, l, m + 1, n)) + GetSHRotationP(*this, -1, l, -m - 1, n) * ((m == -1) ? 1.4142136f : 1.0f);
+                    sum += v * V;
+                }
+                if (w != 0.0f)
+                {
+                    float W;
+                    if (m > 0)
+                        W = GetSHRotationP(*this, 1, l, m + 1, n) + GetSHRotationP(*this, -1, l, -m - 1, n);
+                    else
+                        W = GetSHRotationP(*this, 1, l, m - 1, n) - GetSHRotationP(*this, -1, l, -m + 1, n);
+                    sum += w * W;
+                }
+                matrix[l * l + l + m][l * l + l + n] = sum;
+            }
+        }
+    }
+}
+
+void SHRotation::Process(const float* input, float* output, int numframes, const SHRotation* previous) const
+{
+    const int numchannels = SphericalHarmonics::GetNumChannels(order);
+    const float fadestep = 1.0f / (float)numframes;
+    for (int i = 0; i < numframes; i++)
+    {
+        const float* x = input + i * numchannels;
+        float* y = output + i * numchannels;
+        const float t = (float)(i + 1) * fadestep;
+        y[0] = x[0];
+        for (int l = 1; l <= order; l++)
+        {
+            const int first = l * l, last = first + 2 * l;
+            for (int m = first; m <= last; m++)
+            {
+                float sum = 0.0f;
+                if (previous != NULL)
+                    for (int n = first; n <= last; n++)
+                        sum += (previous->matrix[m][n] + (matrix[m][n] - previous->matrix[m][n]) * t) * x[n];
+                else
+                    for (int n = first; n <= last; n++)
+                        sum += matrix[m][n] * x[n];
+                y[m] = sum;
+            }
+        }
+    }
+}
+
 void FFTAnalyzer::Cleanup()
 {
     delete[] window;
@@ -321,6 +1660,262 @@ void Mutex::Unlock()
 #endif
 }
 
+struct MemoryPoolState
+{
+    enum { NUMCLASSES = 256, HEADERSIZE = 16 };
+
+    // Eight classes per octave starting at 16 bytes, so that at most 1/8 of a block is wasted
+    static size_t GetClassSize(int sizeclass) { return (size_t)(8 + (sizeclass & 7)) << ((sizeclass >> 3) + 1); }
+
+    Mutex mutex;
+    void* freelist[NUMCLASSES];     // Linked through the first bytes of each free block
+    size_t used;
+    size_t pooled;
+};
+
+static MemoryPoolState& GetMemoryPoolState()
+{
+    static MemoryPoolState state;
+    return state;
+}
+
+void* MemoryPool::Allocate(size_t size)
+{
+    MemoryPoolState& pool = GetMemoryPoolState();
+    int sizeclass = 0;
+    while (MemoryPoolState::GetClassSize(sizeclass) < size)
+        sizeclass++;
+    const size_t blocksize = MemoryPoolState::GetClassSize(sizeclass);
+
+    // The size class is stored in a header in front of the block, so that Free does not need to be told the size
+    char* block = NULL;
+    {
+        MutexScopeLock lock(pool.mutex);
+        if (pool.freelist[sizeclass] != NULL)
+        {
+            block = (char*)pool.freelist[sizeclass];
+            pool.freelist[sizeclass] = *(void**)(block + MemoryPoolState::HEADERSIZE);
+            pool.pooled -= blocksize;
+        }
+        pool.used += blocksize;
+    }
+    if (block == NULL)
+    {
+        block = (char*)malloc(blocksize + MemoryPoolState::HEADERSIZE);
+        *(int*)block = sizeclass;
+    }
+    memset(block + MemoryPoolState::HEADERSIZE, 0, blocksize);
+    return block + MemoryPoolState::HEADERSIZE;
+}
+
+void MemoryPool::Free(void* ptr)
+{
+    if (ptr == NULL)
+        return;
+    MemoryPoolState& pool = GetMemoryPoolState();
+    char* block = (char*)ptr - MemoryPoolState::HEADERSIZE;
+    const int sizeclass = *(int*)block;
+    const size_t blocksize = MemoryPoolState::GetClassSize(sizeclass);
+    MutexScopeLock lock(pool.mutex);
+    *(void**)ptr = pool.freelist[sizeclass];
+    pool.freelist[sizeclass] = block;
+    pool.used -= blocksize;
+    pool.pooled += blocksize;
+}
+
+void MemoryPool::GetStats(size_t& used, size_t& pooled)
+{
+    MemoryPoolState& pool = GetMemoryPoolState();
+    MutexScopeLock lock(pool.mutex);
+    used = pool.used;
+    pooled = pool.pooled;
+}
+
+// Index of the calling thread among the threads that currently send to any bus, one bit per slot in use. A thread claims the
+// lowest free slot on its first send and gives it back when it exits.
+static std::atomic<unsigned int> sendbusslotsused(0);
+
+struct SendBusThreadSlot
+{
+    int index;
+
+    SendBusThreadSlot() : index(-1) {}
+
+    ~SendBusThreadSlot()
+    {
+        if (index >= 0)
+            sendbusslotsused.fetch_and(~(1u << index), std::memory_order_release);
+    }
+
+    // Returns -1 while all slots are taken
+    int Get()
+    {
+        if (index >= 0)
+            return index;
+        unsigned int used = sendbusslotsused.load(std::memory_order_relaxed);
+        for (int i = 0; i < SendBus::MAXTHREADS; )
+        {
+            if ((used & (1u << i)) != 0)
+                i++;
+            else if (sendbusslotsused.compare_exchange_weak(used, used | (1u << i), std::memory_order_acquire, std::memory_order_relaxed))
+                return index = i;
+            else
+                i = 0; // used has been reloaded
+        }
+        return -1;
+    }
+};
+
+static thread_local SendBusThreadSlot sendbusslot;
+
+SendBus::SendBus(int numchannels)
+    : numchannels(numchannels)
+{
+    for (int s = 0; s < MAXTHREADS; s++)
+    {
+        for (int i = 0; i < NUMFRAMES; i++)
+        {
+            Frame& f = slots[s].frames[i];
+            f.state.store(FREE, std::memory_order_relaxed);
+            f.tick = 0;
+            f.length = 0;
+            f.capacity = 0;
+            f.data = NULL;
+        }
+        slots[s].current = -1;
+    }
+}
+
+SendBus::~SendBus()
+{
+    for (int s = 0; s < MAXTHREADS; s++)
+        for (int i = 0; i < NUMFRAMES; i++)
+            delete[] slots[s].frames[i].data;
+}
+
+void SendBus::Reserve(int length)
+{
+    for (int s = 0; s < MAXTHREADS; s++)
+    {
+        for (int i = 0; i < NUMFRAMES; i++)
+        {
+            // Take the buffer from whichever side holds it, waiting while a sender or the receiver is using it
+            Frame& f = slots[s].frames[i];
+            int state;
+            for (;;)
+            {
+                state = f.state.load(std::memory_order_relaxed);
+                int expected = state;
+                if (state != BUSY && f.state.compare_exchange_weak(expected, BUSY, std::memory_order_acquire))
+                    break;
+                std::this_thread::yield();
+            }
+            if (length > f.capacity)
+            {
+                float* data = new float[length * numchannels];
+                memset(data, 0, sizeof(float) * length * numchannels);
+                if (f.data != NULL)
+                    memcpy(data, f.data, sizeof(float) * f.length * numchannels);
+                delete[] f.data;
+                f.data = data;
+                f.capacity = length;
+            }
+            f.state.store(state, std::memory_order_release);
+        }
+    }
+}
+
+float* SendBus::BeginSend(UInt64 tick, int length)
+{
+    const int index = sendbusslot.Get();
+    if (index < 0)
+        return NULL;
+
+    // Keep adding to the buffer of this block while the receiver has not taken it, otherwise start a new one
+    Slot& slot = slots[index];
+    slot.current = -1;
+    for (int i = 0; i < NUMFRAMES && slot.current < 0; i++)
+    {
+        Frame& f = slot.frames[i];
+        int expected = READY;
+        if (f.tick == tick && f.state.load(std::memory_order_relaxed) == READY &&
+            f.state.compare_exchange_strong(expected, BUSY, std::memory_order_acquire))
+            slot.current = i;
+    }
+    for (int i = 0; i < NUMFRAMES && slot.current < 0; i++)
+    {
+        Frame& f = slot.frames[i];
+        int expected = FREE;
+        if (f.state.compare_exchange_strong(expected, BUSY, std::memory_order_acquire))
+        {
+            f.tick = tick;
+            f.length = 0;
+            slot.current = i;
+        }
+    }
+    if (slot.current < 0)
+        return NULL;
+
+    Frame& f = slot.frames[slot.current];
+    if (length > f.capacity)
+    {
+        // Nothing has been reserved for blocks this long, so the send is dropped
+        f.state.store((f.length > 0) ? READY : FREE, std::memory_order_release);
+        slot.current = -1;
+        return NULL;
+    }
+    if (length > f.length)
+        f.length = length;
+    return f.data;
+}
+
+void SendBus::EndSend()
+{
+    const int index = sendbusslot.index;
+    if (index < 0)
+        return;
+    Slot& slot = slots[index];
+    if (slot.current >= 0)
+        slot.frames[slot.current].state.store(READY, std::memory_order_release);
+    slot.current = -1;
+}
+
+void SendBus::Receive(UInt64 tick, float* output, int length)
+{
+    for (int s = 0; s < MAXTHREADS; s++)
+    {
+        for (int i = 0; i < NUMFRAMES; i++)
+        {
+            Frame& f = slots[s].frames[i];
+            int expected = READY;
+            if (f.state.load(std::memory_order_relaxed) != READY ||
+                !f.state.compare_exchange_strong(expected, BUSY, std::memory_order_acquire))
+                continue;
+            if (f.tick > tick)
+            {
+                f.state.store(READY, std::memory_order_release);
+                continue;
+            }
+            const int n = ((f.length < length) ? f.length : length) * numchannels;
+            for (int k = 0; k < n; k++)
+                output[k] += f.data[k];
+            if (f.length > length)
+            {
+                // The rest starts where the next block of the receiver does
+                const int rest = (f.length - length) * numchannels;
+                memmove(f.data, f.data + n, sizeof(float) * rest);
+                memset(f.data + rest, 0, sizeof(float) * n);
+                f.tick += length;
+                f.length -= length;
+                f.state.store(READY, std::memory_order_release);
+                continue;
+            }
+            memset(f.data, 0, sizeof(float) * f.length * numchannels);
+            f.state.store(FREE, std::memory_order_release);
+        }
+    }
+}
+
 void RegisterParameter(
     UnityAudioEffectDefinition& definition,
     const char* name,
@@ -392,6 +1987,8 @@ void DeclareEffect(
     registereffectdefcallback(definition);
 }
 
+#if ENABLE_EFFECTS
+
 #if UNITY_PS3
     #define DECLARE_EFFECT(namestr,ns) \
     extern char _binary_spu_ ## ns ## _spu_elf_start[];
@@ -454,6 +2051,8 @@ extern "C" UNITY_AUDIODSP_EXPORT_API int UnityGetAudioEffectDefinitions(UnityAud
     return numeffects;
 }
 
+#endif // ENABLE_EFFECTS
+
 // Simplistic unit-test framework
 #if ENABLE_TESTS
 	#define NAP_TESTSUITE(name)\
@@ -526,4 +2125,727 @@ NAP_TESTSUITE(FFT)
 			}
 		}
 	}
+
+	NAP_UNITTEST(StereoPacking)
+	{
+		Random r;
+		const int num = 1024;
+		UnityComplexNumber* x1 = new UnityComplexNumber [num];
+		UnityComplexNumber* x2 = new UnityComplexNumber [num];
+		UnityComplexNumber* packed = new UnityComplexNumber [num];
+		float* s = new float [num * 4];
+		float* re1 = s, *im1 = s + num, *re2 = s + num * 2, *im2 = s + num * 3;
+		
+		for (int n = 0; n < num; n++)
+		{
+			x1[n].Set(r.GetFloat(-1.0f, 1.0f), 0.0f);
+			x2[n].Set(r.GetFloat(-1.0f, 1.0f), 0.0f);
+			packed[n].Set(x1[n].re, x2[n].re);
+		}
+		
+		FFT::Forward (x1, num, false);
+		FFT::Forward (x2, num, false);
+		FFT::Forward (packed, num, false);
+		FFT::SplitStereo (packed, re1, im1, re2, im2, num);
+		
+		const float errtol = 1.0e-3f;
+		for (int n = 0; n < num; n++)
+		{
+			NAP_CHECK (fabsf (re1[n] - x1[n].re) < errtol && fabsf (im1[n] - x1[n].im) < errtol);
+			NAP_CHECK (fabsf (re2[n] - x2[n].re) < errtol && fabsf (im2[n] - x2[n].im) < errtol);
+		}
+		
+		FFT::MergeStereo (re1, im1, re2, im2, packed, num);
+		FFT::Backward (packed, num, false);
+		FFT::Backward (x1, num, false);
+		FFT::Backward (x2, num, false);
+		
+		for (int n = 0; n < num; n++)
+		{
+			NAP_CHECK (fabsf (packed[n].re - x1[n].re) < errtol);
+			NAP_CHECK (fabsf (packed[n].im - x2[n].re) < errtol);
+		}
+		
+		delete[] x1;
+		delete[] x2;
+		delete[] packed;
+		delete[] s;
+	}
+	
+	NAP_UNITTEST(RealTransform)
+	{
+		Random r;
+		const int num = 1024;
+		UnityComplexNumber* x = new UnityComplexNumber [num];
+		UnityComplexNumber* work = new UnityComplexNumber [num / 2];
+		float* s = new float [num * 3];
+		float* input = s, *re = s + num, *im = s + num * 2;
+		
+		for (int n = 0; n < num; n++)
+		{
+			input[n] = r.GetFloat(-1.0f, 1.0f);
+			x[n].Set(input[n], 0.0f);
+		}
+		
+		FFT::Forward (x, num, false);
+		FFT::ForwardReal (input, work, re, im, num);
+		
+		const float errtol = 1.0e-3f;
+		for (int n = 0; n < num; n++)
+			NAP_CHECK (fabsf (re[n] - x[n].re) < errtol && fabsf (im[n] - x[n].im) < errtol);
+		
+		delete[] x;
+		delete[] work;
+		delete[] s;
+	}
+}
+
+NAP_TESTSUITE(SplitComplex)
+{
+	NAP_UNITTEST(KernelsMatchScalar)
+	{
+		Random r;
+		const int num = 1027; // Not a multiple of the vector width, so that the scalar tails are exercised as well
+		float* buf = new float [num * 8];
+		float* are = buf, *aim = buf + num, *bre = buf + num * 2, *bim = buf + num * 3;
+		float* refre = buf + num * 4, *refim = buf + num * 5, *re = buf + num * 6, *im = buf + num * 7;
+		for (int n = 0; n < num * 4; n++)
+			buf[n] = r.GetFloat(-1.0f, 1.0f);
+		
+		for (int k = 0; k < GetNumSupportedSIMDKernels(); k++)
+		{
+			const SIMDKernels& kernels = simdKernelTable[k];
+			
+			SplitComplexMul_Scalar(are, aim, bre, bim, refre, refim, num);
+			kernels.mul(are, aim, bre, bim, re, im, num);
+			for (int n = 0; n < num; n++)
+				NAP_CHECK (fabsf (re[n] - refre[n]) < 1.0e-5f && fabsf (im[n] - refim[n]) < 1.0e-5f);
+			
+			SplitComplexMulAdd_Scalar(are, aim, bre, bim, refre, refim, num);
+			kernels.muladd(are, aim, bre, bim, re, im, num);
+			for (int n = 0; n < num; n++)
+				NAP_CHECK (fabsf (re[n] - refre[n]) < 1.0e-5f && fabsf (im[n] - refim[n]) < 1.0e-5f);
+			
+			const float* src[4] = { are, aim, bre, bim };
+			const float weights[4] = { 0.1f, 0.2f, 0.3f, 0.4f };
+			Blend4_Scalar(src, weights, refre, num);
+			kernels.blend4(src, weights, re, num);
+			for (int n = 0; n < num; n++)
+				NAP_CHECK (fabsf (re[n] - refre[n]) < 1.0e-5f);
+			
+			const int numtaps = 37;
+			FIR_Scalar(are, aim, refre, num - numtaps, numtaps);
+			kernels.fir(are, aim, re, num - numtaps, numtaps);
+			for (int n = 0; n < num - numtaps; n++)
+				NAP_CHECK (fabsf (re[n] - refre[n]) < 1.0e-4f);
+			
+			const int offsets[5] = { 0, 3, 17, 100, 512 };
+			SparseFIR_Scalar(are, offsets, aim, refre, num - offsets[4], 5);
+			kernels.sparsefir(are, offsets, aim, re, num - offsets[4], 5);
+			for (int n = 0; n < num - offsets[4]; n++)
+				NAP_CHECK (fabsf (re[n] - refre[n]) < 1.0e-5f);
+			
+			// 9 and 16 channels cover both the vector loop and the scalar tail on every instruction set
+			for (int numchannels = 9; numchannels <= 16; numchannels += 7)
+			{
+				const int numframes = num / numchannels;
+				memset(refre, 0, sizeof(float) * numframes * numchannels);
+				memset(re, 0, sizeof(float) * numframes * numchannels);
+				SHEncode_Scalar(are, aim, bre, refre, numframes, numchannels);
+				kernels.shencode(are, aim, bre, re, numframes, numchannels);
+				for (int n = 0; n < numframes * numchannels; n++)
+					NAP_CHECK (fabsf (re[n] - refre[n]) < 1.0e-5f);
+			}
+		}
+		
+		delete[] buf;
+	}
+	
+#if ENABLE_BENCHMARKS
+	NAP_UNITTEST(MulAddThroughput)
+	{
+		// Accumulates 16 spectra of 1024 bins each, which is roughly what a partitioned convolution of a 16k tail does per block
+		const int num = 1024, numpartitions = 16, numiterations = 2000;
+		float* a = new float [num * 2 * numpartitions];
+		float* b = new float [num * 2 * numpartitions];
+		float* acc = new float [num * 2];
+		Random r;
+		for (int n = 0; n < num * 2 * numpartitions; n++)
+		{
+			a[n] = r.GetFloat(-1.0f, 1.0f);
+			b[n] = r.GetFloat(-1.0f, 1.0f);
+		}
+		
+		for (int k = 0; k < GetNumSupportedSIMDKernels(); k++)
+		{
+			const SIMDKernels& kernels = simdKernelTable[k];
+			memset(acc, 0, sizeof(float) * num * 2);
+			clock_t start = clock();
+			for (int i = 0; i < numiterations; i++)
+				for (int p = 0; p < numpartitions; p++)
+					kernels.muladd(a + p * num * 2, a + p * num * 2 + num, b + p * num * 2, b + p * num * 2 + num, acc, acc + num, num);
+			double seconds = (double)(clock() - start) / (double)CLOCKS_PER_SEC;
+			double macs = (double)num * numpartitions * numiterations;
+			printf ("SplitComplex::MulAdd [%s]: %.1f M complex MACs/s (checksum %g)\n", kernels.name, (seconds > 0.0) ? macs / seconds * 1.0e-6 : 0.0, acc[0]);
+		}
+		
+		delete[] a;
+		delete[] b;
+		delete[] acc;
+	}
+#endif
+}
+
+NAP_TESTSUITE(OctaveFilterBank)
+{
+	NAP_UNITTEST(MatchesBiquadFilter)
+	{
+		const int num = 1000, B = OctaveFilterBank::NUMBANDS;
+		float* input = new float [num * 2];
+		float* ref = new float [num * B];
+		float* output = new float [num * B];
+		Random r;
+		for (int n = 0; n < num * 2; n++)
+			input[n] = r.GetFloat(-1.0f, 1.0f);
+		
+		// Compare every kernel against the per-sample filters, reading the right channel of an interleaved buffer
+		for (int k = 0; k < GetNumSupportedSIMDKernels(); k++)
+		{
+			OctaveFilterBank bank;
+			memset(&bank, 0, sizeof(bank));
+			bank.Setup(48000.0f);
+			BiquadFilter filters[B];
+			memset(filters, 0, sizeof(filters));
+			float refrms[B] = { 0.0f };
+			for (int b = 0; b < B; b++)
+			{
+				if (b == 0)
+					filters[b].SetupLowpass(63.0f, 48000.0f, 1.0f);
+				else if (b == B - 1)
+					filters[b].SetupHighpass(8000.0f, 48000.0f, 1.0f);
+				else
+					filters[b].SetupBandpass(125.0f * (float)(1 << (b - 1)), 48000.0f, 1.0f);
+				for (int n = 0; n < num; n++)
+				{
+					ref[n * B + b] = filters[b].Process(input[n * 2 + 1]);
+					refrms[b] += ref[n * B + b] * ref[n * B + b];
+				}
+				refrms[b] = sqrtf(refrms[b] / (float)num);
+			}
+			
+			float sumsq[B] = { 0.0f };
+			simdKernelTable[k].biquadbank(bank.coeffs[0], bank.state[0], input + 1, 2, sumsq, output, num);
+			for (int n = 0; n < num * B; n++)
+				NAP_CHECK (fabsf (output[n] - ref[n]) < 1.0e-4f);
+			for (int b = 0; b < B; b++)
+				NAP_CHECK (fabsf (sqrtf(sumsq[b] / (float)num) - refrms[b]) < 1.0e-4f);
+			
+			float rms[B];
+			bank.Reset();
+			bank.Process(input + 1, 2, rms, NULL, num);
+			for (int b = 0; b < B; b++)
+				NAP_CHECK (fabsf (rms[b] - refrms[b]) < 1.0e-4f);
+		}
+		
+		delete[] input;
+		delete[] ref;
+		delete[] output;
+	}
+}
+
+NAP_TESTSUITE(BandEnergyAnalyzer)
+{
+	NAP_UNITTEST(MatchesFilterBank)
+	{
+		// A sinusoid centered on a bin must give the steady-state level of each band of the time-domain bank
+		const int num = 4096, B = BandEnergyAnalyzer::NUMBANDS;
+		const int bins[] = { 5, 21, 85, 341, 1365 };
+		float* x = new float [num];
+		float* re = new float [num];
+		float* im = new float [num];
+		UnityComplexNumber* work = new UnityComplexNumber [num / 2];
+		BandEnergyAnalyzer analyzer;
+		memset(&analyzer, 0, sizeof(analyzer));
+		analyzer.Init(num * 2, 48000.0f);
+		for (int i = 0; i < (int)(sizeof(bins) / sizeof(bins[0])); i++)
+		{
+			for (int n = 0; n < num; n++)
+				x[n] = sinf(2.0f * kPI * (float)(bins[i] * n) / (float)num);
+			FFT::ForwardReal(x, work, re, im, num);
+			float rms[B], refrms[B];
+			analyzer.Process(re, im, num, num, rms);
+			
+			OctaveFilterBank bank;
+			memset(&bank, 0, sizeof(bank));
+			bank.Setup(48000.0f);
+			bank.Process(x, 1, refrms, NULL, num);
+			bank.Process(x, 1, refrms, NULL, num);
+			for (int b = 0; b < B; b++)
+				NAP_CHECK (fabsf (rms[b] - refrms[b]) < 0.02f * refrms[b] + 1.0e-3f);
+		}
+		analyzer.Cleanup();
+		delete[] x;
+		delete[] re;
+		delete[] im;
+		delete[] work;
+	}
+}
+
+NAP_TESTSUITE(FeedbackDelayNetwork)
+{
+	NAP_UNITTEST(KernelsMatchScalar)
+	{
+		const int num = 100, L = FeedbackDelayNetwork::NUMLINES;
+		FeedbackDelayNetwork fdn;
+		memset(&fdn, 0, sizeof(fdn));
+		fdn.Init(48000.0f);
+		const float t60[FeedbackDelayNetwork::NUMBANDS] = { 3.0f, 1.0f, 0.3f };
+		fdn.SetDecayTimes(t60);
+		
+		float* input = new float [num * L];
+		float* lines = new float [num * L];
+		float* ref = new float [num * L];
+		float* feedback = new float [num * L];
+		Random r;
+		for (int n = 0; n < num * L; n++)
+			input[n] = r.GetFloat(-1.0f, 1.0f);
+		
+		float refstate[2][L] = { { 0.0f } };
+		memcpy(ref, input, sizeof(float) * num * L);
+		float* reffeedback = new float [num * L];
+		FDN_Scalar(fdn.coeffs[0], refstate[0], ref, reffeedback, num);
+		
+		for (int k = 0; k < GetNumSupportedSIMDKernels(); k++)
+		{
+			float state[2][L] = { { 0.0f } };
+			memcpy(lines, input, sizeof(float) * num * L);
+			simdKernelTable[k].fdn(fdn.coeffs[0], state[0], lines, feedback, num);
+			for (int n = 0; n < num * L; n++)
+				NAP_CHECK (fabsf (lines[n] - ref[n]) < 1.0e-4f && fabsf (feedback[n] - reffeedback[n]) < 1.0e-4f);
+			for (int i = 0; i < L; i++)
+				NAP_CHECK (fabsf (state[0][i] - refstate[0][i]) < 1.0e-4f && fabsf (state[1][i] - refstate[1][i]) < 1.0e-4f);
+		}
+		
+		fdn.Cleanup();
+		delete[] input;
+		delete[] lines;
+		delete[] ref;
+		delete[] feedback;
+		delete[] reffeedback;
+	}
+	
+	NAP_UNITTEST(DecayMatchesT60)
+	{
+		// With equal decay times in all bands the level of the impulse response must drop by 60 dB per t60 seconds.
+		// The line lengths and the windows scale with the sample rate, so a low one keeps the test short.
+		const float samplerate = 8000.0f, t60[FeedbackDelayNetwork::NUMBANDS] = { 1.0f, 1.0f, 1.0f };
+		const int blocksize = 512, num = (int)samplerate;
+		FeedbackDelayNetwork fdn;
+		memset(&fdn, 0, sizeof(fdn));
+		fdn.Init(samplerate);
+		fdn.SetDecayTimes(t60);
+		
+		float* buffer = new float [blocksize * 2];
+		double energy[10] = { 0.0 };
+		for (int offset = 0; offset < num; offset += blocksize)
+		{
+			memset(buffer, 0, sizeof(float) * blocksize * 2);
+			if (offset == 0)
+				buffer[0] = buffer[1] = 1.0f;
+			fdn.Process(buffer, buffer, blocksize);
+			for (int n = 0; n < blocksize && offset + n < num; n++)
+				energy[(offset + n) * 10 / num] += buffer[n * 2] * buffer[n * 2] + buffer[n * 2 + 1] * buffer[n * 2 + 1];
+		}
+		
+		// 0.5 s between the windows
+		float drop = 10.0f * log10f((float)(energy[7] / energy[2]));
+		NAP_CHECK (drop > -33.0f && drop < -27.0f);
+		
+		fdn.Cleanup();
+		delete[] buffer;
+	}
+}
+
+NAP_TESTSUITE(MemoryPool)
+{
+	NAP_UNITTEST(ReusesFreedBlocks)
+	{
+		size_t used0, pooled0, used, pooled;
+		MemoryPool::GetStats(used0, pooled0);
+		
+		float* a = (float*)MemoryPool::Allocate(sizeof(float) * 1000);
+		MemoryPool::GetStats(used, pooled);
+		NAP_CHECK (used == used0 + 4096);
+		for (int n = 0; n < 1000; n++)
+			a[n] = 1.0f;
+		
+		// A freed block is handed out again, cleared, for any size in the same class
+		MemoryPool::Free(a);
+		float* b = (float*)MemoryPool::Allocate(sizeof(float) * 980);
+		NAP_CHECK (b == a);
+		for (int n = 0; n < 1000; n++)
+			NAP_CHECK (b[n] == 0.0f);
+		
+		MemoryPool::Free(b);
+		MemoryPool::GetStats(used, pooled);
+		NAP_CHECK (used == used0 && pooled >= 4096);
+	}
+}
+
+NAP_TESTSUITE(SendBus)
+{
+	NAP_UNITTEST(SendsAreReceivedOnce)
+	{
+		const int num = 64;
+		SendBus* bus = new SendBus();
+		bus->Reserve(num);
+		float output[num * 2];
+		
+		// Two sends for the first block and one for the next, all made before the reverb processes the first block
+		for (int k = 0; k < 3; k++)
+		{
+			float* send = bus->BeginSend((k < 2) ? 0 : num, num);
+			NAP_CHECK (send != NULL);
+			for (int n = 0; n < num * 2; n++)
+				send[n] += (k < 2) ? 1.0f : 10.0f;
+			bus->EndSend();
+		}
+		
+		memset(output, 0, sizeof(output));
+		bus->Receive(0, output, num);
+		for (int n = 0; n < num * 2; n++)
+			NAP_CHECK (output[n] == 2.0f);
+		
+		memset(output, 0, sizeof(output));
+		bus->Receive(0, output, num);
+		for (int n = 0; n < num * 2; n++)
+			NAP_CHECK (output[n] == 0.0f);
+		
+		// A send that arrives after the reverb has processed its block is picked up with the next one
+		float* send = bus->BeginSend(0, num);
+		for (int n = 0; n < num * 2; n++)
+			send[n] += 100.0f;
+		bus->EndSend();
+		
+		memset(output, 0, sizeof(output));
+		bus->Receive(num, output, num);
+		for (int n = 0; n < num * 2; n++)
+			NAP_CHECK (output[n] == 110.0f);
+		
+		memset(output, 0, sizeof(output));
+		bus->Receive(num * 2, output, num);
+		for (int n = 0; n < num * 2; n++)
+			NAP_CHECK (output[n] == 0.0f);
+		
+		delete bus;
+	}
+	
+	NAP_UNITTEST(BusesAreIndependent)
+	{
+		// The same thread sends to a stereo and a 16 channel bus within one block
+		const int num = 32, numchannels = 16;
+		SendBus* stereo = new SendBus();
+		SendBus* field = new SendBus(numchannels);
+		stereo->Reserve(num);
+		field->Reserve(num);
+		float* a = stereo->BeginSend(0, num);
+		float* b = field->BeginSend(0, num);
+		NAP_CHECK (a != NULL && b != NULL && a != b);
+		for (int n = 0; n < num * 2; n++)
+			a[n] += 1.0f;
+		for (int n = 0; n < num * numchannels; n++)
+			b[n] += (float)(n % numchannels);
+		field->EndSend();
+		stereo->EndSend();
+		
+		float output[num * numchannels];
+		memset(output, 0, sizeof(output));
+		field->Receive(0, output, num);
+		for (int n = 0; n < num * numchannels; n++)
+			NAP_CHECK (output[n] == (float)(n % numchannels));
+		
+		memset(output, 0, sizeof(output));
+		stereo->Receive(0, output, num);
+		for (int n = 0; n < num * 2; n++)
+			NAP_CHECK (output[n] == 1.0f);
+		
+		delete stereo;
+		delete field;
+	}
+	
+	NAP_UNITTEST(LongSendsAreKept)
+	{
+		// A send for a block twice as long as the receiver's is received over two blocks
+		const int num = 32;
+		SendBus* bus = new SendBus();
+		bus->Reserve(num * 2);
+		NAP_CHECK (bus->BeginSend(0, num * 4) == NULL);
+		bus->EndSend();
+		float* send = bus->BeginSend(0, num * 2);
+		for (int n = 0; n < num * 4; n++)
+			send[n] += (float)n;
+		bus->EndSend();
+		
+		float output[num * 2];
+		for (int k = 0; k < 3; k++)
+		{
+			memset(output, 0, sizeof(output));
+			bus->Receive(k * num, output, num);
+			for (int n = 0; n < num * 2; n++)
+				NAP_CHECK (output[n] == ((k < 2) ? (float)(k * num * 2 + n) : 0.0f));
+		}
+		
+		delete bus;
+	}
+	
+#if ENABLE_SLOW_TESTS
+	NAP_UNITTEST(ThreadSlotsAreReused)
+	{
+		// More threads than slots, one after the other, all get a buffer
+		const int num = 16;
+		SendBus* bus = new SendBus();
+		bus->Reserve(num);
+		for (int t = 0; t < SendBus::MAXTHREADS * 2; t++)
+		{
+			bool sent = false;
+			std::thread thread([bus, &sent]()
+			{
+				float* send = bus->BeginSend(0, num);
+				sent = send != NULL;
+				if (sent)
+					send[0] += 1.0f;
+				bus->EndSend();
+			});
+			thread.join();
+			NAP_CHECK (sent);
+			
+			float output[num * 2];
+			memset(output, 0, sizeof(output));
+			bus->Receive(0, output, num);
+			NAP_CHECK (output[0] == 1.0f);
+		}
+		
+		delete bus;
+	}
+#endif
+}
+
+NAP_TESTSUITE(SharedValues)
+{
+	NAP_UNITTEST(CompleteSets)
+	{
+		SharedValues<3>* shared = new SharedValues<3>(); // Value-initialized, so zeroed
+		float values[3] = { -1.0f, -1.0f, -1.0f };
+		NAP_CHECK (!shared->Read(values) && values[0] == -1.0f);
+		
+		for (int k = 1; k <= 3; k++)
+		{
+			const float set[3] = { (float)k, (float)k * 2.0f, (float)k * 3.0f };
+			NAP_CHECK (shared->Write(set));
+			NAP_CHECK (shared->Read(values));
+			NAP_CHECK (values[0] == set[0] && values[1] == set[1] && values[2] == set[2]);
+		}
+		
+		delete shared;
+	}
+}
+
+NAP_TESTSUITE(Multirate)
+{
+	NAP_UNITTEST(DecimateInterpolate)
+	{
+		// A low-frequency signal must come out of a decimation and interpolation round trip unchanged apart from the filter delay
+		const int num = 4096, factor = 16, taps = 128, delay = taps - 1;
+		PolyphaseDecimator<factor, taps> decimator;
+		PolyphaseInterpolator<factor, taps> interpolator;
+		memset(&decimator, 0, sizeof(decimator));
+		memset(&interpolator, 0, sizeof(interpolator));
+		decimator.Init();
+		interpolator.Init();
+		float* x = new float [num];
+		float* low = new float [num / factor];
+		float* y = new float [num];
+		for (int n = 0; n < num; n++)
+			x[n] = sinf(2.0f * kPI * 100.0f * (float)n / 48000.0f) + 0.5f * sinf(2.0f * kPI * 230.0f * (float)n / 48000.0f);
+		for (int n = 0; n < num; n += 256)
+		{
+			decimator.Process(x + n, low, 256);
+			interpolator.Process(low, y + n, 256 / factor);
+		}
+		for (int n = 1024; n < num; n++)
+			NAP_CHECK (fabsf (y[n] - x[n - delay]) < 1.0e-2f);
+		delete[] x;
+		delete[] low;
+		delete[] y;
+	}
+}
+
+NAP_TESTSUITE(PartitionedConvolver)
+{
+	NAP_UNITTEST(MatchesDirectConvolution)
+	{
+		const int blocksize = 64, numblocks = 16, num = blocksize * numblocks, irlength = 300;
+		float* x = new float [num];
+		float* ir = new float [irlength * 2];
+		float* y = new float [num * 2];
+		Random r;
+		for (int n = 0; n < num; n++)
+			x[n] = r.GetFloat(-1.0f, 1.0f);
+		for (int n = 0; n < irlength * 2; n++)
+			ir[n] = r.GetFloat(-1.0f, 1.0f) * expf(-0.01f * (float)(n % irlength));
+		PartitionedConvolver conv;
+		memset(&conv, 0, sizeof(conv));
+		conv.Init(blocksize, 512);
+		conv.SetImpulseResponse(ir, ir + irlength, irlength);
+		for (int b = 0; b < numblocks; b++)
+			conv.Process(x + b * blocksize, y + b * blocksize, y + num + b * blocksize);
+		for (int c = 0; c < 2; c++)
+		{
+			for (int n = 0; n < num; n++)
+			{
+				float sum = 0.0f;
+				for (int k = 0; k < irlength && k <= n; k++)
+					sum += ir[c * irlength + k] * x[n - k];
+				NAP_CHECK (fabsf (y[c * num + n] - sum) < 1.0e-3f);
+			}
+		}
+		conv.Cleanup();
+		delete[] x;
+		delete[] ir;
+		delete[] y;
+	}
+
+	NAP_UNITTEST(OddChannelCount)
+	{
+		// The last channel has no partner for the shared inverse transform
+		const int blocksize = 32, numblocks = 8, num = blocksize * numblocks, irlength = 100, numchannels = 3;
+		float x[num], ir[irlength * numchannels], y[num * numchannels];
+		Random r;
+		for (int n = 0; n < num; n++)
+			x[n] = r.GetFloat(-1.0f, 1.0f);
+		for (int n = 0; n < irlength * numchannels; n++)
+			ir[n] = r.GetFloat(-1.0f, 1.0f);
+		PartitionedConvolver conv;
+		memset(&conv, 0, sizeof(conv));
+		conv.Init(blocksize, irlength, numchannels);
+		const float* responses[numchannels] = { ir, ir + irlength, ir + irlength * 2 };
+		conv.SetImpulseResponses(responses, irlength);
+		for (int b = 0; b < numblocks; b++)
+		{
+			float* outputs[numchannels] = { y + b * blocksize, y + num + b * blocksize, y + num * 2 + b * blocksize };
+			conv.Process(x + b * blocksize, outputs);
+		}
+		for (int c = 0; c < numchannels; c++)
+		{
+			for (int n = 0; n < num; n++)
+			{
+				float sum = 0.0f;
+				for (int k = 0; k < irlength && k <= n; k++)
+					sum += ir[c * irlength + k] * x[n - k];
+				NAP_CHECK (fabsf (y[c * num + n] - sum) < 1.0e-3f);
+			}
+		}
+		conv.Cleanup();
+	}
+}
+
+NAP_TESTSUITE(SphericalHarmonics)
+{
+	NAP_UNITTEST(RotationMatchesRotatedDirection)
+	{
+		// Rotation about a tilted axis, so that every element of the blocks is exercised
+		float axis[3] = { 0.3f, -0.5f, 0.81f };
+		float len = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+		for (int i = 0; i < 3; i++)
+			axis[i] /= len;
+		float c = cosf(1.1f), s = sinf(1.1f), k = 1.0f - c;
+		float rotation[9] =
+		{
+			c + axis[0] * axis[0] * k,           axis[0] * axis[1] * k - axis[2] * s, axis[0] * axis[2] * k + axis[1] * s,
+			axis[1] * axis[0] * k + axis[2] * s, c + axis[1] * axis[1] * k,           axis[1] * axis[2] * k - axis[0] * s,
+			axis[2] * axis[0] * k - axis[1] * s, axis[2] * axis[1] * k + axis[0] * s, c + axis[2] * axis[2] * k
+		};
+		SHRotation r;
+		r.Setup(SphericalHarmonics::MAXORDER, rotation);
+
+		Random random;
+		random.Seed(1);
+		for (int test = 0; test < 20; test++)
+		{
+			float d[3], e[3];
+			for (int i = 0; i < 3; i++)
+				d[i] = random.GetFloat(-1.0f, 1.0f);
+			len = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+			for (int i = 0; i < 3; i++)
+				d[i] /= len;
+			for (int i = 0; i < 3; i++)
+				e[i] = rotation[i * 3] * d[0] + rotation[i * 3 + 1] * d[1] + rotation[i * 3 + 2] * d[2];
+
+			float encoded[SphericalHarmonics::MAXCHANNELS], rotated[SphericalHarmonics::MAXCHANNELS], expected[SphericalHarmonics::MAXCHANNELS];
+			SphericalHarmonics::Evaluate(SphericalHarmonics::MAXORDER, d[0], d[1], d[2], encoded);
+			SphericalHarmonics::Evaluate(SphericalHarmonics::MAXORDER, e[0], e[1], e[2], expected);
+			r.Process(encoded, rotated, 1);
+			for (int n = 0; n < SphericalHarmonics::MAXCHANNELS; n++)
+				NAP_CHECK (fabsf (rotated[n] - expected[n]) < 1.0e-4f);
+		}
+	}
+}
+
+NAP_TESTSUITE(FIR)
+{
+	NAP_UNITTEST(SparseCorrelateAccuracy)
+	{
+		// Velvet-noise-like taps as used by the reverb. Every kernel must stay within a few rounding errors of the sum
+		// magnitude, whether it rounds every product or fuses the multiplies and adds.
+		Random r;
+		const int numtaps = 300, num = 1027;
+		int offsets[numtaps];
+		float coeffs[numtaps];
+		int offset = 0;
+		for (int k = 0; k < numtaps; k++)
+		{
+			offset += 1 + (int)r.GetFloat(0.0f, 20.0f);
+			offsets[k] = offset;
+			coeffs[k] = r.GetFloat(-1.0f, 1.0f);
+		}
+		float* input = new float [offset + num];
+		float* output = new float [num];
+		for (int n = 0; n < offset + num; n++)
+			input[n] = r.GetFloat(-1.0f, 1.0f);
+		
+		for (int k = 0; k < GetNumSupportedSIMDKernels(); k++)
+		{
+			simdKernelTable[k].sparsefir(input, offsets, coeffs, output, num, numtaps);
+			for (int n = 0; n < num; n++)
+			{
+				double sum = 0.0, magnitude = 0.0;
+				for (int t = 0; t < numtaps; t++)
+				{
+					sum += (double)coeffs[t] * (double)input[offsets[t] + n];
+					magnitude += fabs((double)coeffs[t] * (double)input[offsets[t] + n]);
+				}
+				NAP_CHECK (fabs ((double)output[n] - sum) <= 1.0e-5 * magnitude);
+			}
+		}
+		
+		delete[] input;
+		delete[] output;
+	}
+}
+
+NAP_TESTSUITE(FractionalDelay)
+{
+	NAP_UNITTEST(Interpolation)
+	{
+		// Cubic interpolation reproduces a ramp exactly, so the output must be the input shifted by the delay
+		FractionalDelay<64> d;
+		memset(&d, 0, sizeof(d));
+		for (int n = 0; n < 200; n++)
+		{
+			float delay = (float)(n % 37) * 0.37f;
+			float y = d.Process((float)n, delay);
+			if (n > 64)
+				NAP_CHECK (fabsf (y - ((float)n - delay)) < 1.0e-3f);
+		}
+	}
 }
@@ -1,12 +1,18 @@
 #include "AudioPluginUtil.h"
 #include "rayTraceUtil.h"
+#include "imageSourceUtil.h"
+#include "hrtfUtil.h"
 #include <ctime>
 #include <iostream>
 #include <fstream>
 #include <stdlib.h>
 #include <future>
+#include <chrono>
+#include <climits>
+#include <algorithm>
 extern float hrtfSrcData[];
-extern float reverbmixbuffer[];
+extern SendBus reverbsendbus;
+extern SharedValues<FeedbackDelayNetwork::NUMBANDS> reverbroomdecay;
 
 namespace Spatializer
 {
@@ -15,13 +21,31 @@ namespace Spatializer
     static int maxPathLength = 100;
     static int maxNumReflecs = 75;
     static float absCoeff = 0.5f;
-    const static float airAbsorbtion[6] = {0.002, 0.005, 0.005, 0.007, 0.012, 0.057};
+    static bool listenerTrace = false;    // Trace once from the listener and match the paths to every source
+    static float detectionRadius = 0.5f;  // Radius of the receiver sphere, around the listener or around each source when
+                                          // tracing from the listener
+    static int imageSourceOrder = 2;      // Reflections up to this order are found by the image source method instead of
+                                          // the tracing, 0 leaves all of them to the tracing
+    const int numBands = 6;
+    const static float airAbsorbtion[numBands] = {0.002, 0.005, 0.005, 0.007, 0.012, 0.057};
     const static float C = 343.2;
+    const static float EARLYTIME = 0.08f; // Arrivals later than this after the first one are rendered by the convolver
+    const int MAXCLUSTERS = 16;           // Virtual sources the early reflections are clustered into
+    const static float CLUSTERANGLE = 0.8660254f; // Cosine of the angle within which reflections join a cluster (30 degrees)
+    const static float CLUSTERTIME = 0.005f;      // Arrival time difference within which reflections join a cluster
+    const int HRTFLEN = 512;
+    const int MINPHASELEN = 64;
+    const int DIRECTHRIRLEN = 32;
+    const int ROOMORDER = 2;              // Spherical harmonic order of the late room response
+    const int ROOMCHANNELS = (ROOMORDER + 1) * (ROOMORDER + 1);
     const static int impLength = std::ceil(44100 * (maxPathLength/C));
     static GeomeTree* triangleTree;
+    static const Philox scatterRandom(0x5EED, 1);
+    static std::vector<ReflectionPlane> reflectionPlanes;
+    static std::atomic<int> geometryVersion(0); // Bumped whenever the paths of every instance have to be found again
+    static Mutex geometryMutex;           // Held while the geometry or the ray sphere changes and while the trace worker uses them
     static raySphere sourceSphere = raySphere(numRays);
     std::vector<float> rayOutputData;
-    static bool newTree = true;
     static bool treeInit = false;
     static bool enableDebug;
     bool textWritten = true;
@@ -34,46 +58,540 @@ namespace Spatializer
         P_NUM
     };
     
-    struct filterData {
-        BiquadFilter Octave1[2];
-        BiquadFilter Octave2[2];
-        BiquadFilter Octave3[2];
-        BiquadFilter Octave4[2];
-        BiquadFilter Octave5[2];
-        BiquadFilter Octave6[2];
-        BiquadFilter Octave7[2];
-        BiquadFilter Octave8[2];
+    const int ROOMBLOCKLEN = 256;
+    
+    // HRIRs for the reflection voices: the compiled-in set converted to minimum phase and truncated to DIRECTHRIRLEN taps.
+    // The time of arrival removed by the conversion is kept in the minimum-phase grid and applied as a delay.
+    // The binaural decoder of the late room response is made from the same HRIRs: each ear has one filter per spherical
+    // harmonic channel, the projection of the HRIRs of all grid cells onto that channel. It carries no ITD, which matters
+    // little for the diffuse tail.
+    class HRTFData
+    {
+    public:
+        HRTFGrid minimumphase;
+        HRIRGrid hrir;
+        float decoder[2][ROOMCHANNELS][DIRECTHRIRLEN]; // Reversed like the HRIRs, as FIRFilter expects
+        
+    public:
+        void Init()
+        {
+            HRTFGrid grid;
+            int numthreads = std::thread::hardware_concurrency();
+            grid.Build(hrtfSrcData, HRTFLEN, numthreads);
+            minimumphase.BuildMinimumPhase(grid, MINPHASELEN, numthreads);
+            hrir.Build(minimumphase, DIRECTHRIRLEN);
+            InitDecoder();
+        }
+        
+    protected:
+        void InitDecoder()
+        {
+            static const float kDeg2Rad = kPI / 180.0f;
+            const float halfstep = 0.5f * HRTFGrid::GetElevationStep() * kDeg2Rad;
+            memset(decoder, 0, sizeof(decoder));
+            for (int e = 0; e < HRTFGrid::NUMELEVATIONS; e++)
+            {
+                // Each cell stands for the part of its ring band of the sphere, as a fraction of the whole sphere
+                float elevation = (HRTFGrid::GetElevationStart() + e * HRTFGrid::GetElevationStep()) * kDeg2Rad;
+                float top = FastMin(elevation + halfstep, 0.5f * kPI);
+                float weight = 0.5f * (sinf(top) - sinf(elevation - halfstep)) / (float)HRTFGrid::NUMAZIMUTHS;
+                for (int a = 0; a < HRTFGrid::NUMAZIMUTHS; a++)
+                {
+                    float azimuth = a * HRTFGrid::GetAzimuthStep() * kDeg2Rad;
+                    float sh[SphericalHarmonics::MAXCHANNELS];
+                    SphericalHarmonics::Evaluate(ROOMORDER, cosf(elevation) * sinf(azimuth), sinf(elevation), cosf(elevation) * cosf(azimuth), sh);
+                    for (int c = 0; c < 2; c++)
+                    {
+                        const float* h = hrir.data + ((c * HRTFGrid::NUMELEVATIONS + e) * HRTFGrid::NUMAZIMUTHS + a) * DIRECTHRIRLEN;
+                        for (int k = 0; k < ROOMCHANNELS; k++)
+                            for (int n = 0; n < DIRECTHRIRLEN; n++)
+                                decoder[c][k][n] += weight * sh[k] * h[n];
+                    }
+                }
+            }
+        }
+    };
+    
+    static std::atomic<HRTFData*> activeHRTFData(NULL);
+    static Mutex hrtfDataMutex;
+    
+    // Prepared on first use rather than at library load, so that Unity can enumerate the plugin without waiting for it
+    static HRTFData& GetHRTFData()
+    {
+        HRTFData* data = activeHRTFData.load(std::memory_order_acquire);
+        if (data == NULL)
+        {
+            MutexScopeLock lock(hrtfDataMutex);
+            data = activeHRTFData.load(std::memory_order_acquire);
+            if (data == NULL)
+            {
+                data = new HRTFData();
+                data->Init();
+                activeHRTFData.store(data, std::memory_order_release);
+            }
+        }
+        return *data;
+    }
+    
+    // Paths traced from the listener, shared by all instances when listenerTrace is set
+    struct ListenerTrace
+    {
+        std::vector<RaySegment> segments;
+        Vector3 position;
+        int geometry;           // geometryVersion the paths were traced in
+        int version;            // Bumped on every retrace, so that the instances know to match their source again; 0 until the first
+    };
+    
+    // The shared trace belongs to the trace worker, which matches the sources against it as well. The instances ask for
+    // the listener position they see through requestedListener, and the worker traces the latest position asked for.
+    static ListenerTrace sharedTrace;
+    static SharedValues<3> requestedListener;
+    
+    // Rotation from world space into the listener's frame, as a row-major 3x3 matrix
+    static void GetListenerRotation(const float* m, float* rotation)
+    {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                rotation[i * 3 + j] = m[j * 4 + i];
+    }
+    
+    // Azimuth and elevation in degrees, as used by the HRTF grids, of a world space direction seen by the listener
+    static void GetListenerAngles(const float* m, const Vector3& direction, float& azimuth, float& elevation)
+    {
+        static const float kRad2Deg = 180.0f / kPI;
+        float x = m[0] * direction.X + m[4] * direction.Y + m[8] * direction.Z;
+        float y = m[1] * direction.X + m[5] * direction.Y + m[9] * direction.Z;
+        float z = m[2] * direction.X + m[6] * direction.Y + m[10] * direction.Z;
+        azimuth = (fabsf(z) < 0.001f) ? 0.0f : atan2f(x, z);
+        if (azimuth < 0.0f)
+            azimuth += 2.0f * kPI;
+        azimuth = FastClip(azimuth * kRad2Deg, 0.0f, 360.0f);
+        elevation = atan2f(y, sqrtf(x * x + z * z) + 0.001f) * kRad2Deg;
+    }
+    
+    // Early reflection, merged from all rays that arrive in the same sample
+    struct EarlyTap
+    {
+        float delay;            // In samples after the first arrival
+        float gain[numBands];
+        Vector3 direction;      // World space direction the sound arrives from, weighted by the band gains of the merged rays
+        int sample;             // Delay of the first merged ray rounded to samples, which the others have to share
+        float weight;           // Summed broadband gain of the merged rays; delay and direction are weighted sums until divided by it
+    };
+    
+    // Virtual source standing in for the early reflections that arrive from similar directions at similar times
+    struct ReflectionCluster
+    {
+        float delay;            // Gain-weighted arrival time in samples after the first arrival
+        float gain[numBands];   // Summed band gains of the member reflections
+        Vector3 direction;      // Gain-weighted world space arrival direction, normalized
+    };
+    
+    // Filter state of one virtual source. The HRIRs follow the listener orientation and are crossfaded when they change.
+    struct ReflectionVoice
+    {
+        ReflectionCluster cluster;
+        FIRFilter<DIRECTHRIRLEN> fir[2];
+        float coeffs[2][DIRECTHRIRLEN];
+        float prevcoeffs[2][DIRECTHRIRLEN];
+        float itd[2];           // Interaural time difference of the current HRIRs in samples
+    };
+    
+    // Hands values of type T from one thread to another without either of them waiting. The writer fills the back slot and
+    // swaps it for the middle one, and the reader swaps its front slot for the middle one whenever the writer has marked
+    // that as new. Init must be called after zero-initialization.
+    template<class T>
+    struct TripleBuffer
+    {
+        enum { NEW = 4 };
+        
+        T slots[3];
+        std::atomic<int> middle;
+        int front;              // Reader only
+        int back;               // Writer only
+        
+        void Init()
+        {
+            front = 0;
+            middle = 1;
+            back = 2;
+        }
+        
+        T& Back() { return slots[back]; }
+        T& Front() { return slots[front]; }
+        
+        void Publish()
+        {
+            back = middle.exchange(back | NEW, std::memory_order_acq_rel) & 3;
+        }
+        
+        // Returns true if the front slot was replaced by a new one
+        bool Update()
+        {
+            if ((middle.load(std::memory_order_relaxed) & NEW) == 0)
+                return false;
+            front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+            return true;
+        }
+    };
+    
+    // Renders the traced room response. Early reflections are clustered into at most MAXCLUSTERS virtual sources. Each one
+    // is a tap on a delay line of the band-split input, with linear interpolation of the fractional delay, followed by a
+    // minimum-phase HRIR pair, so the early part costs the same per sample no matter how many rays arrive.
+    // The diffuse tail is a world space ambisonic response of order ROOMORDER, convolved with the input delayed to the start
+    // of the tail. The result is rotated into the listener's frame every block and decoded binaurally, so turning the head
+    // never needs a new response. The per-band tail responses are band filtered and summed into one response per processing
+    // rate: the 63 and 125 Hz octaves are convolved at 1/16 of the sample rate, the 250 Hz octave at 1/8 and only the
+    // remaining bands at the full rate, so the long low-frequency tails cost a fraction of a full-rate convolution.
+    // Works on blocks of ROOMBLOCKLEN samples, which is also its latency. New responses are prepared on the trace worker,
+    // including the transforms of the tail partitions, and only swapped in on the audio thread. Assumes zero-initialization.
+    struct RoomConvolver
+    {
+        enum { NUMPATHS = 3, LOWTAPS = 128, MIDTAPS = 64 };
+        enum { TAIL = 1024 };                   // Room for the band filter responses, in full-rate samples
+        enum { MAXITD = 64 };                   // Longest interaural time difference of the reflection voices
+        
+        static const int factors[NUMPATHS];     // Rate reduction of each path
+        static const int firstBand[NUMPATHS + 1];
+        static const int offsets[NUMPATHS];     // Alignment of each path to the delay of the 1/16 rate resampling filters
+        
+        PolyphaseDecimator<16, LOWTAPS> lowdecimator;
+        PolyphaseInterpolator<16, LOWTAPS> lowinterpolator[ROOMCHANNELS];
+        PolyphaseDecimator<8, MIDTAPS> middecimator;
+        PolyphaseInterpolator<8, MIDTAPS> midinterpolator[ROOMCHANNELS];
+        PartitionedConvolver conv[NUMPATHS];    // 1/16, 1/8 and full rate, ROOMCHANNELS outputs each
+        SHRotation rotation;
+        SHRotation prevrotation;
+        FIRFilter<DIRECTHRIRLEN> decoder[2][ROOMCHANNELS];
+        float input[ROOMBLOCKLEN];
+        float output[2][ROOMBLOCKLEN];
+        int pos;
+        int capacity;                           // Longest tail response the convolvers can hold, in full-rate samples
+        OctaveFilterBank bank;                  // Splits the input into the ray bands; the last two bands are unused
+        ReflectionVoice voices[MAXCLUSTERS];
+        int numvoices;
+        float* history;                         // Band-split input, OctaveFilterBank::NUMBANDS samples per frame
+        float* delayed;                         // Input history for the tail
+        int historymask;
+        int historypos;
+        int tailstart;                          // Arrival time of the first tail sample, in samples after the first arrival
+        float samplerate;
+        
+        // Clusters and tail spectra of one room response
+        struct Response
+        {
+            ReflectionCluster clusters[MAXCLUSTERS];
+            int numclusters;
+            float* spectra[NUMPATHS];
+            int numactive[NUMPATHS];
+        };
+        
+        TripleBuffer<Response> responses;
+        
+        // Scratch space of PrepareResponse, which belongs to the trace worker
+        float* tailbands;                       // capacity samples per spherical harmonic channel and band, see GetTailBand
+        float* pathresponses;                   // maxpathlength samples per spherical harmonic channel
+        float* pathband;
+        int maxpathlength;
+        UnityComplexNumber* work;
+        
+        // Allocates everything for tails of up to maxlength samples, so that neither PrepareResponse nor UpdateResponse
+        // allocates, and UpdateResponse never resets the convolvers. Longer tails are cut off at maxlength.
+        void Init(float samplerate, int maxlength)
+        {
+            lowdecimator.Init();
+            middecimator.Init();
+            for (int c = 0; c < ROOMCHANNELS; c++)
+            {
+                lowinterpolator[c].Init();
+                midinterpolator[c].Init();
+            }
+            
+            for (int b = 0; b < numBands; b++)
+                bank.SetupBand(b, GetBandFilter(b, samplerate));
+            
+            // Room for the longest early delay including the ITD and the alignment to the resampled paths, and for the tail delay
+            tailstart = (int)(EARLYTIME * samplerate);
+            int size = 1;
+            while (size < tailstart + MAXITD + LOWTAPS + ROOMBLOCKLEN + 1)
+                size *= 2;
+            history = new float[size * OctaveFilterBank::NUMBANDS];
+            delayed = new float[size];
+            memset(history, 0, sizeof(float) * size * OctaveFilterBank::NUMBANDS);
+            memset(delayed, 0, sizeof(float) * size);
+            historymask = size - 1;
+            historypos = 0;
+            
+            for (int i = 0; i < NUMPATHS; i++)
+                conv[i].Init(ROOMBLOCKLEN / factors[i], (maxlength + TAIL + factors[i] - 1) / factors[i] + offsets[i], ROOMCHANNELS);
+            capacity = maxlength;
+            this->samplerate = samplerate;
+            
+            maxpathlength = 0;
+            for (int i = 0; i < NUMPATHS; i++)
+                maxpathlength = std::max(maxpathlength, (maxlength + TAIL + factors[i] - 1) / factors[i] + offsets[i]);
+            tailbands = new float[std::max(maxlength, 1) * ROOMCHANNELS * numBands];
+            pathresponses = new float[maxpathlength * ROOMCHANNELS];
+            pathband = new float[maxpathlength];
+            work = new UnityComplexNumber[ROOMBLOCKLEN * 2];
+            responses.Init();
+            for (int k = 0; k < 3; k++)
+                for (int i = 0; i < NUMPATHS; i++)
+                    responses.slots[k].spectra[i] = new float[conv[i].GetSpectraSize()];
+        }
+        
+        void Cleanup()
+        {
+            for (int i = 0; i < NUMPATHS; i++)
+                conv[i].Cleanup();
+            capacity = 0;
+            delete[] history;
+            delete[] delayed;
+            history = NULL;
+            delayed = NULL;
+            samplerate = 0.0f;
+            delete[] tailbands;
+            delete[] pathresponses;
+            delete[] pathband;
+            delete[] work;
+            tailbands = NULL;
+            pathresponses = NULL;
+            pathband = NULL;
+            work = NULL;
+            for (int k = 0; k < 3; k++)
+            {
+                for (int i = 0; i < NUMPATHS; i++)
+                {
+                    delete[] responses.slots[k].spectra[i];
+                    responses.slots[k].spectra[i] = NULL;
+                }
+            }
+        }
+        
+        // Tail of spherical harmonic channel c in band b, at the full sample rate and starting at EARLYTIME
+        float* GetTailBand(int c, int b) { return tailbands + (c * numBands + b) * std::max(capacity, 1); }
+        
+        // Prepares a response from length samples of the tail in GetTailBand and the clusters, which are expected to arrive
+        // before EARLYTIME, and publishes it for UpdateResponse. Runs on the trace worker.
+        void PrepareResponse(int length, const ReflectionCluster* clusters, int numclusters)
+        {
+            Response& response = responses.Back();
+            response.numclusters = std::min(numclusters, MAXCLUSTERS);
+            for (int i = 0; i < response.numclusters; i++)
+                response.clusters[i] = clusters[i];
+            
+            length = std::min(length, capacity);
+            for (int i = 0; i < NUMPATHS; i++)
+            {
+                int factor = factors[i];
+                int pathLength = (length + TAIL + factor - 1) / factor + offsets[i];
+                const float* pathresponse[ROOMCHANNELS];
+                for (int c = 0; c < ROOMCHANNELS; c++)
+                {
+                    float* result = pathresponses + c * maxpathlength;
+                    pathresponse[c] = result;
+                    memset(result, 0, sizeof(float) * pathLength);
+                    for (int b = firstBand[i]; b < firstBand[i + 1]; b++)
+                    {
+                        // Taps are split between the two nearest samples of the reduced rate, then band limited at that rate
+                        const float* tail = GetTailBand(c, b);
+                        memset(pathband, 0, sizeof(float) * pathLength);
+                        for (int n = 0; n < length; n++)
+                        {
+                            float frac = (float)(n % factor) / (float)factor;
+                            pathband[offsets[i] + n / factor] += tail[n] * (1.0f - frac);
+                            pathband[offsets[i] + n / factor + 1] += tail[n] * frac;
+                        }
+                        BiquadFilter filter = GetBandFilter(b, this->samplerate / (float)factor);
+                        for (int n = 0; n < pathLength; n++)
+                            result[n] += filter.Process(pathband[n]);
+                    }
+                }
+                response.numactive[i] = conv[i].PrepareSpectra(pathresponse, pathLength, response.spectra[i], work);
+            }
+            responses.Publish();
+        }
+        
+        // Swaps in the latest response from PrepareResponse, if there is a new one. Runs on the audio thread.
+        void UpdateResponse()
+        {
+            if (!responses.Update())
+                return;
+            Response& response = responses.Front();
+            numvoices = response.numclusters;
+            for (int i = 0; i < numvoices; i++)
+                voices[i].cluster = response.clusters[i];
+            for (int i = 0; i < NUMPATHS; i++)
+                response.spectra[i] = conv[i].SwapSpectra(response.spectra[i], response.numactive[i]);
+        }
+        
+        static BiquadFilter GetBandFilter(int band, float samplerate)
+        {
+            BiquadFilter filter;
+            memset(&filter, 0, sizeof(filter));
+            if (band == 0)
+                filter.SetupLowpass(63.0f, samplerate, 1.0f);
+            else if (band == numBands - 1)
+                filter.SetupHighpass(125.0f * (float)(1 << (band - 1)), samplerate, 1.0f);
+            else
+                filter.SetupBandpass(125.0f * (float)(1 << (band - 1)), samplerate, 1.0f);
+            return filter;
+        }
+        
+        // listenermatrix orients the reflection voices; it is sampled once per block
+        void Process(const float* mono, float* outbuffer, int length, const float* listenermatrix, const HRTFData& hrtf)
+        {
+            for (int n = 0; n < length; n++)
+            {
+                input[pos] = mono[n];
+                outbuffer[n * 2] = output[0][pos];
+                outbuffer[n * 2 + 1] = output[1][pos];
+                if (++pos == ROOMBLOCKLEN)
+                {
+                    ProcessBlock(listenermatrix, hrtf);
+                    pos = 0;
+                }
+            }
+        }
+        
+        void ProcessBlock(const float* listenermatrix, const HRTFData& hrtf)
+        {
+            if (conv[0].numactive == 0)
+                return; // No response yet, the output stays silent
+            float low[ROOMBLOCKLEN / 16], lowOut[ROOMCHANNELS][ROOMBLOCKLEN / 16];
+            float mid[ROOMBLOCKLEN / 8], midOut[ROOMCHANNELS][ROOMBLOCKLEN / 8];
+            float ambi[ROOMCHANNELS][ROOMBLOCKLEN];
+            float* lowOutputs[ROOMCHANNELS];
+            float* midOutputs[ROOMCHANNELS];
+            float* ambiOutputs[ROOMCHANNELS];
+            float encoded[ROOMBLOCKLEN * ROOMCHANNELS];
+            float rotated[ROOMBLOCKLEN * ROOMCHANNELS];
+            float upsampled[ROOMBLOCKLEN];
+            float frames[ROOMBLOCKLEN * OctaveFilterBank::NUMBANDS];
+            float tail[ROOMBLOCKLEN];
+            float rms[OctaveFilterBank::NUMBANDS];
+            
+            const int start = historypos;
+            bank.Process(input, 1, rms, frames, ROOMBLOCKLEN);
+            for (int n = 0; n < ROOMBLOCKLEN; n++)
+            {
+                int p = (start + n) & historymask;
+                memcpy(history + p * OctaveFilterBank::NUMBANDS, frames + n * OctaveFilterBank::NUMBANDS, sizeof(float) * OctaveFilterBank::NUMBANDS);
+                delayed[p] = input[n];
+            }
+            historypos = (start + ROOMBLOCKLEN) & historymask;
+            for (int n = 0; n < ROOMBLOCKLEN; n++)
+                tail[n] = delayed[(start + n - tailstart) & historymask];
+            
+            lowdecimator.Process(tail, low, ROOMBLOCKLEN);
+            middecimator.Process(tail, mid, ROOMBLOCKLEN);
+            for (int k = 0; k < ROOMCHANNELS; k++)
+            {
+                lowOutputs[k] = lowOut[k];
+                midOutputs[k] = midOut[k];
+                ambiOutputs[k] = ambi[k];
+            }
+            conv[0].Process(low, lowOutputs);
+            conv[1].Process(mid, midOutputs);
+            conv[2].Process(tail, ambiOutputs);
+            for (int k = 0; k < ROOMCHANNELS; k++)
+            {
+                lowinterpolator[k].Process(lowOut[k], upsampled, ROOMBLOCKLEN / 16);
+                for (int n = 0; n < ROOMBLOCKLEN; n++)
+                    ambi[k][n] += upsampled[n];
+                midinterpolator[k].Process(midOut[k], upsampled, ROOMBLOCKLEN / 8);
+                for (int n = 0; n < ROOMBLOCKLEN; n++)
+                    encoded[n * ROOMCHANNELS + k] = ambi[k][n] + upsampled[n];
+            }
+            
+            // Into the listener's frame, crossfading from the previous orientation, and through the binaural decoder
+            float m[9];
+            GetListenerRotation(listenermatrix, m);
+            prevrotation = rotation;
+            rotation.Setup(ROOMORDER, m);
+            bool turned = memcmp(prevrotation.matrix, rotation.matrix, sizeof(rotation.matrix)) != 0;
+            rotation.Process(encoded, rotated, ROOMBLOCKLEN, turned ? &prevrotation : NULL);
+            memset(output, 0, sizeof(output));
+            for (int k = 0; k < ROOMCHANNELS; k++)
+            {
+                for (int n = 0; n < ROOMBLOCKLEN; n++)
+                    tail[n] = rotated[n * ROOMCHANNELS + k];
+                for (int c = 0; c < 2; c++)
+                {
+                    decoder[c][k].Process(tail, upsampled, ROOMBLOCKLEN, hrtf.decoder[c][k]);
+                    for (int n = 0; n < ROOMBLOCKLEN; n++)
+                        output[c][n] += upsampled[n];
+                }
+            }
+            
+            // The voices get the same alignment delay as the full-rate path of the tail. The ITD is ramped over the block.
+            float ear[ROOMBLOCKLEN];
+            float filtered[ROOMBLOCKLEN];
+            for (int v = 0; v < numvoices; v++)
+            {
+                ReflectionVoice& voice = voices[v];
+                const ReflectionCluster& cluster = voice.cluster;
+                float azimuth, elevation;
+                GetListenerAngles(listenermatrix, cluster.direction, azimuth, elevation);
+                memcpy(voice.prevcoeffs, voice.coeffs, sizeof(voice.coeffs));
+                float previtd[2] = { voice.itd[0], voice.itd[1] };
+                for (int c = 0; c < 2; c++)
+                {
+                    hrtf.hrir.GetHRIR(c, azimuth, elevation, voice.coeffs[c]);
+                    voice.itd[c] = FastMin(hrtf.minimumphase.GetDelay(c, azimuth, elevation), (float)MAXITD);
+                }
+                bool crossfade = memcmp(voice.prevcoeffs, voice.coeffs, sizeof(voice.coeffs)) != 0;
+                
+                for (int c = 0; c < 2; c++)
+                {
+                    float delay = cluster.delay + (float)(LOWTAPS - 1) + previtd[c];
+                    const float step = (voice.itd[c] - previtd[c]) / (float)ROOMBLOCKLEN;
+                    for (int n = 0; n < ROOMBLOCKLEN; n++)
+                    {
+                        const int whole = (int)delay;
+                        const float frac = delay - (float)whole;
+                        const float* a = history + ((start + n - whole) & historymask) * OctaveFilterBank::NUMBANDS;
+                        const float* b = history + ((start + n - whole - 1) & historymask) * OctaveFilterBank::NUMBANDS;
+                        float sum = 0.0f;
+                        for (int k = 0; k < numBands; k++)
+                            sum += cluster.gain[k] * (a[k] + (b[k] - a[k]) * frac);
+                        ear[n] = sum;
+                        delay += step;
+                    }
+                    voice.fir[c].Process(ear, filtered, ROOMBLOCKLEN, voice.coeffs[c], crossfade ? voice.prevcoeffs[c] : NULL);
+                    for (int n = 0; n < ROOMBLOCKLEN; n++)
+                        output[c][n] += filtered[n];
+                }
+            }
+        }
     };
     
+    const int RoomConvolver::factors[NUMPATHS] = { 16, 8, 1 };
+    const int RoomConvolver::firstBand[NUMPATHS + 1] = { 0, 2, 3, numBands };
+    const int RoomConvolver::offsets[NUMPATHS] = { 0, (LOWTAPS - MIDTAPS) / 8, LOWTAPS - 1 };
+    
     struct EffectData
     {
         
         float p[P_NUM];
-        Vector3 prevPositons[2];
-        std::vector<Ray> sucessfullRays;
-        std::vector<float> convOverlapL;
-        std::vector<float> convOverlapR;
+        SharedValues<6> request;        // Source and listener position the room response is wanted for
+        bool traced;                    // From here up to room everything belongs to the trace worker
+        Vector3 tracedPositions[2];     // Source and listener position the latest response was traced for
+        int tracedGeometry;             // geometryVersion the latest response was traced in
+        int traceVersion;               // Version of the shared listener trace the source was last matched against
+        ImageSourceTree images;
+        std::vector<Ray> sucessfullRays; // Traced and image source paths of the latest response
+        std::vector<EarlyTap> early;
+        std::vector<EarlyTap> merged;
+        RoomConvolver room;
         union
         {
-            filterData filterBank;
-            unsigned char pad[(sizeof(filterData) + 15) & ~15]; // This entire structure must be a multiple of 16 bytes (and and instance 16 byte aligned) for PS3 SPU DMA requirements
+            BandEnergyAnalyzer bands;
+            unsigned char pad[(sizeof(BandEnergyAnalyzer) + 15) & ~15]; // This entire structure must be a multiple of 16 bytes (and and instance 16 byte aligned) for PS3 SPU DMA requirements
         };
         
     };
     
-    static void SetupFilterCoeffs(filterData* data, float samplerate)
-    {
-        data->Octave1->SetupLowpass(63, samplerate, 1);
-        data->Octave2->SetupBandpass(125, samplerate, 1);
-        data->Octave3->SetupBandpass(250, samplerate, 1);
-        data->Octave4->SetupBandpass(500, samplerate, 1);
-        data->Octave5->SetupBandpass(1000, samplerate, 1);
-        data->Octave6->SetupBandpass(2000, samplerate, 1);
-        data->Octave7->SetupBandpass(4000, samplerate, 1);
-        data->Octave8->SetupHighpass(8000, samplerate, 1);
-    }
-    
-    
     inline bool IsHostCompatible(UnityAudioEffectState* state)
     {
         return
@@ -102,6 +620,9 @@ namespace Spatializer
         return UNITY_AUDIODSP_OK;
     }
     
+    void addTraceInstance(EffectData* data);
+    void removeTraceInstance(EffectData* data);
+    
     UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK CreateCallback(UnityAudioEffectState* state)
     {
         rayOutputData.clear();
@@ -111,7 +632,17 @@ namespace Spatializer
         if (IsHostCompatible(state))
             state->spatializerdata->distanceattenuationcallback = DistanceAttenuationCallback;
         InitParametersFromDefinitions(InternalRegisterEffectDefinition, effectdata->p);
-        SetupFilterCoeffs(&effectdata->filterBank, state->samplerate);
+        // The convolvers are sized for the longest tail the current trace parameters can produce
+        int maxTailLength = (int)std::ceil((maxPathLength/C)*state->samplerate) + 1 - (int)(EARLYTIME*state->samplerate);
+        effectdata->room.Init((float)state->samplerate, std::max(maxTailLength, 0));
+        // The octave levels are measured on the transform of the mono mix of a host block, see ProcessCallback
+        int fftsize = 2;
+        while (fftsize < (int)state->dspbuffersize)
+            fftsize *= 2;
+        effectdata->bands.Init(fftsize, (float)state->samplerate);
+        FFT::Prepare(fftsize);
+        GetHRTFData();
+        addTraceInstance(effectdata);
         if(enableDebug){
             DebugInUnity(std::string("Spatialiser plugin loaded sucessfully"));
         }
@@ -125,6 +656,9 @@ namespace Spatializer
             DebugInUnity(std::string("Spatailiser plugin released:"));
         }
         EffectData* data = state->GetEffectData<EffectData>();
+        removeTraceInstance(data);
+        data->bands.Cleanup();
+        data->room.Cleanup();
         delete data;
         return UNITY_AUDIODSP_OK;
     }
@@ -167,22 +701,44 @@ namespace Spatializer
     }
     
     extern "C" ABA_API void setTraceParam(int numberOfRays,int maxLen,int maxReflec, float absorbtionCoeff){
+        MutexScopeLock lock(geometryMutex);
         absCoeff = absorbtionCoeff;
         numRays  = numberOfRays;
         sourceSphere = raySphere(numRays);
         maxPathLength = maxLen;
         maxNumReflecs = maxReflec;
+        geometryVersion++;
+    }
+    
+    extern "C" ABA_API void setListenerTrace(bool enabled, float radius){
+        MutexScopeLock lock(geometryMutex);
+        listenerTrace = enabled;
+        detectionRadius = radius;
+        geometryVersion++;
+    }
+    
+    extern "C" ABA_API void setImageSourceOrder(int order){
+        MutexScopeLock lock(geometryMutex);
+        imageSourceOrder = std::min(std::max(order, 0), (int)ImageSourceTree::MAXORDER);
+        geometryVersion++;
     }
     
-    extern "C" ABA_API void marshalGeomeTree(int numNodes,int numTri, int depth,int bbl,float boundingBoxes[],int tl,float triangles[],int lsl,int leafSizes[],int tidl, int triangleIds[],int tml,float triangleMatList[]) {
+    extern "C" ABA_API void marshalGeomeTree(int numNodes,int numTri, int depth,int bbl,float boundingBoxes[],int tl,float triangles[],int lsl,int leafSizes[],int tidl, int triangleIds[],int tml,float triangleMatList[],int tsl,float triangleScatterList[]) {
         rayOutputData.clear();
         std::deque<float> boundingList(boundingBoxes, boundingBoxes + bbl);
         std::deque<float> triangleList(triangles, triangles + tl);
         std::deque<int> leafSizeList(leafSizes, leafSizes + lsl);
         std::deque<int> triangleIdList(triangleIds, triangleIds + tidl);
         std::deque<float> triangleMats(triangleMatList, triangleMatList + tml);
+        std::deque<float> triangleScatter(triangleScatterList, triangleScatterList + tsl);
         
-        triangleTree = new GeomeTree(depth,&boundingList,&triangleList,&leafSizeList,&triangleIdList,&triangleMats);
+        GeomeTree* tree = new GeomeTree(depth,&boundingList,&triangleList,&leafSizeList,&triangleIdList,&triangleMats,&triangleScatter);
+        {
+            MutexScopeLock lock(geometryMutex);
+            triangleTree = tree;
+            ImageSourceTree::findPlanes(triangleTree, &reflectionPlanes);
+            geometryVersion++;
+        }
         if(enableDebug){
             std::stringstream sstr;
             sstr << "received and constructed tree with ";
@@ -190,7 +746,6 @@ namespace Spatializer
             sstr << " nodes";
             sendStringStream(&sstr);
         }
-        newTree = true;
         treeInit = true;
     }
     
@@ -209,63 +764,328 @@ namespace Spatializer
         
     }
     
-    void shootRays(std::vector<Ray> *inputRayList,std::vector<Ray> *outputRayList){
+    // Energy weight of a path that a receiver sphere of radius detectionRadius detects at the given distance along it, with
+    // the path passing offset away from the centre. Each ray stands for an equal part of the directions around its start,
+    // so the number of rays that hit the sphere grows with the solid angle it covers. Dividing by that solid angle and by
+    // the spreading of the path makes the sum over the rays of one image source independent of both the number of rays and
+    // the radius. Paths shorter than the radius start inside the sphere and are weighted as if they started on its surface.
+    // Weighting each hit by its chord through the sphere, relative to the mean chord, lowers the variance of that sum.
+    float receiverWeight(float distance, float offset) {
+        float d = std::max(distance, detectionRadius);
+        float ratio2 = (detectionRadius*detectionRadius)/(d*d);
+        float solidAngle = 2.0f*kPI*ratio2/(1.0f + sqrtf(1.0f - ratio2));
+        float chord = 1.5f*sqrtf(std::max(1.0f - (offset*offset)/(detectionRadius*detectionRadius), 0.0f));
+        return 4.0f*kPI*chord/((float)sourceSphere.rays.size()*solidAngle*d*d);
+    }
+    
+    // Specular paths up to imageOrder, the order the image sources of the source were found for, are found exactly by the
+    // image source method and left out of the tracing
+    static bool isTracedOrder(int numReflecs, bool scattered, int imageOrder) {
+        return imageOrder == 0 || scattered || numReflecs > imageOrder;
+    }
+    
+    // Diffuse rain: the scattered part of the energy reflected at the point the ray has just reached is sent straight to
+    // the receiver, if the receiver can be seen from there. The Lambert distribution sends the part
+    // 2cos(theta)(1 - cos(gamma)) of it into the cone of half angle gamma that the receiver sphere fills, which is divided
+    // by the cross section of the sphere like the energy of a ray that hits it.
+    void addDiffuseRain(const Ray& ray, const Tri& hit, const Vector3& receiver, std::vector<Ray> *outputRayList){
+        Vector3 toReceiver = receiver - ray.origin;
+        float dist = toReceiver.length();
+        if(hit.scatterCoeff <= 0.0f || dist <= kEpsilon) {
+            return;
+        }
+        toReceiver = toReceiver/dist;
+        Vector3 normal = (ray.direction.Dot(hit.faceNorm) > 0.0f) ? hit.faceNorm*(-1.0f) : hit.faceNorm;
+        float cosine = toReceiver.Dot(normal);
+        if(cosine <= 0.0f) {
+            return;
+        }
+        Ray shadow = Ray(ray.origin, toReceiver);
+        float hitDist;
+        if(triangleTree->nearestHit(&shadow, &hitDist, NULL, kSurfaceOffset) && hitDist < dist) {
+            return;
+        }
+        float d = std::max(dist, detectionRadius);
+        float ratio2 = (detectionRadius*detectionRadius)/(d*d);
+        float cone = 2.0f*cosine*ratio2/(1.0f + sqrtf(1.0f - ratio2));
+        Ray arrival = ray;
+        arrival.arrival = toReceiver*(-1.0f);
+        arrival.pathLength += dist;
+        arrival.absorbtion *= hit.scatterCoeff;
+        arrival.detection = 4.0f*cone/((float)sourceSphere.rays.size()*detectionRadius*detectionRadius);
+        arrival.scattered = true;
+        arrival.listenerTag = 0;
+        outputRayList->push_back(arrival);
+    }
+    
+    // Records an arrival for every segment of a ray that passes within detectionRadius of the receiver, before the ray
+    // reaches the surface it hits next at distance length. The ray then carries on, so one ray can be detected on any
+    // number of its reflections. The ear meshes are not needed for this and are passed through.
+    // The scattered energy of every reflection reaches the receiver as diffuse rain, so a segment that leaves a surface in
+    // a scattered direction is not detected itself, or that energy would be counted twice.
+    void shootRays(std::vector<Ray> *inputRayList,std::vector<Ray> *outputRayList,const Vector3& receiver,int imageOrder){
         // For each ray in the raylist, itterate backwards to avoid indexing problems when removing
         // from the list
         for (int i = inputRayList->size()-1; i >= 0; i--) {
-            // Get list of triangles the ray might intersect with according to bounding heirarchy
-            std::deque<Tri> candidates = triangleTree->getCandidates(&inputRayList->at(i));
-            // If candidate list has been populated test the ray against each, otherwise delete!
-            if(candidates.size() > 0) {
-                float min = INFINITY;
-                int minDistIdx = 0;
-                for(int j = 0; j < candidates.size();j++){
-                    float t;
-                    bool intersectResult = inputRayList->at(i).testIntersect(&candidates[j], &t);
-                    if(intersectResult){
-                        if(t < min && t > kEpsilon) {
-                            min = t;
-                            minDistIdx = j;
-                        }
-                    }
+            Ray& ray = inputRayList->at(i);
+            // Nearest surface according to the bounding heirarchy
+            float min;
+            Tri hit;
+            bool surface = triangleTree->nearestHit(&ray, &min, &hit);
+            RaySegment segment;
+            segment.origin = ray.origin;
+            segment.direction = ray.direction;
+            segment.length = surface ? min : (maxPathLength - ray.pathLength);
+            float t;
+            float offset = segment.distanceTo(receiver, &t);
+            if(!ray.diffuse && isTracedOrder(ray.numReflecs, ray.scattered, imageOrder) && offset <= detectionRadius && t < segment.length) {
+                Ray arrival = ray;
+                arrival.arrival = ray.direction*(-1.0f);
+                arrival.pathLength += t;
+                arrival.detection = receiverWeight(arrival.pathLength, offset);
+                arrival.listenerTag = 0;
+                outputRayList->push_back(arrival);
+            }
+            // if no surface is hit the ray has left the room
+            if(!surface){
+                addToDebugList(&ray, NULL);
+                inputRayList->erase(inputRayList->begin()+i);
+                continue;
+            }
+            addToDebugList(&ray, &min);
+            // Update origin
+            ray.origin = ray.origin + (ray.direction * min);
+            // Update number of reflections
+            ray.numReflecs++;
+            // Update path length
+            ray.pathLength += min;
+            // update absorbtion
+            ray.absorbtion *= (1.0f-hit.absorbitonCoeff);
+            addDiffuseRain(ray, hit, receiver, outputRayList);
+            //Update angle
+            ray.scatterDirec(hit.faceNorm, hit.scatterCoeff, scatterRandom);
+            if(ray.numReflecs >= maxNumReflecs || ray.pathLength >= maxPathLength || ray.absorbtion < 0.01){
+                addToDebugList(&ray, NULL);
+                inputRayList->erase(inputRayList->begin()+i);
+            }
+        }
+        if(inputRayList->size() > 0) {
+            shootRays(inputRayList, outputRayList, receiver, imageOrder);
+        }
+    }
+    
+    // Follows every ray of the sphere from the listener until it dies and keeps the straight parts of its path. The ear
+    // meshes move with the listener and would stop every ray where it starts, so tagged triangles are passed through.
+    // Rays that leave the geometry can still pass sources up to the maximum path length. The sources are only known when
+    // the paths are matched, so there is no diffuse rain here, and segments that leave a surface in a scattered direction
+    // are matched like any other.
+    void traceFromListener(const Vector3& listenerPos, std::vector<RaySegment> *segments){
+        for(int i = 0; i < sourceSphere.rays.size(); i++) {
+            Ray ray = Ray(listenerPos, sourceSphere.rays[i].direction);
+            ray.id = i;
+            RaySegment segment;
+            segment.arrival = ray.direction;
+            while(true) {
+                float min;
+                Tri hit;
+                bool surface = triangleTree->nearestHit(&ray, &min, &hit);
+                segment.origin = ray.origin;
+                segment.direction = ray.direction;
+                segment.pathLength = ray.pathLength;
+                segment.absorbtion = ray.absorbtion;
+                segment.numReflecs = ray.numReflecs;
+                segment.scattered = ray.scattered;
+                if(!surface) {
+                    segment.length = maxPathLength - ray.pathLength;
+                    segments->push_back(segment);
+                    addToDebugList(&ray, NULL);
+                    break;
                 }
-                // if minimum distance is not infinity (therefore no valid intersections)
-                // update the ray
-                if(min != INFINITY){
-                    
-                    addToDebugList(&inputRayList->at(i), &min);
-                    // Update origin
-                    inputRayList->at(i).origin = inputRayList->at(i).origin + (inputRayList->at(i).direction * fabsf(min));
-                    // Update number of reflections
-                    inputRayList->at(i).numReflecs++;
-                    // Update path length
-                    inputRayList->at(i).pathLength += fabsf(min);
-                    //Update angle
-                    inputRayList->at(i).updateDirec(candidates[minDistIdx].faceNorm);
-                    // update absorbtion
-                    inputRayList->at(i).absorbtion *= (1.0f-candidates[minDistIdx].absorbitonCoeff);
-                    if(candidates[minDistIdx].objectType != 0){
-                        inputRayList->at(i).listenerTag = candidates[minDistIdx].objectType;
-                        addToDebugList(&inputRayList->at(i), &min);
-                        outputRayList->push_back(inputRayList->at(i));
-                        inputRayList->erase(inputRayList->begin()+i);
-                    }else{
-                        if(inputRayList->at(i).numReflecs >= maxNumReflecs || inputRayList->at(i).pathLength >= maxPathLength || inputRayList->at(i).absorbtion < 0.01){
-                            addToDebugList(&inputRayList->at(i), NULL);
-                            inputRayList->erase(inputRayList->begin()+i);
-                        }
+                segment.length = min;
+                segments->push_back(segment);
+                addToDebugList(&ray, &min);
+                ray.origin = ray.origin + (ray.direction * min);
+                ray.numReflecs++;
+                ray.pathLength += min;
+                ray.scatterDirec(hit.faceNorm, hit.scatterCoeff, scatterRandom);
+                ray.absorbtion *= (1.0f-hit.absorbitonCoeff);
+                if(ray.numReflecs >= maxNumReflecs || ray.pathLength >= maxPathLength || ray.absorbtion < 0.01){
+                    break;
+                }
+            }
+        }
+    }
+    
+    // Turns the listener paths that pass within detectionRadius of the source into arrivals, as if they had been traced
+    // from the source, weighted like the receiver of the source trace. The sound arrives from the direction the path left the listener in, after the length of the path up
+    // to the point closest to the source. A point at the end of a segment is left to the segment that follows it, so a
+    // source next to a wall is not found twice by the same path.
+    void matchSource(const std::vector<RaySegment>& segments, const Vector3& sourcePos, int imageOrder, std::vector<Ray> *outputRayList){
+        for(int i = 0; i < segments.size(); i++) {
+            const RaySegment& segment = segments[i];
+            float t;
+            float offset = segment.distanceTo(sourcePos, &t);
+            if(!isTracedOrder(segment.numReflecs, segment.scattered, imageOrder) || offset > detectionRadius || t >= segment.length) {
+                continue;
+            }
+            Ray ray = Ray(segment.origin + (segment.direction * t), segment.direction*(-1.0f));
+            ray.arrival = segment.arrival;
+            ray.pathLength = segment.pathLength + t;
+            ray.absorbtion = segment.absorbtion;
+            ray.numReflecs = segment.numReflecs;
+            ray.detection = receiverWeight(ray.pathLength, offset);
+            ray.listenerTag = 0;
+            outputRayList->push_back(ray);
+        }
+    }
+    
+    // Retraces from the latest listener position the instances have asked for, unless the shared trace is already for that
+    // position and geometry. Called with the geometry locked.
+    void updateListenerTrace(){
+        float position[3];
+        if(!listenerTrace || !requestedListener.Read(position)) {
+            return;
+        }
+        Vector3 listenerPos = Vector3(position[0], position[1], position[2]);
+        if(sharedTrace.version != 0 && !(sharedTrace.position != listenerPos) && sharedTrace.geometry == geometryVersion) {
+            return;
+        }
+        sharedTrace.segments.clear();
+        traceFromListener(listenerPos, &sharedTrace.segments);
+        sharedTrace.position = listenerPos;
+        sharedTrace.geometry = geometryVersion;
+        sharedTrace.version++;
+    }
+    
+    void updateRoomResponse(EffectData* data);
+    void updateRoomDecay(const std::vector<Ray>& rays);
+    
+    // Finds the paths of an instance again when its source, its listener or the geometry has changed, or when the shared
+    // listener trace has, and prepares the room response from them for the audio thread. The images of the source are only
+    // enumerated again when the source or the geometry has changed. Called with the geometry locked.
+    void updateRoom(EffectData* data){
+        float positions[6];
+        if(!data->request.Read(positions)) {
+            return;
+        }
+        Vector3 sourcePos = Vector3(positions[0], positions[1], positions[2]);
+        Vector3 listenerPos = Vector3(positions[3], positions[4], positions[5]);
+        int version = listenerTrace ? sharedTrace.version : 0;
+        if(listenerTrace && version == 0) {
+            // Nothing to match the source against before the first listener trace
+            return;
+        }
+        bool moved = sourcePos != data->tracedPositions[0] || listenerPos != data->tracedPositions[1];
+        if(data->traced && !moved && data->tracedGeometry == geometryVersion && data->traceVersion == version) {
+            return;
+        }
+        
+        ImageSourceTree& images = data->images;
+        if(!data->traced || images.version != geometryVersion || sourcePos != images.source) {
+            // The images only depend on the source and the geometry, the listener position selects the valid paths
+            images.build(reflectionPlanes, triangleTree->masterNode.getBounds(), sourcePos, imageSourceOrder, maxPathLength);
+            images.version = geometryVersion;
+            if(images.truncated && enableDebug) {
+                std::stringstream sstr;
+                sstr << "image sources limited to order ";
+                sstr << images.order;
+                sendStringStream(&sstr);
+            }
+        }
+        // The tracing covers the orders above those of the images
+        data->sucessfullRays.clear();
+        if(listenerTrace) {
+            matchSource(sharedTrace.segments, sourcePos, images.order, &data->sucessfullRays);
+        }else {
+            std::vector<Ray> sourceRays = sourceSphere.getRayList(sourcePos);
+            shootRays(&sourceRays, &data->sucessfullRays, listenerPos, images.order);
+        }
+        if(images.order > 0) {
+            images.findPaths(triangleTree, reflectionPlanes, listenerPos, detectionRadius, &data->sucessfullRays);
+        }
+        data->traced = true;
+        data->tracedPositions[0] = sourcePos;
+        data->tracedPositions[1] = listenerPos;
+        data->tracedGeometry = geometryVersion;
+        data->traceVersion = version;
+        
+        updateRoomResponse(data);
+        updateRoomDecay(data->sucessfullRays);
+        if(enableDebug){
+            std::stringstream sstr;
+            sstr << data->sucessfullRays.size();
+            sstr << " Sucessfull Rays";
+            sendStringStream(&sstr);
+        }
+    }
+    
+    // The trace worker runs while any instance exists and polls every kTraceWorkerInterval milliseconds, since the audio
+    // threads must neither wait for it nor wake it up. It is also stopped if the library is unloaded with instances left.
+    const static int kTraceWorkerInterval = 5;
+    
+    struct TraceWorker
+    {
+        std::thread thread;
+        std::atomic<bool> running;
+        Mutex mutex;                        // Held while the worker is started or stopped
+        std::vector<EffectData*> instances;
+        Mutex instancemutex;                // Held while instances changes and while the worker goes through it
+        
+        TraceWorker() : running(false) {}
+        ~TraceWorker() { Stop(); }
+        
+        void Stop()
+        {
+            running = false;
+            if (thread.joinable())
+                thread.join();
+        }
+    };
+    
+    static TraceWorker traceWorker;
+    
+    void runTraceWorker() {
+        while(traceWorker.running.load()) {
+            {
+                MutexScopeLock lock(traceWorker.instancemutex);
+                if(treeInit) {
+                    MutexScopeLock geometry(geometryMutex);
+                    updateListenerTrace();
+                    for(int i = 0; i < traceWorker.instances.size(); i++) {
+                        updateRoom(traceWorker.instances[i]);
                     }
-                }else {
-                    addToDebugList(&inputRayList->at(i), NULL);
-                    inputRayList->erase(inputRayList->begin()+i);
                 }
-            }else {
-                addToDebugList(&inputRayList->at(i), NULL);
-                inputRayList->erase(inputRayList->begin()+i);
             }
+            std::this_thread::sleep_for(std::chrono::milliseconds(kTraceWorkerInterval));
         }
-        if(inputRayList->size() > 0) {
-            shootRays(inputRayList, outputRayList);
+        // No instance is left that could match against the trace
+        sharedTrace = ListenerTrace();
+    }
+    
+    void addTraceInstance(EffectData* data) {
+        MutexScopeLock lock(traceWorker.mutex);
+        bool start = false;
+        {
+            MutexScopeLock instances(traceWorker.instancemutex);
+            start = traceWorker.instances.empty();
+            traceWorker.instances.push_back(data);
+        }
+        if(start) {
+            traceWorker.running = true;
+            traceWorker.thread = std::thread(runTraceWorker);
+        }
+    }
+    
+    void removeTraceInstance(EffectData* data) {
+        MutexScopeLock lock(traceWorker.mutex);
+        bool stop = false;
+        {
+            MutexScopeLock instances(traceWorker.instancemutex);
+            traceWorker.instances.erase(std::find(traceWorker.instances.begin(), traceWorker.instances.end(), data));
+            stop = traceWorker.instances.empty();
+        }
+        if(stop) {
+            traceWorker.Stop();
         }
     }
     
@@ -276,102 +1096,258 @@ namespace Spatializer
         sendStringStream(&sstr);
     }
     
-    void calcImpResponse(float* listenerMatrix,float* sourceMatrix, float octavePower[],EffectData* data,std::vector<float>* left,std::vector<float>* right) {
-        
-        Vector3 sourcePos = Vector3(sourceMatrix[12], sourceMatrix[13], sourceMatrix[14]);
-        Vector3 listenerPos = Vector3(listenerMatrix[12], listenerMatrix[13], sourceMatrix[14]);
-        float maxL = -INFINITY;
-        float maxR = -INFINITY;
-        std::vector<int> idxL;
-        std::vector<int> idxR;
-        bool reShoot = false;
+    // Groups the early taps into at most MAXCLUSTERS virtual sources. The strongest taps are visited first and seed the
+    // clusters; every tap joins the closest cluster in direction and time, or starts a new one if none is within
+    // CLUSTERANGLE and CLUSTERTIME while clusters are left. Returns the number of clusters.
+    int clusterReflections(const std::vector<EarlyTap>& taps, float samplerate, ReflectionCluster* clusters) {
+        std::vector<float> weights(taps.size());
+        std::vector<int> order(taps.size());
+        for(int j = 0; j < taps.size(); j++) {
+            weights[j] = 0.0f;
+            for(int b = 0; b < numBands; b++) {
+                weights[j] += taps[j].gain[b];
+            }
+            order[j] = j;
+        }
+        std::sort(order.begin(), order.end(), [&weights](int a, int b) {
+            return weights[a] > weights[b];
+        });
         
-        if(sourcePos != data->prevPositons[0]){
-            reShoot = true;
-            data->prevPositons[0] = sourcePos;
+        float weight[MAXCLUSTERS];
+        Vector3 seed[MAXCLUSTERS];
+        Vector3 direction[MAXCLUSTERS];
+        int num = 0;
+        const float maxTime = CLUSTERTIME*samplerate;
+        for(int j = 0; j < order.size(); j++) {
+            const EarlyTap& tap = taps[order[j]];
+            float w = weights[order[j]];
+            if(w <= 0.0f) {
+                break;
+            }
+            int best = -1;
+            float bestDist = INFINITY;
+            for(int k = 0; k < num; k++) {
+                float len = direction[k].length();
+                Vector3 centre = (len > 0.0f) ? direction[k]/len : seed[k];
+                float dist = (1.0f - tap.direction.Dot(centre))/(1.0f - CLUSTERANGLE) + fabsf(tap.delay - clusters[k].delay/weight[k])/maxTime;
+                if(dist < bestDist) {
+                    bestDist = dist;
+                    best = k;
+                }
+            }
+            if(best < 0 || (bestDist > 1.0f && num < MAXCLUSTERS)) {
+                best = num++;
+                clusters[best] = ReflectionCluster();
+                weight[best] = 0.0f;
+                seed[best] = tap.direction;
+                direction[best] = Vector3(0.0f, 0.0f, 0.0f);
+            }
+            ReflectionCluster& cluster = clusters[best];
+            weight[best] += w;
+            cluster.delay += tap.delay*w;
+            direction[best] = direction[best] + tap.direction*w;
+            for(int b = 0; b < numBands; b++) {
+                cluster.gain[b] += tap.gain[b];
+            }
         }
-        if(listenerPos != data->prevPositons[1]){
-            reShoot = true;
-            data->prevPositons[1] = listenerPos;
+        for(int k = 0; k < num; k++) {
+            float len = direction[k].length();
+            clusters[k].delay /= weight[k];
+            clusters[k].direction = (len > 0.0f) ? direction[k]/len : seed[k];
         }
-        
-        if(reShoot || newTree ) {
-            data->sucessfullRays.clear();
-            std::vector<Ray> sourceRays = sourceSphere.getRayList(sourcePos);
-            shootRays(&sourceRays,&data->sucessfullRays);
-            newTree = false;
-            if(enableDebug){
-                std::stringstream sstr;
-                sstr << data->sucessfullRays.size();
-                sstr << " Sucessfull Rays";
-                sendStringStream(&sstr);
-                
+        return num;
+    }
+    
+    // Builds the room response from the traced rays, relative to the first arrival and normalized to the strongest tap of
+    // the broadband sum, and hands it to the room convolver. Rays arriving within EARLYTIME of the first one become early
+    // taps with their exact fractional delays and arrival directions, which are then clustered into the virtual sources.
+    // Later ones are encoded by their arrival direction into the per-band ambisonic tail responses, in the scratch space of
+    // the convolver. Runs on the trace worker.
+    void updateRoomResponse(EffectData* data) {
+        RoomConvolver& room = data->room;
+        float samplerate = room.samplerate;
+        std::vector<EarlyTap>& early = data->early;
+        std::vector<EarlyTap>& merged = data->merged;
+        early.clear();
+        merged.clear();
+        int first = INT_MAX;
+        int length = 0;
+        for(int j = 0; j < data->sucessfullRays.size(); j++) {
+            int sampIdx = (int)std::round((data->sucessfullRays[j].pathLength/C)*samplerate);
+            first = std::min(first, sampIdx);
+            length = std::max(length, sampIdx + 1);
+        }
+        if(length == 0) {
+            first = 0;
+        }
+        length -= first;
+        int tailStart = (int)(EARLYTIME*samplerate);
+        // Longer tails are cut off at the capacity of the convolver
+        int tailLength = std::min(std::max(length - tailStart, 0), room.capacity);
+        for(int k = 0; k < ROOMCHANNELS; k++) {
+            for(int b = 0; b < numBands; b++) {
+                memset(room.GetTailBand(k, b), 0, sizeof(float)*tailLength);
             }
         }
-        
-        for(int i = 0; i < 6; i++){
-            for(int j = 0; j < data->sucessfullRays.size(); j++) {
-                int sampIdx = (int)std::round((data->sucessfullRays[j].pathLength/C)*44100);
-                if(data->sucessfullRays[j].listenerTag == 1) {
-                    if(i == 0) {
-                        idxR.push_back(sampIdx);
-                    }
-                    if(sampIdx > right->size()) {
-                        right->resize(sampIdx+1);
-                    }
-                    right->at(sampIdx) += octavePower[i]*expf(-airAbsorbtion[i]*data->sucessfullRays[j].pathLength)*data->sucessfullRays[j].absorbtion;
-                    if(right->at(sampIdx) > maxR) {
-                        maxR = right->at(sampIdx);
-                    }
-                }else {
-                    if(i == 0) {
-                        idxL.push_back(sampIdx);
-                    }
-                    if(sampIdx > left->size()){
-                        left->resize(sampIdx+1);
-                    }
-                    left->at(sampIdx) += octavePower[i]*expf(-airAbsorbtion[i]*data->sucessfullRays[j].pathLength)*data->sucessfullRays[j].absorbtion;
-                    
-                    if(left->at(sampIdx) > maxL) {
-                        maxL = left->at(sampIdx);
+        for(int j = 0; j < data->sucessfullRays.size(); j++) {
+            const Ray& ray = data->sucessfullRays[j];
+            int sampIdx = (int)std::round((ray.pathLength/C)*samplerate) - first;
+            if(sampIdx < tailStart) {
+                EarlyTap tap;
+                tap.delay = std::max((ray.pathLength/C)*samplerate - (float)first, 0.0f);
+                tap.direction = ray.arrival;
+                for(int b = 0; b < numBands; b++) {
+                    tap.gain[b] = expf(-airAbsorbtion[b]*ray.pathLength)*ray.absorbtion*ray.detection;
+                }
+                early.push_back(tap);
+            }else if(sampIdx - tailStart < tailLength) {
+                float sh[SphericalHarmonics::MAXCHANNELS];
+                SphericalHarmonics::Evaluate(ROOMORDER, ray.arrival.X, ray.arrival.Y, ray.arrival.Z, sh);
+                for(int b = 0; b < numBands; b++) {
+                    float gain = expf(-airAbsorbtion[b]*ray.pathLength)*ray.absorbtion*ray.detection;
+                    for(int k = 0; k < ROOMCHANNELS; k++) {
+                        room.GetTailBand(k, b)[sampIdx - tailStart] += sh[k]*gain;
                     }
-                    
                 }
             }
         }
         
-        int minL = left->size();
-        int minR = right->size();
-        // Normalise IR and remove front zeros
-        for(int i = 0; i < idxL.size(); i++) {
-            int idx =idxL[i];
-            left->at(idx) = left->at(idx)/maxL ;
-            if(idx < minL) {
-                minL = idx;
+        // Merge the rays that arrive in the same sample, so the tap count is bounded by the early time
+        std::sort(early.begin(), early.end(), [](const EarlyTap& a, const EarlyTap& b) {
+            return a.delay < b.delay;
+        });
+        for(int j = 0; j < early.size(); j++) {
+            const EarlyTap& tap = early[j];
+            float weight = 0.0f;
+            for(int b = 0; b < numBands; b++) {
+                weight += tap.gain[b];
+            }
+            int sample = (int)std::round(tap.delay);
+            if(merged.empty() || merged.back().sample != sample) {
+                merged.push_back(tap);
+                merged.back().delay *= weight;
+                merged.back().direction = tap.direction*weight;
+                merged.back().sample = sample;
+                merged.back().weight = weight;
+                continue;
+            }
+            EarlyTap& dest = merged.back();
+            dest.delay += tap.delay*weight;
+            dest.direction = dest.direction + tap.direction*weight;
+            dest.weight += weight;
+            for(int b = 0; b < numBands; b++) {
+                dest.gain[b] += tap.gain[b];
             }
         }
-        for(int i = 0; i < idxR.size(); i++) {
-            int idx =idxR[i];
-            right->at(idx) = right->at(idx)/maxR;
-            if(idx < minR) {
-                minR = idx;
+        
+        float peak = 0.0f;
+        for(int j = 0; j < merged.size(); j++) {
+            EarlyTap& tap = merged[j];
+            if(tap.weight > 0.0f) {
+                tap.delay /= tap.weight;
+                tap.direction = tap.direction/tap.weight;
+            }else {
+                tap.delay = (float)tap.sample;
+            }
+            if(tap.direction.length() > 0.0f) {
+                tap.direction.Normalize();
             }
+            peak = std::max(peak, tap.weight);
         }
-        int min = std::min(minL, minR);
-        left->erase(left->begin(), left->begin()+min);
-        right->erase(right->begin(), right->begin()+min);
+        // The omnidirectional channel holds the plain sum of the tail rays
+        for(int n = 0; n < tailLength; n++) {
+            float sum = 0.0f;
+            for(int b = 0; b < numBands; b++) {
+                sum += room.GetTailBand(0, b)[n];
+            }
+            peak = std::max(peak, sum);
+        }
+        if(peak > 0.0f) {
+            for(int j = 0; j < merged.size(); j++) {
+                for(int b = 0; b < numBands; b++) {
+                    merged[j].gain[b] /= peak;
+                }
+            }
+            for(int k = 0; k < ROOMCHANNELS; k++) {
+                for(int b = 0; b < numBands; b++) {
+                    float* tail = room.GetTailBand(k, b);
+                    for(int n = 0; n < tailLength; n++) {
+                        tail[n] /= peak;
+                    }
+                }
+            }
+        }
+        ReflectionCluster clusters[MAXCLUSTERS];
+        int numClusters = clusterReflections(merged, samplerate, clusters);
+        room.PrepareResponse(tailLength, clusters, numClusters);
+    }
+    
+    // Estimates the decay time of each band with a least-squares fit of the ray energies in dB against their arrival times
+    // and publishes it, paired up into the low, mid and high band, for the feedback delay network of the reverb. Nothing is
+    // published unless every band could be fitted, so the reverb always gets the complete set of one room.
+    void updateRoomDecay(const std::vector<Ray>& rays) {
+        float t60[numBands];
+        for(int b = 0; b < numBands; b++) {
+            double n = 0.0, st = 0.0, sx = 0.0, stt = 0.0, stx = 0.0;
+            for(int j = 0; j < rays.size(); j++) {
+                float energy = expf(-airAbsorbtion[b]*rays[j].pathLength)*rays[j].absorbtion;
+                if(energy <= 0.0f) {
+                    continue;
+                }
+                double t = rays[j].pathLength/C;
+                double x = 10.0*log10(energy);
+                n += 1.0;
+                st += t;
+                sx += x;
+                stt += t*t;
+                stx += t*x;
+            }
+            double denom = n*stt - st*st;
+            if(n < 2.0 || denom <= 0.0) {
+                return;
+            }
+            double slope = (n*stx - st*sx)/denom;
+            if(slope >= 0.0) {
+                return;
+            }
+            t60[b] = (float)std::min(-60.0/slope, 20.0);
+        }
+        float decay[FeedbackDelayNetwork::NUMBANDS];
+        for(int b = 0; b < FeedbackDelayNetwork::NUMBANDS; b++) {
+            decay[b] = 0.5f*(t60[b*2] + t60[b*2+1]);
+        }
+        reverbroomdecay.Write(decay);
+    }
+    
+    // Asks the trace worker for the room response of the current source and listener position, and swaps in the latest
+    // one it has prepared.
+    void calcImpResponse(float* listenerMatrix,float* sourceMatrix, float octavePower[],EffectData* data) {
+        
+        Vector3 sourcePos = Vector3(sourceMatrix[12], sourceMatrix[13], sourceMatrix[14]);
+        // The listener matrix maps world space into the listener's frame, so its translation changes when the head turns.
+        // Only the position it was built from triggers a retrace; the orientation is applied while rendering.
+        const float* m = listenerMatrix;
+        Vector3 listenerPos = Vector3(-(m[0]*m[12] + m[1]*m[13] + m[2]*m[14]), -(m[4]*m[12] + m[5]*m[13] + m[6]*m[14]), -(m[8]*m[12] + m[9]*m[13] + m[10]*m[14]));
+        
+        float positions[6] = { sourcePos.X, sourcePos.Y, sourcePos.Z, listenerPos.X, listenerPos.Y, listenerPos.Z };
+        data->request.Write(positions);
+        if(listenerTrace) {
+            requestedListener.Write(positions + 3);
+        }
+        data->room.UpdateResponse();
         
         if(textWritten){
-            std::ofstream arrayDataL("/Users/Alex/IRL.txt");
-            std::ofstream arrayDataR("/Users/Alex/IRR.txt");
-            
-            for(int i = 0;i < left->size();i++){
-                arrayDataL << left->at(i);
-                arrayDataL<< ",";
-            }
-            for(int i = 0;i < right->size();i++){
-                arrayDataR << right->at(i);
-                arrayDataR<< ",";
+            // Reflection clusters as delay:level:x:y:z, weighted with the current octave power of the source
+            const RoomConvolver& room = data->room;
+            std::ofstream arrayData("/Users/Alex/IR.txt");
+            for(int i = 0; i < room.numvoices; i++){
+                const ReflectionCluster& cluster = room.voices[i].cluster;
+                float level = 0.0f;
+                for(int b = 0; b < numBands; b++) {
+                    level += octavePower[b]*cluster.gain[b];
+                }
+                arrayData << cluster.delay << ":" << level << ":" << cluster.direction.X << ":" << cluster.direction.Y << ":" << cluster.direction.Z;
+                arrayData << ",";
             }
             textWritten = false;
             if(enableDebug) {
@@ -399,39 +1375,34 @@ namespace Spatializer
         }
         
         EffectData* data = state->GetEffectData<EffectData>();
-        float octavePower[6] = {0.0f};
-        float mono[length];
-        UnityComplexNumber compMono[length/2];
+        // The octave levels are read from the spectrum of the mono mix, zero-padded to the next power of two.
+        // Only the first six bands are used for the impulse response.
+        int fftsize = 2;
+        while (fftsize < (int)length)
+            fftsize *= 2;
+        float octavePower[BandEnergyAnalyzer::NUMBANDS];
+        float mono[fftsize];
+        float monore[fftsize];
+        float monoim[fftsize];
+        UnityComplexNumber compMono[fftsize / 2];
         for (unsigned int n = 0; n < length; n++)
-        {
             mono[n] = (inbuffer[n * 2] + inbuffer[n * 2 + 1]) / 2.0f;
-            compMono[n].re = mono[n];
-            compMono[n].im = 0.0f;
-            octavePower[0] += powf(data->filterBank.Octave1[0].Process(mono[n]),2.0f);
-            octavePower[1] += powf(data->filterBank.Octave2[0].Process(mono[n]),2.0);
-            octavePower[2] += powf(data->filterBank.Octave3[0].Process(mono[n]),2.0f);
-            octavePower[3] += powf(data->filterBank.Octave4[0].Process(mono[n]),2.0f);
-            octavePower[4] += powf(data->filterBank.Octave5[0].Process(mono[n]),2.0f);
-            octavePower[5] += powf(data->filterBank.Octave6[0].Process(mono[n]),2.0f);
-        }
-        
-        for(int i = 0 ;  i < 6; i++) {
-            octavePower[i] = sqrtf(octavePower[i]/length);
-        }
+        memset(mono + length, 0, sizeof(float) * (fftsize - length));
+        FFT::ForwardReal(mono, compMono, monore, monoim, fftsize);
+        data->bands.Process(monore, monoim, fftsize, length, octavePower);
         
-        std::vector<float> impLeft;
-        std::vector<float> impRight;
         float* l = state->spatializerdata->listenermatrix;
         float* s = state->spatializerdata->sourcematrix;
         bool impCalc = false;
         if(treeInit){
-            calcImpResponse(l,s,octavePower,data,&impLeft,&impRight);
+            calcImpResponse(l,s,octavePower,data);
             impCalc = true;
         }
-                if(impCalc == true) {
-                    
-                    
-                }
+        if(impCalc) {
+            data->room.Process(mono, outbuffer, length, l, GetHRTFData());
+        }else {
+            memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
+        }
         //        std::stringstream sstr2;
         //        sstr2 << diff;
         //        sendStringStream(&sstr2);
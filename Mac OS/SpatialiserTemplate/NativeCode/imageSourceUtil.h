@@ -0,0 +1,176 @@
+#pragma once
+
+#include "rayTraceUtil.h"
+#include <algorithm>
+
+const float kSurfaceOffset = 1e-3f;    // Distance from a reflection point within which the next leg ignores surfaces
+
+// Plane of the room geometry that sources are mirrored in. Coplanar triangles share one plane, whichever way they face.
+struct ReflectionPlane {
+    Vector3 normal;
+    float offset;       // normal.Dot(p) for every point p on the plane
+
+    inline Vector3 mirror(const Vector3& p) const
+    {return p - (normal*(2.0f*(normal.Dot(p) - offset)));}
+
+    inline bool contains(const Tri& tri) const
+    {return fabsf(normal.Dot(tri.faceNorm)) > 0.999f && fabsf(normal.Dot(tri.P1) - offset) < 1e-3f;}
+};
+
+// Source mirrored in the planes of its parents and then in plane. First order images have no parent.
+struct ImageSource {
+    Vector3 position;
+    int plane;
+    int parent;
+    int order;
+};
+
+// Specular reflections found with the image source method. The images of one source are enumerated up to maxOrder and
+// kept while the source stays put. For each listener position the path of every image is followed back to the source
+// through the BVH: each leg has to hit the plane of its image first, at the point the image predicts, and the last leg
+// must reach the source unblocked. The paths that pass come out as rays, like those of the tracer, with the direct
+// sound as the path of order 0. Only the specular part of the energy follows an image, the scattered part is left to
+// the tracer, and so are the orders above order, which is lowered when MAXIMAGES cuts the enumeration short.
+class ImageSourceTree {
+public:
+    enum { MAXORDER = 3, MAXIMAGES = 20000 };
+
+    std::vector<ImageSource> images;
+    Vector3 source;
+    int order = 0;      // Highest order whose images are all enumerated
+    bool truncated = false;
+    int version = 0;    // Geometry version the images were enumerated for
+
+    static inline void findPlanes(GeomeTree *tree, std::vector<ReflectionPlane> *planes) {
+        std::vector<Tri> triangles;
+        tree->getTriangles(&tree->masterNode, &triangles);
+        planes->clear();
+        for(int i = 0; i < triangles.size(); i++) {
+            const Tri& tri = triangles[i];
+            if(tri.objectType != 0) {
+                continue;
+            }
+            bool known = false;
+            for(int j = 0; j < planes->size() && !known; j++) {
+                known = planes->at(j).contains(tri);
+            }
+            if(!known) {
+                ReflectionPlane plane;
+                plane.normal = tri.faceNorm;
+                plane.normal.Normalize();
+                plane.offset = plane.normal.Dot(tri.P1);
+                planes->push_back(plane);
+            }
+        }
+    }
+
+    // Enumerates the images order by order, up to MAXIMAGES. An image is never mirrored in its own plane again, and images
+    // further than maxPathLength from the bounds of the geometry, which the listener is inside of, are dropped together
+    // with their children. If an order does not fit, its images are dropped as well and order stops at the one before.
+    inline void build(const std::vector<ReflectionPlane>& planes, const Bounds& bounds, const Vector3& sourcePos, int maxOrder, float maxPathLength) {
+        images.clear();
+        source = sourcePos;
+        order = std::min(maxOrder, (int)MAXORDER);
+        truncated = false;
+        int begin = 0;
+        for(int o = 1; o <= order; o++) {
+            // The parents are the source for the first order and the images of the previous order after that
+            int end = images.size();
+            int numParents = (o == 1) ? 1 : (end - begin);
+            for(int k = 0; k < numParents; k++) {
+                int parent = (o == 1) ? -1 : (begin + k);
+                Vector3 position = (parent < 0) ? source : images[parent].position;
+                for(int p = 0; p < planes.size(); p++) {
+                    if(parent >= 0 && images[parent].plane == p) {
+                        continue;
+                    }
+                    ImageSource image;
+                    image.position = planes[p].mirror(position);
+                    if(distanceTo(bounds, image.position) > maxPathLength) {
+                        continue;
+                    }
+                    if(images.size() >= MAXIMAGES) {
+                        images.resize(end);
+                        order = o - 1;
+                        truncated = true;
+                        return;
+                    }
+                    image.plane = p;
+                    image.parent = parent;
+                    image.order = o;
+                    images.push_back(image);
+                }
+            }
+            begin = end;
+        }
+    }
+
+    // Adds a ray for the direct sound and for every image whose path is valid from the listener. The energy of a path is
+    // the product of the specular reflection factors of its surfaces over the square of its length, which is never taken
+    // as less than minDist.
+    inline void findPaths(GeomeTree *tree, const std::vector<ReflectionPlane>& planes, const Vector3& listener, float minDist, std::vector<Ray> *outputRayList) {
+        addPath(tree, listener, listener, source, 1.0f, 0, minDist, outputRayList);
+        for(int i = 0; i < images.size(); i++) {
+            Vector3 from = listener;
+            float absorbtion = 1.0f;
+            bool valid = true;
+            for(int idx = i; idx >= 0 && valid; idx = images[idx].parent) {
+                const ReflectionPlane& plane = planes[images[idx].plane];
+                Vector3 direction = images[idx].position - from;
+                float dist = direction.length();
+                direction = direction/dist;
+                float denom = direction.Dot(plane.normal);
+                float t = (fabsf(denom) < kEpsilon) ? -1.0f : (plane.offset - plane.normal.Dot(from))/denom;
+                Ray ray = Ray(from, direction);
+                float hitDist;
+                Tri hit;
+                valid = t > kSurfaceOffset && t < dist && tree->nearestHit(&ray, &hitDist, &hit, kSurfaceOffset) && fabsf(hitDist - t) < kSurfaceOffset*(1.0f + t) && plane.contains(hit);
+                if(valid) {
+                    absorbtion *= (1.0f - hit.absorbitonCoeff)*(1.0f - hit.scatterCoeff);
+                    from = from + (direction * t);
+                }
+            }
+            if(valid) {
+                addPath(tree, listener, from, images[i].position, absorbtion, images[i].order, minDist, outputRayList);
+            }
+        }
+    }
+
+protected:
+    static inline float distanceTo(const Bounds& bounds, const Vector3& p) {
+        float dx = std::max(std::max(bounds.parameters[0].X - p.X, p.X - bounds.parameters[1].X), 0.0f);
+        float dy = std::max(std::max(bounds.parameters[0].Y - p.Y, p.Y - bounds.parameters[1].Y), 0.0f);
+        float dz = std::max(std::max(bounds.parameters[0].Z - p.Z, p.Z - bounds.parameters[1].Z), 0.0f);
+        return sqrtf(dx*dx + dy*dy + dz*dz);
+    }
+
+    // The last leg runs from the final reflection point, or the listener for the direct sound, to the source. The sound
+    // arrives from the image, which is the source for the direct sound.
+    inline void addPath(GeomeTree *tree, const Vector3& listener, const Vector3& from, const Vector3& image, float absorbtion, int numReflecs, float minDist, std::vector<Ray> *outputRayList) {
+        Vector3 direction = source - from;
+        float dist = direction.length();
+        if(dist > kEpsilon) {
+            direction = direction/dist;
+            Ray leg = Ray(from, direction);
+            float hitDist;
+            if(tree->nearestHit(&leg, &hitDist, NULL, (numReflecs > 0) ? kSurfaceOffset : kEpsilon) && hitDist < dist) {
+                return;
+            }
+        }
+        Vector3 arrival = image - listener;
+        float pathLength = arrival.length();
+        if(pathLength <= kEpsilon) {
+            return;
+        }
+        arrival = arrival/pathLength;
+        Ray ray = Ray(listener, arrival);
+        ray.arrival = arrival;
+        ray.pathLength = pathLength;
+        ray.absorbtion = absorbtion;
+        ray.numReflecs = numReflecs;
+        ray.listenerTag = 0;
+        float d = std::max(pathLength, minDist);
+        ray.detection = 1.0f/(d*d);
+        outputRayList->push_back(ray);
+    }
+};
@@ -1,8 +1,11 @@
+#pragma once
+
 #include <vector>
 #include <deque>
 #include <string>
 #include <sstream>
 #include <cmath>
+#include <cstdint>
 #include <pthread.h>
 
 
@@ -97,14 +100,44 @@ public:
     }
 };
 
+// Counter-based random numbers (Philox4x32-10 of Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"). The
+// numbers are a function of the key and the counter alone, so a ray draws the same numbers at every bounce no matter
+// in which order or on which thread the rays are traced, and no state is shared between them.
+struct Philox {
+    uint32_t key[2];
+    inline Philox(uint32_t n_k0, uint32_t n_k1)
+    {key[0] = n_k0; key[1] = n_k1;}
+    // Four uniform numbers in [0, 1) for the counter c0..c3
+    inline void generate(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3, float *out) const {
+        uint32_t ctr[4] = {c0, c1, c2, c3};
+        uint32_t k0 = key[0], k1 = key[1];
+        for(int round = 0; round < 10; round++) {
+            uint64_t p0 = (uint64_t)0xD2511F53u * ctr[0];
+            uint64_t p1 = (uint64_t)0xCD9E8D57u * ctr[2];
+            uint32_t n0 = (uint32_t)(p1 >> 32) ^ ctr[1] ^ k0;
+            uint32_t n2 = (uint32_t)(p0 >> 32) ^ ctr[3] ^ k1;
+            ctr[0] = n0;
+            ctr[1] = (uint32_t)p1;
+            ctr[2] = n2;
+            ctr[3] = (uint32_t)p0;
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        for(int i = 0; i < 4; i++) {
+            out[i] = (float)(ctr[i] >> 8) * (1.0f / 16777216.0f);
+        }
+    }
+};
+
 class Tri {
 public:
     Vector3 P1,P2,P3,faceNorm;
     float absorbitonCoeff;
+    float scatterCoeff;     // Part of the reflected energy that is scattered diffusely
     int objectType;
     inline Tri(){};
-    inline Tri(Vector3 n_p1,Vector3 n_p2,Vector3 n_p3,Vector3 n_fn,int n_ls,float n_abs)
-    {P1 = n_p1; P2 = n_p2; P3 = n_p3; faceNorm = n_fn;objectType = n_ls;absorbitonCoeff = n_abs;}
+    inline Tri(Vector3 n_p1,Vector3 n_p2,Vector3 n_p3,Vector3 n_fn,int n_ls,float n_abs,float n_scat)
+    {P1 = n_p1; P2 = n_p2; P3 = n_p3; faceNorm = n_fn;objectType = n_ls;absorbitonCoeff = n_abs;scatterCoeff = n_scat;}
     inline void setVerts(Vector3 n_p1,Vector3 n_p2,Vector3 n_p3)
     {P1 = n_p1; P2 = n_p2; P3 = n_p3;}
     inline void setFaceNorm(Vector3 n_fn)
@@ -114,10 +147,15 @@ public:
 class Ray {
 public:
     Vector3 origin,direction,invDirection;
+    Vector3 arrival;    // Direction the ray came from when it hit the listener, in world space
     float absorbtion = 1;
     float pathLength = 0;
+    float detection = 1;    // Energy weight of the receiver that detected the ray
     int numReflecs = 0;
     int listenerTag = 5;
+    int id = 0;             // Position in the ray sphere, which keys its random numbers
+    bool scattered = false; // Has been reflected diffusely, so no image source stands for its path
+    bool diffuse = false;   // Left the last surface in a scattered direction
     int sign[3];
     inline Ray(){};
     inline Ray(Vector3 n_o, Vector3 n_d)
@@ -146,6 +184,26 @@ public:
         sign[2] = (invDirection.Z < 0);
 
     }
+    // Reflects off a surface that scatters the part scatter of the energy. The ray takes the specular direction or, with
+    // probability scatter, a direction from the Lambert distribution around the normal on the side it came from. The
+    // random numbers are drawn for the ray and the bounce, so the choice is the same whenever the ray is traced again.
+    inline void scatterDirec(Vector3 normal, float scatter, const Philox& rng) {
+        float u[4];
+        rng.generate((uint32_t)id, (uint32_t)numReflecs, 0, 0, u);
+        diffuse = u[0] < scatter;
+        if(!diffuse) {
+            updateDirec(normal);
+            return;
+        }
+        scattered = true;
+        Vector3 n = (direction.Dot(normal) > 0.0f) ? normal*(-1.0f) : normal;
+        Vector3 tangent = (fabsf(n.X) > 0.5f) ? Vector3(n.Z, 0.0f, -n.X) : Vector3(0.0f, -n.Z, n.Y);
+        tangent.Normalize();
+        Vector3 bitangent = n.cross(tangent);
+        float r = sqrtf(u[1]);
+        float phi = 2.0f*(float)M_PI*u[2];
+        setDirection(tangent*(r*cosf(phi)) + bitangent*(r*sinf(phi)) + n*sqrtf(fmaxf(1.0f - u[1], 0.0f)));
+    }
     inline bool testIntersect(Tri *tri,float *t){
         float u,v;
         Vector3 v0v1 = tri->P2 - tri->P1;
@@ -169,6 +227,24 @@ public:
     
 };
 
+// Straight part of a path traced from the listener, between two reflections. Kept so that any number of sources can be
+// matched against the same paths.
+struct RaySegment {
+    Vector3 origin,direction;
+    Vector3 arrival;        // Direction the path left the listener in, which is the direction its sound arrives from
+    float length;
+    float pathLength = 0;   // Length of the path up to origin
+    float absorbtion = 1;
+    int numReflecs = 0;
+    bool scattered = false; // Some surface on the path up to origin reflected it diffusely
+    // Distance of point from the segment. t receives how far along the segment the closest point lies.
+    inline float distanceTo(const Vector3& point, float *t) const {
+        *t = fminf(fmaxf((point - origin).Dot(direction), 0.0f), length);
+        Vector3 offset = origin + (direction * *t) - point;
+        return offset.length();
+    }
+};
+
 class Bounds {
 public:
     Vector3 parameters[2];
@@ -223,7 +299,7 @@ private:
 public:
     Node *leftChild,*rightChild;
     inline Node() {}
-    inline Node(int parentDepth, int maxDepth, std::deque<float> *boundingBoxArray,std::deque<float> *triangleArray,std::deque<int> *leafSizeArray,std::deque<int> *idList,std::deque<float> *matList) {
+    inline Node(int parentDepth, int maxDepth, std::deque<float> *boundingBoxArray,std::deque<float> *triangleArray,std::deque<int> *leafSizeArray,std::deque<int> *idList,std::deque<float> *matList,std::deque<float> *scatterList) {
         this->depth = parentDepth+1;
         this->boundingBox = Bounds(Vector3(boundingBoxArray->at(0),boundingBoxArray->at(1),boundingBoxArray->at(2)),Vector3(boundingBoxArray->at(3),boundingBoxArray->at(4),boundingBoxArray->at(5)));
         boundingBoxArray->erase(boundingBoxArray->begin(), boundingBoxArray->begin()+6);
@@ -238,18 +314,22 @@ public:
                 Vector3 P3 = Vector3(triangleArray->at(6),triangleArray->at(7),triangleArray->at(8));
                 Vector3 faceNorm = Vector3(triangleArray->at(9),triangleArray->at(10),triangleArray->at(11));
                 triangleArray->erase(triangleArray->begin(), triangleArray->begin()+12);
-                nodeTriangles[i] = *new Tri(P1,P2,P3,faceNorm,idList->front(),matList->front());
+                nodeTriangles[i] = *new Tri(P1,P2,P3,faceNorm,idList->front(),matList->front(),scatterList->front());
                 idList->pop_front();
                 matList->pop_front();
+                scatterList->pop_front();
             }
         }else{
-            leftChild = new Node(depth,maxDepth,boundingBoxArray,triangleArray,leafSizeArray,idList,matList);
-            rightChild = new Node(depth,maxDepth,boundingBoxArray,triangleArray,leafSizeArray,idList,matList);
+            leftChild = new Node(depth,maxDepth,boundingBoxArray,triangleArray,leafSizeArray,idList,matList,scatterList);
+            rightChild = new Node(depth,maxDepth,boundingBoxArray,triangleArray,leafSizeArray,idList,matList,scatterList);
         }
     }
     inline bool intersects(Ray *testRay){
         return boundingBox.testIntersect(testRay, 0.0f, INFINITY);
     }
+    inline const Bounds& getBounds() {
+        return boundingBox;
+    }
     inline bool getIsLeaf() {
         return isLeaf;
     }
@@ -265,8 +345,8 @@ class GeomeTree {
     public:
     Node masterNode;
     inline GeomeTree() {};
-    inline GeomeTree(int maxDepth,std::deque<float> *boundingBoxArray,std::deque<float> *triangleArray,std::deque<int> *leafSizeArray,std::deque<int> *idList,std::deque<float> *matList) {
-        masterNode = *new Node(0,maxDepth,boundingBoxArray,triangleArray,leafSizeArray,idList,matList);
+    inline GeomeTree(int maxDepth,std::deque<float> *boundingBoxArray,std::deque<float> *triangleArray,std::deque<int> *leafSizeArray,std::deque<int> *idList,std::deque<float> *matList,std::deque<float> *scatterList) {
+        masterNode = *new Node(0,maxDepth,boundingBoxArray,triangleArray,leafSizeArray,idList,matList,scatterList);
     };
     
     inline std::deque<Tri> getCandidates(Ray *testRay) {
@@ -275,6 +355,37 @@ class GeomeTree {
         return candidates;
     }
     
+    // Nearest surface the ray hits further away than minDist, leaving out the ear meshes. hit may be NULL.
+    inline bool nearestHit(Ray *testRay, float *t, Tri *hit, float minDist = kEpsilon) {
+        std::deque<Tri> candidates = getCandidates(testRay);
+        float min = INFINITY;
+        int minDistIdx = -1;
+        for(int j = 0; j < candidates.size();j++){
+            float dist;
+            if(candidates[j].objectType == 0 && testRay->testIntersect(&candidates[j], &dist) && dist < min && dist > minDist) {
+                min = dist;
+                minDistIdx = j;
+            }
+        }
+        if(minDistIdx < 0) {
+            return false;
+        }
+        *t = min;
+        if(hit != NULL) {
+            *hit = candidates[minDistIdx];
+        }
+        return true;
+    }
+    
+    inline void getTriangles(Node *currentNode, std::vector<Tri> *triangles) {
+        if (currentNode->getIsLeaf()) {
+            triangles->insert(triangles->end(), currentNode->getTri()->begin(), currentNode->getTri()->end());
+        }else {
+            getTriangles(currentNode->leftChild, triangles);
+            getTriangles(currentNode->rightChild, triangles);
+        }
+    }
+    
     inline void collision(Node *currentNode, Ray *testRay, std::deque<Tri> *candidates) {
         if(currentNode->intersects(testRay)) {
             if (currentNode->getIsLeaf()) {
@@ -296,9 +407,13 @@ struct raySphere {
     public:
         std::vector<Ray> rays;
         inline raySphere(){};
+        // The jitter of the grid is drawn from the counter-based generator, so the same number of rays always gives the
+        // same sphere
         inline raySphere(int nRays) {
-            float rnd1 = rand() % 2;
-            float rnd2 = rand() % 2;
+            float u[4];
+            Philox(0x5EED, 0).generate((uint32_t)nRays, 0, 0, 0, u);
+            float rnd1 = (float)(u[0] < 0.5f);
+            float rnd2 = (float)(u[1] < 0.5f);
             for(int i = 0; i < nRays; i++) {
                 for (int j = 0; j < nRays; j++) {
             float l = 2 * sqrt(((i + rnd1) / nRays) - pow(((i + rnd1) / nRays), 2.0))*cos(2 * M_PI*((j + rnd2) / nRays));
@@ -313,7 +428,8 @@ struct raySphere {
         inline std::vector<Ray> getRayList(Vector3 sourcePos){
             std::vector<Ray> translatedRays;
             for(int i = 0; i< rays.size(); i++){
-                Ray tempRay = Ray(rays[i].origin + sourcePos, rays[i].direction);
+                Ray tempRay = Ray(sourcePos, rays[i].direction);
+                tempRay.id = i;
                 translatedRays.push_back(tempRay);
             }
             return translatedRays;
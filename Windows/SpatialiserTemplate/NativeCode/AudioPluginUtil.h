@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <atomic>
 
 #if UNITY_WIN
 #   include <windows.h>
@@ -110,8 +111,71 @@ typedef UnityComplexNumberT<float> UnityComplexNumber;
 class FFT
 {
 public:
+    // Creates the tables of all transform sizes up to numsamples points, so that the first transform of a size does not
+    // allocate. Transforms create missing tables themselves, which is thread-safe but not free.
+    static void Prepare(int numsamples);
+
     static void Forward(UnityComplexNumber* data, int numsamples, bool highprecision);
     static void Backward(UnityComplexNumber* data, int numsamples, bool highprecision);
+
+    // Two-for-one transforms of real signals: when two real signals are packed into the real and imaginary parts of one
+    // complex sequence, a single Forward call followed by SplitStereo yields both spectra. MergeStereo does the reverse for
+    // spectra of real signals, so that a single Backward call returns the two signals in the real and imaginary parts.
+    // The separated spectra are stored in split (SoA) form so that they can be fed directly to the SplitComplex kernels.
+    static void SplitStereo(const UnityComplexNumber* packed, float* re1, float* im1, float* re2, float* im2, int numsamples);
+    static void MergeStereo(const float* re1, const float* im1, const float* re2, const float* im2, UnityComplexNumber* packed, int numsamples);
+
+    // Spectrum of a single real signal from a transform of half the size: even and odd samples are packed into one
+    // complex sequence of numsamples / 2 elements and separated afterwards. work must hold numsamples / 2 elements.
+    // All numsamples bins are written in split form.
+    static void ForwardReal(const float* input, UnityComplexNumber* work, float* re, float* im, int numsamples);
+};
+
+// Spectral kernels operating on split-complex (separate real and imaginary arrays) buffers.
+// The implementation is selected at load time from the best instruction set supported by the CPU (SSE, AVX2 or AVX-512).
+class SplitComplex
+{
+public:
+    // result = a * b
+    static void Mul(const float* are, const float* aim, const float* bre, const float* bim, float* resultre, float* resultim, int numsamples);
+    // result += a * b
+    static void MulAdd(const float* are, const float* aim, const float* bre, const float* bim, float* resultre, float* resultim, int numsamples);
+
+    // result = weights[0] * src[0] + weights[1] * src[1] + weights[2] * src[2] + weights[3] * src[3]
+    // This is a plain real-valued blend, so a whole SplitComplexBuffer can be processed in one pass by passing its length * 2.
+    static void Blend4(const float* const* src, const float* weights, float* result, int numsamples);
+
+    static void Deinterleave(const UnityComplexNumber* src, float* re, float* im, int numsamples);
+    static void Interleave(const float* re, const float* im, UnityComplexNumber* dst, int numsamples);
+
+    static const char* GetInstructionSetName();
+};
+
+class FIR
+{
+public:
+    // output[n] = sum of coeffs[k] * input[n + k] for k < numtaps. input must hold numsamples + numtaps - 1 samples.
+    // Passing an impulse response in reverse order turns this into a convolution with numtaps - 1 samples of history.
+    static void Correlate(const float* input, const float* coeffs, float* output, int numsamples, int numtaps);
+
+    // Sparse version of Correlate: output[n] = sum of coeffs[k] * input[offsets[k] + n] for k < numtaps.
+    // Each tap reads a contiguous run of input, so taps sorted by offset give the best cache locality.
+    // The AVX2 and AVX-512 kernels accumulate with fused multiply-adds, so their results differ from the scalar ones in the
+    // last bits.
+    static void SparseCorrelate(const float* input, const int* offsets, const float* coeffs, float* output, int numsamples, int numtaps);
+
+    // Linear-phase lowpass (Blackman-windowed sinc) with unity gain at DC. cutoff is given as a fraction of the sample rate.
+    static void DesignLowpass(float* coeffs, int numtaps, float cutoff);
+};
+
+// The imaginary parts follow directly after the real parts, so a buffer can also be treated as LENGTH * 2 contiguous floats.
+template<const int _LENGTH>
+struct SplitComplexBuffer
+{
+    enum { LENGTH = _LENGTH };
+
+    float re[LENGTH];
+    float im[LENGTH];
 };
 
 class FFTAnalyzer : public FFT
@@ -234,6 +298,227 @@ public:
     }
 };
 
+// Block-based FIR filter for short impulse responses given in reverse order (see FIR::Correlate).
+// When prevcoeffs is passed the output is crossfaded linearly from the old to the new filter over the block,
+// which avoids clicks when the coefficients change from block to block. Assumes zero-initialization.
+template<const int _LENGTH>
+class FIRFilter
+{
+public:
+    enum { LENGTH = _LENGTH };
+    enum { CHUNK = 256 };
+
+    float buffer[LENGTH - 1 + CHUNK];   // History followed by the current input chunk
+    float temp[CHUNK];
+
+    void Process(const float* input, float* output, int numsamples, const float* coeffs, const float* prevcoeffs = NULL)
+    {
+        const float fadestep = 1.0f / (float)numsamples;
+        for (int offset = 0; offset < numsamples; offset += CHUNK)
+        {
+            int num = (numsamples - offset < CHUNK) ? (numsamples - offset) : CHUNK;
+            memcpy(buffer + LENGTH - 1, input + offset, sizeof(float) * num);
+            FIR::Correlate(buffer, coeffs, output + offset, num, LENGTH);
+            if (prevcoeffs != NULL)
+            {
+                FIR::Correlate(buffer, prevcoeffs, temp, num, LENGTH);
+                for (int n = 0; n < num; n++)
+                    output[offset + n] = temp[n] + (output[offset + n] - temp[n]) * (float)(offset + n + 1) * fadestep;
+            }
+            memmove(buffer, buffer + num, sizeof(float) * (LENGTH - 1));
+        }
+    }
+};
+
+// Delay line with a fractional delay time, read by cubic Hermite interpolation.
+// Below one sample the input that would follow the current one is not known yet, so it is extrapolated linearly.
+// LENGTH must be a power of two. Delays are clamped to [0, LENGTH - 3] samples. Assumes zero-initialization.
+template<const int _LENGTH>
+class FractionalDelay
+{
+public:
+    enum { LENGTH = _LENGTH };
+
+    int writepos;
+    float buffer[LENGTH];
+
+    inline float Process(float input, float delay)
+    {
+        const int mask = LENGTH - 1;
+        buffer[writepos] = input;
+        float d = FastClip(delay, 0.0f, (float)(LENGTH - 3));
+        int i = (int)d;
+        float f = d - (float)i;
+        int r = writepos - i;
+        float y1 = buffer[r & mask];
+        float y2 = buffer[(r - 1) & mask];
+        float y3 = buffer[(r - 2) & mask];
+        float y0 = (i > 0) ? buffer[(r + 1) & mask] : (2.0f * y1 - y2);
+        writepos = (writepos + 1) & mask;
+        float c1 = 0.5f * (y2 - y0);
+        float c2 = y0 - 2.5f * y1 + 2.0f * y2 - 0.5f * y3;
+        float c3 = 0.5f * (y3 - y0) + 1.5f * (y1 - y2);
+        return ((c3 * f + c2) * f + c1) * f + y1;
+    }
+
+    inline void Clear()
+    {
+        writepos = 0;
+        memset(buffer, 0, sizeof(buffer));
+    }
+};
+
+// Decimation by FACTOR with a polyphase anti-aliasing filter: only every FACTOR-th output of the TAPS-tap lowpass is computed.
+// The lowpass has its cutoff at the output Nyquist frequency and lets part of the transition band alias, so it is meant for
+// signals whose content of interest lies well below that, such as the lowest octave bands.
+// The signal is delayed by (TAPS - 1) / 2 input samples.
+// numsamples must be a multiple of FACTOR. Call Init once before use; assumes zero-initialization.
+template<const int _FACTOR, const int _TAPS>
+class PolyphaseDecimator
+{
+public:
+    enum { FACTOR = _FACTOR, TAPS = _TAPS };
+    enum { CHUNK = 256 };
+
+    float coeffs[TAPS];
+    float buffer[TAPS - 1 + CHUNK]; // History followed by the current input chunk
+
+    void Init()
+    {
+        FIR::DesignLowpass(coeffs, TAPS, 0.5f / (float)FACTOR);
+    }
+
+    void Process(const float* input, float* output, int numsamples)
+    {
+        for (int offset = 0; offset < numsamples; offset += CHUNK)
+        {
+            int num = (numsamples - offset < CHUNK) ? (numsamples - offset) : CHUNK;
+            memcpy(buffer + TAPS - 1, input + offset, sizeof(float) * num);
+            for (int n = 0; n < num; n += FACTOR)
+            {
+                const float* x = buffer + n;
+                float sum = 0.0f;
+                for (int k = 0; k < TAPS; k++)
+                    sum += coeffs[k] * x[k];
+                *output++ = sum;
+            }
+            memmove(buffer, buffer + num, sizeof(float) * (TAPS - 1));
+        }
+    }
+};
+
+// Interpolation by FACTOR, the counterpart of PolyphaseDecimator: each input sample produces FACTOR outputs, one from each
+// of the FACTOR sub-filters of the lowpass, so the zeros of the upsampled signal are never multiplied.
+// The signal is delayed by (TAPS - 1) / 2 output samples. Call Init once before use; assumes zero-initialization.
+template<const int _FACTOR, const int _TAPS>
+class PolyphaseInterpolator
+{
+public:
+    enum { FACTOR = _FACTOR, TAPS = _TAPS };
+    enum { PHASELENGTH = TAPS / FACTOR };
+
+    float phases[FACTOR][PHASELENGTH];
+    float history[PHASELENGTH]; // Most recent input first
+
+    void Init()
+    {
+        float coeffs[TAPS];
+        FIR::DesignLowpass(coeffs, TAPS, 0.5f / (float)FACTOR);
+        for (int p = 0; p < FACTOR; p++)
+            for (int k = 0; k < PHASELENGTH; k++)
+                phases[p][k] = coeffs[k * FACTOR + p] * (float)FACTOR;
+    }
+
+    void Process(const float* input, float* output, int numsamples)
+    {
+        for (int n = 0; n < numsamples; n++)
+        {
+            memmove(history + 1, history, sizeof(float) * (PHASELENGTH - 1));
+            history[0] = input[n];
+            for (int p = 0; p < FACTOR; p++)
+            {
+                float sum = 0.0f;
+                for (int k = 0; k < PHASELENGTH; k++)
+                    sum += phases[p][k] * history[k];
+                *output++ = sum;
+            }
+        }
+    }
+};
+
+// Uniformly partitioned overlap-save convolution of a mono signal with a multichannel impulse response, for responses that
+// are too long for FIRFilter. The input spectra of the last partitions are kept in a frequency-domain delay line and
+// multiplied with the partition spectra using SplitComplex::MulAdd, so the input is transformed once for all channels.
+// Each pair of channels shares one inverse transform.
+// Processes exactly blocksize samples per call without additional latency. Assumes zero-initialization.
+class PartitionedConvolver
+{
+public:
+    void Init(int blocksize, int maxlength, int numchannels = 2); // blocksize must be a power of two >= 4
+    void Cleanup();
+
+    // Replaces the impulse response; the convolution state is kept. length is clamped to the maxlength passed to Init.
+    void SetImpulseResponse(const float* left, const float* right, int length);
+    void SetImpulseResponses(const float* const* responses, int length);
+
+    // The same in two steps, so that the transforms can run on another thread than the convolution. PrepareSpectra fills a
+    // buffer of GetSpectraSize() floats and returns the number of partitions it used; work must hold blocksize * 2
+    // elements. SwapSpectra puts the buffer in place of the current impulse response and returns the buffer it replaced.
+    int GetSpectraSize() const;
+    int PrepareSpectra(const float* const* responses, int length, float* result, UnityComplexNumber* work) const;
+    float* SwapSpectra(float* prepared, int numprepared);
+    void Process(const float* input, float* left, float* right);
+    void Process(const float* input, float* const* outputs);
+
+public:
+    int blocksize;
+    int numchannels;
+    int numpartitions;              // Capacity
+    int numactive;                  // Partitions of the current impulse response
+    int fdlpos;
+    float* buffer;                  // Previous and current input block
+    float* spectra;                 // Impulse response spectra: numpartitions per channel
+    float* fdl;                     // Frequency-domain delay line of input spectra
+    float* acc;                     // Accumulated output spectra of all channels
+    UnityComplexNumber* work;
+};
+
+// Real spherical harmonics up to MAXORDER in ACN channel order with N3D normalization, so that every channel has the
+// same mean power over the sphere. Directions are unit vectors in the caller's x, y, z axes.
+class SphericalHarmonics
+{
+public:
+    enum { MAXORDER = 3, MAXCHANNELS = (MAXORDER + 1) * (MAXORDER + 1) };
+
+    static inline int GetNumChannels(int order) { return (order + 1) * (order + 1); }
+
+    // Writes GetNumChannels(order) values
+    static void Evaluate(int order, float x, float y, float z, float* result);
+
+    // Adds a mono signal to numchannels interleaved channels of output, scaled by a gain vector that is ramped linearly
+    // from prevgains to gains over the block. Runs on the SIMD kernels (see SplitComplex), so the cost per frame is a few
+    // vector multiply-adds regardless of how the source was filtered.
+    static void Encode(const float* input, const float* prevgains, const float* gains, float* output, int numsamples, int numchannels);
+};
+
+// Rotation of real spherical harmonic coefficients. The matrix is block diagonal with one block per order, built from the
+// 3x3 rotation with the recursion of Ivanic and Ruedenberg, so no transform to and from directions is needed.
+// A field encoded from direction d and rotated equals the field encoded from rotation * d.
+class SHRotation
+{
+public:
+    int order;
+    float matrix[SphericalHarmonics::MAXCHANNELS][SphericalHarmonics::MAXCHANNELS];
+
+public:
+    // rotation is a row-major 3x3 matrix
+    void Setup(int order, const float* rotation);
+
+    // Rotates numframes frames of GetNumChannels(order) interleaved channels. If previous is not NULL the result is
+    // crossfaded from its rotation over the frames. input and output must not overlap.
+    void Process(const float* input, float* output, int numframes, const SHRotation* previous = NULL) const;
+};
+
 class BiquadFilter
 {
 public:
@@ -343,6 +628,86 @@ void BiquadFilter::SetupHighpass(float cutoff, float samplerate, float Q)
     float inv_a0 = 1.0f / a0; a1 *= inv_a0; a2 *= inv_a0; b0 *= inv_a0; b1 *= inv_a0; b2 *= inv_a0;
 }
 
+// Eight biquads fed from the same signal and run a whole block at a time, with the bands laid out in SIMD lanes
+// (one AVX register or two SSE registers per coefficient and state variable).
+// Setup creates the octave bank used for the room acoustics: a lowpass at 63 Hz, bandpasses from 125 Hz to 4 kHz and a highpass at 8 kHz.
+// Assumes zero-initialization.
+class OctaveFilterBank
+{
+public:
+    enum { NUMBANDS = 8 };
+
+    float coeffs[5][NUMBANDS];  // a1, a2, b0, b1, b2
+    float state[2][NUMBANDS];   // z1, z2
+
+public:
+    void Setup(float samplerate);
+    void SetupBand(int band, BiquadFilter filter);
+    void Reset();
+
+    // Filters numsamples of input read with the given stride, so that one channel of an interleaved buffer can be passed directly.
+    // rms receives the RMS level of each band over the block. If output is not NULL it receives numsamples frames of NUMBANDS band samples.
+    void Process(const float* input, int stride, float* rms, float* output, int numsamples);
+
+    // Squared magnitude response of a band at the normalized angular frequency w (radians per sample)
+    float GetPowerResponse(int band, float w) const;
+};
+
+// Octave band levels taken from a spectrum that has already been computed, which saves running a filter bank over the signal.
+// Each bin is weighted by the power response of the corresponding OctaveFilterBank band, so stationary signals give the same
+// levels as the time-domain bank. The band-to-bin weights are rebuilt when the transform size or sample rate changes.
+class BandEnergyAnalyzer
+{
+public:
+    enum { NUMBANDS = OctaveFilterBank::NUMBANDS };
+
+    // Makes the weights for transforms of up to fftsize points, which must be a power of two. Assumes zero-initialization.
+    void Init(int fftsize, float samplerate);
+    void Cleanup();
+
+    // re and im hold (at least) bins 0 to fftsize / 2 of the transform of numsamples signal samples, zero-padded to fftsize.
+    // rms receives the RMS level of each band, or zeros if fftsize is larger than the one passed to Init.
+    void Process(const float* re, const float* im, int fftsize, int numsamples, float* rms);
+
+public:
+    float* weights; // Power response of each of the NUMBANDS bands for each of the fftsize / 2 + 1 bins
+    int fftsize;
+    float samplerate;
+};
+
+// Feedback delay network for late reverberation: NUMLINES delay lines of mutually prime lengths between 20 and 60 ms,
+// fed back through an orthogonal Hadamard matrix. A first-order low and high shelf in each line sets the decay time in
+// three bands, with crossovers at 350 Hz and 2.8 kHz. The lines are processed as SIMD lanes a chunk at a time, which works
+// because no line is shorter than CHUNK. Even lines feed the left channel and odd lines the right.
+// Assumes zero-initialization.
+class FeedbackDelayNetwork
+{
+public:
+    enum { NUMLINES = 16, NUMBANDS = 3, CHUNK = 64 };
+
+    void Init(float samplerate);
+    void Cleanup();
+
+    // Decay times (T60) in seconds of the low, mid and high band. Must be called after Init; the absorption filters are
+    // only recomputed when the times change.
+    void SetDecayTimes(const float* t60);
+
+    // Interleaved stereo input and output, which may be the same buffer
+    void Process(const float* input, float* output, int numsamples);
+
+public:
+    float samplerate;
+    float decay[NUMBANDS];
+    int length[NUMLINES];
+    int mask[NUMLINES];
+    float* data[NUMLINES];
+    int writepos;
+    float coeffs[6][NUMLINES];          // b0, b1, a1 of the low shelf, then b0, b1, a1 of the high shelf
+    float state[2][NUMLINES];           // z1 of both shelves
+    float lines[CHUNK * NUMLINES];      // Line outputs of the current chunk, one frame of NUMLINES per sample
+    float feedback[CHUNK * NUMLINES];
+};
+
 class StateVariableFilter
 {
 public:
@@ -484,6 +849,120 @@ protected:
     Mutex* mutex;
 };
 
+// Allocator for large, long-lived DSP buffers such as delay lines. Sizes are rounded up to one of eight size classes per
+// octave and released blocks are kept on a free list per class, so effect instances that are created and destroyed
+// repeatedly reuse the same memory instead of going back to the system allocator. The pool keeps its peak size. Thread safe.
+class MemoryPool
+{
+public:
+    // Returns zeroed, 16-byte aligned memory for at least size bytes
+    static void* Allocate(size_t size);
+    static void Free(void* ptr); // Accepts NULL
+
+    // used: bytes currently handed out, pooled: bytes kept on the free lists
+    static void GetStats(size_t& used, size_t& pooled);
+};
+
+// A few values that one effect publishes for others as a complete set, without locking. Write makes the sequence count odd,
+// stores the values and makes it even again, and Read retries until it sees the same even count before and after loading
+// them, so readers never get a mix of two sets. Writers from several threads do not wait for each other either: a Write that
+// starts while another one is in progress is dropped. Assumes zero-initialization.
+template<const int _NUM>
+class SharedValues
+{
+public:
+    enum { NUM = _NUM };
+
+    // Returns false if the values were not published because another thread was writing
+    bool Write(const float* values)
+    {
+        unsigned int seq = sequence.load(std::memory_order_relaxed);
+        if ((seq & 1) != 0 || !sequence.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            return false;
+        std::atomic_thread_fence(std::memory_order_release);
+        for (int n = 0; n < NUM; n++)
+            data[n].store(values[n], std::memory_order_relaxed);
+        sequence.store(seq + 2, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if nothing has been published yet, in which case values is left untouched
+    bool Read(float* values) const
+    {
+        float result[NUM];
+        unsigned int seq;
+        do
+        {
+            seq = sequence.load(std::memory_order_acquire);
+            for (int n = 0; n < NUM; n++)
+                result[n] = data[n].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        while ((seq & 1) != 0 || sequence.load(std::memory_order_relaxed) != seq);
+        if (seq == 0)
+            return false;
+        memcpy(values, result, sizeof(result));
+        return true;
+    }
+
+protected:
+    std::atomic<unsigned int> sequence;
+    std::atomic<float> data[NUM];
+};
+
+// Send bus shared by the spatializer instances and a receiving effect (the reverb, or the ambisonic decoder). Every mixer
+// thread adds its sends to buffers of its own, so instances that are mixed in parallel never write to the same memory. Each
+// buffer is tagged with the DSP tick of the block it belongs to. The receiver takes all buffers up to its own tick and clears
+// only the samples that were written to them; sends for later blocks, or sends that arrive after the receiver has run, are
+// picked up by the next block. Buffers change hands through an atomic state per buffer, so neither side ever waits for the other.
+// The slot of the calling thread is a process-wide index that the thread holds until it exits, so any number of buses can be
+// used from the same threads and a new thread reuses the slot of one that has gone. The buffers are allocated by Reserve, never
+// by the sending threads.
+class SendBus
+{
+public:
+    enum { MAXTHREADS = 32, NUMFRAMES = 4 }; // MAXTHREADS is limited to the bits of an unsigned int
+
+    explicit SendBus(int numchannels = 2);
+    ~SendBus();
+
+    // Makes every buffer hold blocks of up to length frames. Called when the receiving effect is created, off the audio thread.
+    void Reserve(int length);
+
+    // Returns the buffer that the calling thread adds its sends for the block starting at tick to. It holds length interleaved
+    // frames of numchannels. Returns NULL when all buffers of the thread are still waiting for the receiver, when more than
+    // MAXTHREADS threads are sending at the same time or when length is more than has been reserved. Must be followed by EndSend.
+    float* BeginSend(UInt64 tick, int length);
+    void EndSend();
+
+    // Adds the sends for all blocks up to and including tick to output (length interleaved frames of numchannels). Where a send
+    // was longer than length, the rest of it is kept for the next block.
+    void Receive(UInt64 tick, float* output, int length);
+
+    inline int GetNumChannels() const { return numchannels; }
+
+protected:
+    enum { FREE, BUSY, READY };
+
+    struct Frame
+    {
+        std::atomic<int> state; // Only the side that has changed it to BUSY touches the other members
+        UInt64 tick;
+        int length;
+        int capacity;
+        float* data;
+    };
+
+    struct Slot
+    {
+        Frame frames[NUMFRAMES];
+        int current;            // Frame between BeginSend and EndSend, or -1
+    };
+
+    int numchannels;
+    Slot slots[MAXTHREADS];
+};
+
 void RegisterParameter(
     UnityAudioEffectDefinition& desc,
     const char* name,
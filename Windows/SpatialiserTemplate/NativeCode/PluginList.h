@@ -1,2 +1,3 @@
 DECLARE_EFFECT("Spatialiser Template", Spatializer);
+DECLARE_EFFECT("Spatializer Ambisonic Decoder", SpatializerDecoder);
 
@@ -1,8 +1,11 @@
 #include "AudioPluginUtil.h"
 #include "rayTraceUtil.h"
+#include "hrtfUtil.h"
+#include <chrono>
 
 extern float hrtfSrcData[];
-extern float reverbmixbuffer[];
+extern SendBus reverbsendbus;
+extern SendBus ambisonicbus;
 
 namespace Spatializer
 {
@@ -10,7 +13,13 @@ namespace Spatializer
     static int numRays = 20;
     static int maxPathLength = 100;
     static int maxNumReflecs = 75;
-    const int HRTFLEN = 512;
+    const int HRTFLEN = HRTFDataset::MAXLENGTH;
+    const int NUMHRTFLENGTHS = HRTFDataset::NUMLENGTHS;
+    const static int hrtfLengths[NUMHRTFLENGTHS] = { HRTFLEN, HRTFLEN / 2, HRTFLEN / 4, HRTFLEN / 8 }; // Shorter lengths are minimum-phase with separate ITD
+    const int DIRECTHRIRLEN = HRTFDataset::DIRECTLENGTH;
+    const int DIRECTBLOCKLEN = 256;
+    const int AMBISONICORDER = SphericalHarmonics::MAXORDER;
+    const int AMBISONICCHANNELS = SphericalHarmonics::MAXCHANNELS;
 	const int numBands = 6;
     const float GAINCORRECTION = 2.0f;
     const static int airAbsorbtion[numBands] = {0.002, 0.005, 0.005, 0.007, 0.012, 0.057};
@@ -22,15 +31,26 @@ namespace Spatializer
     static bool newTree = true;
     static bool treeInit = false;
     static bool enableDebug;
+    static std::string hrtfCachePath;
     
     enum
     {
         P_AUDIOSRCATTN,
         P_FIXEDVOLUME,
         P_CUSTOMFALLOFF,
+        P_HRTFLENGTH,
+        P_RENDERMODE,
         P_NUM
     };
     
+    enum
+    {
+        RENDERMODE_SPECTRAL,
+        RENDERMODE_DIRECT,
+        RENDERMODE_AMBISONIC,
+        NUMRENDERMODES
+    };
+    
 	class LoudnessAnalyzer
 	{
 	public:
@@ -85,100 +105,308 @@ namespace Spatializer
 	};
 
 
-    class HRTFData
+    // The grids, the direct path filters (hrir) and the binaural decoder of the ambisonic bus, plus the caches of the grids
+    class HRTFData : public HRTFDataset
     {
-        struct CircleCoeffs
+    public:
+        HRTFCache cache[NUMHRTFLENGTHS];
+
+    public:
+        // Maps the cache file when it is valid, otherwise derives everything from the compiled-in table and writes the cache file
+        void InitDefault()
+        {
+            if (hrtfCachePath.empty() || !Load(hrtfCachePath.c_str()))
+            {
+                Build(hrtfSrcData, std::thread::hardware_concurrency());
+                if (!hrtfCachePath.empty())
+                    Save(hrtfCachePath.c_str());
+            }
+            InitCaches();
+        }
+
+        bool InitFromFile(const char* path)
         {
-            int numangles;
-            float* hrtf;
-            float* angles;
+            if (!Load(path))
+                return false;
+            InitCaches();
+            return true;
+        }
+
+    protected:
+        void InitCaches()
+        {
+            for (int n = 0; n < NUMHRTFLENGTHS; n++)
+                cache[n].Init(grid[n], 512);
+        }
+    };
+    
+    // The active dataset is swapped atomically. Replaced datasets are kept alive for a grace period because a callback
+    // running on a mixer thread may still be using spectra from them. Callbacks never hold on to a dataset beyond their
+    // own block, so one second is plenty.
+    struct RetiredHRTFData
+    {
+        HRTFData* data;
+        std::chrono::steady_clock::time_point time;
+    };
+    
+    const double kHRTFDataGracePeriod = 1.0;
+    static std::atomic<HRTFData*> activeHRTFData(NULL);
+    static std::vector<RetiredHRTFData> retiredHRTFData;
+    static Mutex hrtfDataMutex;
+    
+    // Prepared on first use rather than at library load, so that Unity can enumerate the plugin without waiting for it
+    static HRTFData& GetHRTFData()
+    {
+        HRTFData* data = activeHRTFData.load(std::memory_order_acquire);
+        if (data == NULL)
+        {
+            MutexScopeLock lock(hrtfDataMutex);
+            data = activeHRTFData.load(std::memory_order_acquire);
+            if (data == NULL)
+            {
+                data = new HRTFData();
+                data->InitDefault();
+                activeHRTFData.store(data, std::memory_order_release);
+            }
+        }
+        return *data;
+    }
+    
+    // Used by the ambisonic decoder effect, which renders the bus that the instances in the ambisonic render mode encode into
+    const SHDecoderFilters& GetSHDecoderFilters()
+    {
+        return GetHRTFData().decoder;
+    }
+    
+    template<int LENGTH>
+    struct InstanceChannel
+    {
+        SplitComplexBuffer<LENGTH * 2> x;
+        SplitComplexBuffer<LENGTH * 2> y;
+        float buffer[LENGTH * 2];
+    };
+    
+    // Convolution state of one voice for one HRTF length. Blocks of LENGTH frames are filtered by overlap-save with
+    // transforms of LENGTH * 2 points.
+    template<int LENGTH>
+    struct HRTFVoice
+    {
+        InstanceChannel<LENGTH> ch[2];
+        UnityComplexNumber stereo[LENGTH * 2]; // Both ears packed into one complex sequence (left = re, right = im)
+        bool monohistory;                      // The previous block was mono, so both ears hold the same overlap
+        
+        // Filters one block of LENGTH interleaved stereo frames. The result is left in stereo[0..LENGTH).
+        // When both ears receive the same signal (mono) and did so in the previous block as well, so that their overlaps
+        // match too, only that signal is transformed, using a real transform of half the size, and its spectrum is
+        // multiplied by both HRTFs. The input of the right ear is kept up to date regardless, so that it has the right
+        // overlap once the signals differ again.
+        // The octave band levels of both ear inputs are measured from the same spectra and written to bandrms.
+        const UnityComplexNumber* Process(const float* inbuffer, const float* spreadmatrix, const HRTFCache::Entry* hrtf, bool mono, BandEnergyAnalyzer& analyzer, float (*bandrms)[BandEnergyAnalyzer::NUMBANDS])
+        {
+            bool shared = mono && monohistory;
+            monohistory = mono;
             
-            void GetHRTF(UnityComplexNumber* h, float angle, float mix)
+            for (int c = 0; c < 2; c++)
+            {
+                InstanceChannel<LENGTH>& ch = this->ch[c];
+                
+                for (int n = 0; n < LENGTH; n++)
+                {
+                    float left  = inbuffer[n * 2];
+                    float right = inbuffer[n * 2 + 1];
+                    ch.buffer[n] = ch.buffer[n + LENGTH];
+                    ch.buffer[n + LENGTH] = left * spreadmatrix[c] + right * spreadmatrix[1 - c];
+                }
+            }
+
+            if (shared)
+            {
+                FFT::ForwardReal(ch[0].buffer, stereo, ch[0].x.re, ch[0].x.im, LENGTH * 2);
+                for (int c = 0; c < 2; c++)
+                {
+                    const float* h = hrtf->spectrum[c];
+                    SplitComplex::Mul(ch[0].x.re, ch[0].x.im, h, h + LENGTH * 2, ch[c].y.re, ch[c].y.im, LENGTH * 2);
+                }
+            }
+            else
             {
-                int index1 = 0;
-                while (index1 < numangles && angles[index1] < angle)
-                    index1++;
-                if (index1 > 0)
-                    index1--;
-                int index2 = (index1 + 1) % numangles;
-                float* hrtf1 = hrtf + HRTFLEN * 4 * index1;
-                float* hrtf2 = hrtf + HRTFLEN * 4 * index2;
-                float f = (angle - angles[index1]) / (angles[index2] - angles[index1]);
-                for (int n = 0; n < HRTFLEN * 2; n++)
+                // Both ear inputs are real, so they share one forward and one inverse transform:
+                // the left ear goes into the real part and the right ear into the imaginary part.
+                for (int n = 0; n < LENGTH * 2; n++)
+                {
+                    stereo[n].re = ch[0].buffer[n];
+                    stereo[n].im = ch[1].buffer[n];
+                }
+
+                FFT::Forward(stereo, LENGTH * 2, false);
+                FFT::SplitStereo(stereo, ch[0].x.re, ch[0].x.im, ch[1].x.re, ch[1].x.im, LENGTH * 2);
+
+                for (int c = 0; c < 2; c++)
                 {
-                    h[n].re += (hrtf1[0] + (hrtf2[0] - hrtf1[0]) * f - h[n].re) * mix;
-                    h[n].im += (hrtf1[1] + (hrtf2[1] - hrtf1[1]) * f - h[n].im) * mix;
-                    hrtf1 += 2;
-                    hrtf2 += 2;
+                    const float* h = hrtf->spectrum[c];
+                    SplitComplex::Mul(ch[c].x.re, ch[c].x.im, h, h + LENGTH * 2, ch[c].y.re, ch[c].y.im, LENGTH * 2);
                 }
             }
-        };
+
+            analyzer.Process(ch[0].x.re, ch[0].x.im, LENGTH * 2, LENGTH * 2, bandrms[0]);
+            if (shared)
+                memcpy(bandrms[1], bandrms[0], sizeof(bandrms[0]));
+            else
+                analyzer.Process(ch[1].x.re, ch[1].x.im, LENGTH * 2, LENGTH * 2, bandrms[1]);
+
+            FFT::MergeStereo(ch[0].y.re, ch[0].y.im, ch[1].y.re, ch[1].y.im, stereo, LENGTH * 2);
+            FFT::Backward(stereo, LENGTH * 2, false);
+            return stereo;
+        }
+    };
+    
+    struct HRTFVoices
+    {
+        HRTFVoice<512> voice512;
+        HRTFVoice<256> voice256;
+        HRTFVoice<128> voice128;
+        HRTFVoice<64> voice64;
         
-    public:
-        CircleCoeffs hrtfChannel[2][14];
+        inline const UnityComplexNumber* Process(int lengthindex, const float* inbuffer, const float* spreadmatrix, const HRTFCache::Entry* hrtf, bool mono, BandEnergyAnalyzer& analyzer, float (*bandrms)[BandEnergyAnalyzer::NUMBANDS])
+        {
+            switch (lengthindex)
+            {
+                case 1: return voice256.Process(inbuffer, spreadmatrix, hrtf, mono, analyzer, bandrms);
+                case 2: return voice128.Process(inbuffer, spreadmatrix, hrtf, mono, analyzer, bandrms);
+                case 3: return voice64.Process(inbuffer, spreadmatrix, hrtf, mono, analyzer, bandrms);
+                default: return voice512.Process(inbuffer, spreadmatrix, hrtf, mono, analyzer, bandrms);
+            }
+        }
+    };
+    
+    // Time-domain renderer for the direct path: a short minimum-phase FIR per ear, processed in blocks of up to
+    // DIRECTBLOCKLEN frames without any transform latency. The ITD is applied afterwards like for the short spectral HRTFs.
+    struct DirectVoice
+    {
+        FIRFilter<DIRECTHRIRLEN> fir[2];
+        float coeffs[2][DIRECTHRIRLEN];
+        float prevcoeffs[2][DIRECTHRIRLEN];
+        float ear[DIRECTBLOCKLEN];
+        float filtered[DIRECTBLOCKLEN];
+        UnityComplexNumber stereo[DIRECTBLOCKLEN];
         
-    public:
-        HRTFData()
+        void SetHRIR(const HRIRGrid& hrir, float azimuth, float elevation)
+        {
+            memcpy(prevcoeffs, coeffs, sizeof(coeffs));
+            hrir.GetHRIR(0, azimuth, elevation, coeffs[0]);
+            hrir.GetHRIR(1, azimuth, elevation, coeffs[1]);
+        }
+        
+        // Filters numsamples interleaved stereo frames, crossfading from the previous HRIRs if requested.
+        // The result is left in stereo[0..numsamples) (left = re, right = im).
+        const UnityComplexNumber* Process(const float* inbuffer, int numsamples, const float* spreadmatrix, bool crossfade)
         {
-            float* p = hrtfSrcData;
             for (int c = 0; c < 2; c++)
             {
-                for (int e = 0; e < 14; e++)
-                {
-                    CircleCoeffs& coeffs = hrtfChannel[c][e];
-                    coeffs.numangles = (int)(*p++);
-                    coeffs.angles = p;
-                    p += coeffs.numangles;
-                    coeffs.hrtf = new float[coeffs.numangles * HRTFLEN * 4];
-                    float* dst = coeffs.hrtf;
-                    UnityComplexNumber h[HRTFLEN * 2];
-                    for (int a = 0; a < coeffs.numangles; a++)
-                    {
-                        memset(h, 0, sizeof(h));
-                        for (int n = 0; n < HRTFLEN; n++)
-                            h[n + HRTFLEN].re = p[n];
-                        p += HRTFLEN;
-                        FFT::Forward(h, HRTFLEN * 2, false);
-                        for (int n = 0; n < HRTFLEN * 2; n++)
-                        {
-                            *dst++ = h[n].re;
-                            *dst++ = h[n].im;
-                        }
-                    }
-                }
+                for (int n = 0; n < numsamples; n++)
+                    ear[n] = inbuffer[n * 2] * spreadmatrix[c] + inbuffer[n * 2 + 1] * spreadmatrix[1 - c];
+                fir[c].Process(ear, filtered, numsamples, coeffs[c], crossfade ? prevcoeffs[c] : NULL);
+                if (c == 0)
+                    for (int n = 0; n < numsamples; n++)
+                        stereo[n].re = filtered[n];
+                else
+                    for (int n = 0; n < numsamples; n++)
+                        stereo[n].im = filtered[n];
             }
+            return stereo;
         }
     };
     
-    static HRTFData sharedData;
+    // Encoder for the ambisonic render mode. The voice adds its input to the shared third-order bus with spherical harmonic
+    // gains for its direction, so the only per-voice work is one vector multiply-add per frame. The binaural decoding of the
+    // whole bus is done once per mixer block by the decoder effect (see Plugin_SpatializerDecoder.cpp).
+    struct AmbisonicVoice
+    {
+        float gains[AMBISONICCHANNELS];
+        float prevgains[AMBISONICCHANNELS];
+        float mono[DIRECTBLOCKLEN];
+        
+        // x, y, z is the source direction in the listener's frame. focus scales the directional components, so that a wide
+        // spread blends the source towards an omnidirectional one.
+        void SetDirection(float x, float y, float z, float gain, float focus)
+        {
+            memcpy(prevgains, gains, sizeof(gains));
+            float len = sqrtf(x * x + y * y + z * z);
+            if (len > 0.0f)
+                SphericalHarmonics::Evaluate(AMBISONICORDER, x / len, y / len, z / len, gains);
+            else
+            {
+                memset(gains, 0, sizeof(gains));
+                gains[0] = 1.0f;
+            }
+            gains[0] *= gain;
+            for (int k = 1; k < AMBISONICCHANNELS; k++)
+                gains[k] *= gain * focus;
+        }
+        
+        // Adds the sum of both input channels to numsamples frames of the bus, ramping from the previous gains if requested
+        void Process(const float* inbuffer, float* bus, int numsamples, bool ramp)
+        {
+            for (int n = 0; n < numsamples; n++)
+                mono[n] = inbuffer[n * 2] + inbuffer[n * 2 + 1];
+            SphericalHarmonics::Encode(mono, ramp ? prevgains : gains, gains, bus, numsamples, AMBISONICCHANNELS);
+        }
+    };
     
-    struct InstanceChannel
+    // Decouples the host block size from the block size of the spectral renderer. Input frames are collected until a
+    // full block is available. The filtered block is then played back, together with the dry input it was made from,
+    // while the next block is collected. This adds a latency of one internal block.
+    struct BlockFIFO
     {
-        UnityComplexNumber h[HRTFLEN * 2];
-        UnityComplexNumber x[HRTFLEN * 2];
-        UnityComplexNumber y[HRTFLEN * 2];
-		UnityComplexNumber xh[HRTFLEN * 2];
-        float buffer[HRTFLEN * 2];
+        float input[HRTFLEN * 2];             // Interleaved frames of the block being collected
+        float dry[HRTFLEN * 2];               // Interleaved frames of the block being played back
+        UnityComplexNumber output[HRTFLEN];   // Filtered frames of the block being played back (left = re, right = im)
+        int pos;
     };
     
+    // Both ears receive the same signal when the spread is zero or when the source is a mono clip played as stereo
+    static bool IsMono(const float* inbuffer, int numframes, const float* spreadmatrix)
+    {
+        if (spreadmatrix[0] == spreadmatrix[1])
+            return true;
+        for (int n = 0; n < numframes; n++)
+            if (inbuffer[n * 2] != inbuffer[n * 2 + 1])
+                return false;
+        return true;
+    }
+    
+    static inline int GetRenderMode(float rendermode)
+    {
+        return (int)FastClip(rendermode + 0.5f, 0.0f, NUMRENDERMODES - 1);
+    }
+    
+    // Latency in frames of the given render mode and HRTF length. The ambisonic mode adds none of its own, but sends that
+    // reach the bus after the decoder has run are heard one mixer block later.
+    static int GetLatency(float rendermode, float hrtflength)
+    {
+        if (GetRenderMode(rendermode) != RENDERMODE_SPECTRAL)
+            return 0;
+        return hrtfLengths[(int)FastClip(hrtflength, 0.0f, NUMHRTFLENGTHS - 1)];
+    }
+    
     struct EffectData
     {
         float p[P_NUM];
         Vector3 prevPositons[2];
         std::vector<Ray> sucessfullRays;
 		LoudnessAnalyzer momentary;
-        InstanceChannel ch[2];
+        HRTFVoices voices;
+        BandEnergyAnalyzer bands;
+        DirectVoice direct;
+        AmbisonicVoice ambisonic;
+        BlockFIFO fifo;
+        int voicemode;                  // Render mode and HRTF length the voice state currently holds
+        FractionalDelay<128> itd[2];    // Interaural time difference, only used with the minimum-phase lengths
+        float itddelay[2];
 		struct Data
 		{
 			float p[P_NUM];
-			BiquadFilter Octave1[2];
-			BiquadFilter Octave2[2];
-			BiquadFilter Octave3[2];
-			BiquadFilter Octave4[2];
-			BiquadFilter Octave5[2];
-			BiquadFilter Octave6[2];
-			BiquadFilter Octave7[2];
-			BiquadFilter Octave8[2];
+			float octaverms[2][BandEnergyAnalyzer::NUMBANDS]; // Ear input levels, only measured by the spectral path, read as "OctaveRMS"
 			BiquadFilter DisplayFilterCoeffs[8];
 			float sr;
 			Random random;
@@ -204,6 +432,8 @@ namespace Spatializer
         RegisterParameter(definition, "AudioSrc Attn", "", 0.0f, 1.0f, 1.0f, 1.0f, 1.0f, P_AUDIOSRCATTN, "AudioSource distance attenuation");
         RegisterParameter(definition, "Fixed Volume", "", 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, P_FIXEDVOLUME, "Fixed volume amount");
         RegisterParameter(definition, "Custom Falloff", "", 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, P_CUSTOMFALLOFF, "Custom volume falloff amount (logarithmic)");
+        RegisterParameter(definition, "Render Mode", "", 0.0f, NUMRENDERMODES - 1, 0.0f, 1.0f, 1.0f, P_RENDERMODE, "0 = spectral HRTF (see HRTF Length), 1 = direct path with 32-tap minimum-phase HRIRs and no block latency, 2 = encode into the shared ambisonic bus (needs the Spatializer Ambisonic Decoder on a mixer group)");
+        RegisterParameter(definition, "HRTF Length", "", 0.0f, NUMHRTFLENGTHS - 1, 0.0f, 1.0f, 1.0f, P_HRTFLENGTH, "HRTF filter length (0 = 512 taps, 1 = 256, 2 = 128, 3 = 64 taps). Shorter filters are minimum-phase and cost less and have lower latency");
         definition.flags |= UnityAudioEffectDefinitionFlags_IsSpatializer;
         return numparams;
     }
@@ -229,6 +459,10 @@ namespace Spatializer
         InitParametersFromDefinitions(InternalRegisterEffectDefinition, effectdata->p);
 		state->effectdata = effectdata;
 		effectdata->momentary.Init(3.0f, (float)state->samplerate, 0.4f, 0.4f, (float)state->samplerate);
+        // The spectral voices transform blocks of up to HRTFLEN * 2 points and measure the ear levels on them
+        effectdata->bands.Init(HRTFLEN * 2, (float)state->samplerate);
+        FFT::Prepare(HRTFLEN * 2);
+        GetHRTFData();
         if(enableDebug){
             DebugInUnity(std::string("Spatialiser plugin loaded sucessfully"));
         }
@@ -242,6 +476,7 @@ namespace Spatializer
             DebugInUnity(std::string("Spatailiser plugin released:"));
         }
         EffectData* data = state->GetEffectData<EffectData>();
+        data->bands.Cleanup();
         delete data;
         return UNITY_AUDIODSP_OK;
     }
@@ -255,19 +490,6 @@ namespace Spatializer
         return UNITY_AUDIODSP_OK;
     }
     
-	static void SetupFilterCoeffs(EffectData::Data* data, float samplerate)
-	{
-		data->Octave1->SetupLowpass(63, samplerate, 1);
-		data->Octave2->SetupBandpass(125, samplerate, 1);
-		data->Octave3->SetupBandpass(250, samplerate, 1);
-		data->Octave4->SetupBandpass(500, samplerate, 1);
-		data->Octave5->SetupBandpass(1000, samplerate, 1);
-		data->Octave6->SetupBandpass(2000, samplerate, 1);
-		data->Octave7->SetupBandpass(4000, samplerate, 1);
-		data->Octave8->SetupHighpass(8000, samplerate, 1);
-	}
-
-
     UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK GetFloatParameterCallback(UnityAudioEffectState* state, int index, float* value, char *valuestr)
     {
         EffectData* data = state->GetEffectData<EffectData>();
@@ -296,8 +518,19 @@ namespace Spatializer
 
 		//=========
 
-		if (strcmp(name, "Coeffs") == 0) {
-			SetupFilterCoeffs(data, (float)state->samplerate);
+		if (strcmp(name, "Latency") == 0) {
+			buffer[0] = (float)GetLatency(effData->p[P_RENDERMODE], effData->p[P_HRTFLENGTH]);
+			if (numsamples > 1)
+				memset(buffer + 1, 0, sizeof(float) * (numsamples - 1));
+		}
+		else if (strcmp(name, "OctaveRMS") == 0) {
+			// The band levels of the left ear input followed by those of the right ear input
+			int num = (numsamples < 2 * BandEnergyAnalyzer::NUMBANDS) ? numsamples : 2 * BandEnergyAnalyzer::NUMBANDS;
+			memcpy(buffer, data->octaverms, sizeof(float) * num);
+			if (numsamples > num)
+				memset(buffer + num, 0, sizeof(float) * (numsamples - num));
+		}
+		else if (strcmp(name, "Coeffs") == 0) {
 			data->DisplayFilterCoeffs[7].StoreCoeffs(buffer);
 			data->DisplayFilterCoeffs[6].StoreCoeffs(buffer);
 			data->DisplayFilterCoeffs[5].StoreCoeffs(buffer);
@@ -317,22 +550,6 @@ namespace Spatializer
 		return UNITY_AUDIODSP_OK;
     }
     
-    static void GetHRTF(int channel, UnityComplexNumber* h, float azimuth, float elevation)
-    {
-        float e = FastClip(elevation * 0.1f + 4, 0, 12);
-        float f = floorf(e);
-        int index1 = (int)f;
-        if (index1 < 0)
-            index1 = 0;
-        else if (index1 > 12)
-            index1 = 12;
-        int index2 = index1 + 1;
-        if (index2 > 12)
-            index2 = 12;
-        sharedData.hrtfChannel[channel][index1].GetHRTF(h, azimuth, 1.0f);
-        sharedData.hrtfChannel[channel][index2].GetHRTF(h, azimuth, e - f);
-    }
-    
     extern "C" ABA_API void getRayData(long* len, float **data){
         *len = rayOutputData.size();
         auto size = (*len)*sizeof(float);
@@ -340,10 +557,54 @@ namespace Spatializer
         memcpy(*data, rayOutputData.data(), size);
     }
     
+    // Latency in frames that the spatializer adds for the given "Render Mode" and "HRTF Length" parameter values
+    extern "C" ABA_API int getSpatializerLatency(float renderMode, float hrtfLength){
+        return GetLatency(renderMode, hrtfLength);
+    }
+    
     extern "C" ABA_API void debugToggle(bool state){
         enableDebug = state;
     }
     
+    // Replaces the HRTF set by a dataset file (see HRTFDataset, created with Tools/sofa2hrtf). The file is memory-mapped,
+    // so switching is cheap and everything derived from the HRIRs is shared with other processes using the same file.
+    extern "C" ABA_API bool loadHRTFDataset(const char* path){
+        HRTFData* data = new HRTFData();
+        if (path == NULL || !data->InitFromFile(path))
+        {
+            delete data;
+            if(enableDebug){
+                DebugInUnity(std::string("Failed to load HRTF dataset"));
+            }
+            return false;
+        }
+        MutexScopeLock lock(hrtfDataMutex);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (size_t n = 0; n < retiredHRTFData.size();)
+        {
+            if (std::chrono::duration<double>(now - retiredHRTFData[n].time).count() > kHRTFDataGracePeriod)
+            {
+                delete retiredHRTFData[n].data;
+                retiredHRTFData[n] = retiredHRTFData.back();
+                retiredHRTFData.pop_back();
+            }
+            else
+                n++;
+        }
+        HRTFData* previous = activeHRTFData.exchange(data, std::memory_order_acq_rel);
+        if (previous != NULL)
+        {
+            RetiredHRTFData retired = { previous, now };
+            retiredHRTFData.push_back(retired);
+        }
+        return true;
+    }
+    
+    // Optional file for the transformed HRTF set. Must be set before the first spatializer instance is created.
+    extern "C" ABA_API void setHRTFCachePath(const char* path){
+        hrtfCachePath = (path != NULL) ? path : "";
+    }
+    
     extern "C" ABA_API void setTraceParam(int numberOfRays,int maxLen,int maxReflec){
         numRays  = numberOfRays;
         sourceSphere = raySphere(numRays);
@@ -484,6 +745,41 @@ namespace Spatializer
     };
     
     
+    // Ambisonic render mode: the part of the signal that is not spatialised is played by the instance itself and the rest
+    // is encoded into the bus. The binaural rendering only happens in the decoder, so the reverb is sent the dry signal.
+    static void ProcessAmbisonic(UnityAudioEffectState* state, EffectData* data, const float* inbuffer, float* outbuffer, int length, float dir_x, float dir_y, float dir_z)
+    {
+        float spatialblend = state->spatializerdata->spatialblend;
+        float reverbmix = state->spatializerdata->reverbzonemix;
+        float spread = cosf(state->spatializerdata->spread * kPI / 360.0f);
+        data->ambisonic.SetDirection(dir_x, dir_y, dir_z, spatialblend * GAINCORRECTION, FastMax(spread, 0.0f));
+        
+        float* bus = ambisonicbus.BeginSend(state->currdsptick, length);
+        if (bus != NULL)
+        {
+            for (int offset = 0; offset < length; offset += DIRECTBLOCKLEN)
+            {
+                int numsamples = (length - offset < DIRECTBLOCKLEN) ? (length - offset) : DIRECTBLOCKLEN;
+                data->ambisonic.Process(inbuffer + offset * 2, bus + offset * AMBISONICCHANNELS, numsamples, offset == 0);
+            }
+        }
+        ambisonicbus.EndSend();
+        
+        float* reverb = reverbsendbus.BeginSend(state->currdsptick, length);
+        for (int c = 0; c < 2; c++)
+        {
+            float stereopan = 1.0f - ((c == 0) ? FastMax(0.0f, state->spatializerdata->stereopan) : FastMax(0.0f, -state->spatializerdata->stereopan));
+            for (int n = 0; n < length; n++)
+            {
+                float s = inbuffer[n * 2 + c] * stereopan;
+                outbuffer[n * 2 + c] = s * (1.0f - spatialblend);
+                if (reverb != NULL)
+                    reverb[n * 2 + c] += s * reverbmix;
+            }
+        }
+        reverbsendbus.EndSend();
+    }
+    
     UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK ProcessCallback(UnityAudioEffectState* state, float* inbuffer, float* outbuffer, unsigned int length, int inchannels, int outchannels)
     {
 		EffectData* data = state->GetEffectData<EffectData>();
@@ -503,7 +799,6 @@ namespace Spatializer
 			src += inchannels;
 
 		}*/
-		float o1;
         static const float kRad2Deg = 180.0f / kPI;
         float* m = state->spatializerdata->listenermatrix;
         float* s = state->spatializerdata->sourcematrix;
@@ -524,117 +819,119 @@ namespace Spatializer
         float spatialblend = state->spatializerdata->spatialblend;
         float reverbmix = state->spatializerdata->reverbzonemix;
         
-        GetHRTF(0, data->ch[0].h, azimuth, elevation);
-        GetHRTF(1, data->ch[1].h, azimuth, elevation);
+        int rendermode = GetRenderMode(data->p[P_RENDERMODE]);
+        bool direct = rendermode == RENDERMODE_DIRECT;
+        int lengthindex = (int)FastClip(data->p[P_HRTFLENGTH], 0.0f, NUMHRTFLENGTHS - 1);
+        int voicemode = (rendermode == RENDERMODE_SPECTRAL) ? lengthindex : (NUMHRTFLENGTHS + rendermode - 1);
+        if (voicemode != data->voicemode)
+        {
+            memset(&data->voices, 0, sizeof(data->voices));
+            memset(&data->direct, 0, sizeof(data->direct));
+            memset(&data->ambisonic, 0, sizeof(data->ambisonic));
+            memset(&data->fifo, 0, sizeof(data->fifo));
+            memset(data->itd, 0, sizeof(data->itd));
+            memset(data->itddelay, 0, sizeof(data->itddelay));
+            data->voicemode = voicemode;
+        }
+        
+        if (rendermode == RENDERMODE_AMBISONIC)
+        {
+            ProcessAmbisonic(state, data, inbuffer, outbuffer, length, dir_x, dir_y, dir_z);
+            return UNITY_AUDIODSP_OK;
+        }
+        
+        HRTFData& hrtfdata = GetHRTFData();
+        // Keeps the cache entry from being refilled until the voices are done with it at the end of the callback
+        HRTFCache::Reader hrtfreader(direct ? NULL : &hrtfdata.cache[lengthindex]);
+        const HRTFCache::Entry* hrtf = NULL;
+        float itdtarget[2];
+        if (direct)
+        {
+            data->direct.SetHRIR(hrtfdata.hrir, azimuth, elevation);
+            for (int c = 0; c < 2; c++)
+                itdtarget[c] = hrtfdata.grid[NUMHRTFLENGTHS - 1].GetDelay(c, azimuth, elevation);
+        }
+        else
+        {
+            hrtf = hrtfreader.Get(azimuth, elevation);
+            itdtarget[0] = hrtf->delay[0];
+            itdtarget[1] = hrtf->delay[1];
+        }
+        bool applyitd = direct || lengthindex > 0;
+        const int blocklength = direct ? DIRECTBLOCKLEN : hrtfLengths[lengthindex];
         float spread = cosf(state->spatializerdata->spread * kPI / 360.0f);
         float spreadmatrix[2] = { 2.0f - spread, spread };
         
-        float* reverb = reverbmixbuffer;
-        for (int sampleOffset = 0; sampleOffset < length; sampleOffset += HRTFLEN)
+        float* reverb = reverbsendbus.BeginSend(state->currdsptick, length);
+        BlockFIFO& fifo = data->fifo;
+        for (int sampleOffset = 0; sampleOffset < length; )
         {
-			
+            // The direct path filters the host frames right away. The spectral path plays back the previous block from
+            // the FIFO up to the next block boundary.
+            int numsamples = direct ? blocklength : (blocklength - fifo.pos);
+            if (numsamples > length - sampleOffset)
+                numsamples = length - sampleOffset;
+            const UnityComplexNumber* stereo;
+            const float* dry;
+            if (direct)
+            {
+                stereo = data->direct.Process(inbuffer, numsamples, spreadmatrix, sampleOffset == 0);
+                dry = inbuffer;
+            }
+            else
+            {
+                stereo = fifo.output + fifo.pos;
+                dry = fifo.dry + fifo.pos * 2;
+            }
+
             for (int c = 0; c < 2; c++)
             {
                 float stereopan = 1.0f - ((c == 0) ? FastMax(0.0f, state->spatializerdata->stereopan) : FastMax(0.0f, -state->spatializerdata->stereopan));
                 
-                InstanceChannel& ch = data->ch[c];
+                // The minimum-phase filters have their time of arrival removed, so the ITD is applied as a delay that
+                // is ramped towards the new value over the block
+                float itddelay = data->itddelay[c];
+                float itdstep = (itdtarget[c] - itddelay) / (float)numsamples;
                 
-                for (int n = 0; n < HRTFLEN; n++)
+                for (int n = 0; n < numsamples; n++)
                 {
-                    float left  = inbuffer[n * 2];
-                    float right = inbuffer[n * 2 + 1];
-                    ch.buffer[n] = ch.buffer[n + HRTFLEN];
-                    ch.buffer[n + HRTFLEN] = left * spreadmatrix[c] + right * spreadmatrix[1 - c];
-                }
-
-                
-                UnityComplexNumber windowedInput[HRTFLEN*2];
-                
-                int startFreq = 250;
-                int startIdx = (int)startFreq/((state->samplerate/2)/(HRTFLEN*2));
-                float octavePower[numBands];
-                
-                for (int n = 0; n < HRTFLEN * 2; n++)
-                {
-                    windowedInput[n].re = (0.54f - 0.46f * cosf(n * (kPI / (float)HRTFLEN*2))) * ch.buffer[n];
-                    windowedInput[n].im = 0.0f;
-                    ch.x[n].re = ch.buffer[n];
-                    ch.x[n].im = 0.0f;
-                }
-                
-                FFT::Forward(windowedInput, HRTFLEN * 2, false);
-				UnityComplexNumber impulse[HRTFLEN * 2];
-        /*        
-                for(int i = 0; i < numBands; i++) {
-                    int binStartIdx = startIdx * (i+1);
-                    int binWidth = (binStartIdx*2)-binStartIdx;
-                    float magSum = 0;
-                    for(int j = (binStartIdx-(binWidth/2)); j < (binStartIdx * 2)+(binWidth/2); j++) {
-                        magSum += windowedInput[j].Magnitude2()*0.5f*(1.0f-cos(2*kPI*((j/(binWidth*2)))));
+                    float s = dry[n * 2 + c] * stereopan;
+                    float filtered = (c == 0) ? stereo[n].re : stereo[n].im;
+                    if (applyitd)
+                    {
+                        filtered = data->itd[c].Process(filtered, itddelay);
+                        itddelay += itdstep;
                     }
-					std::stringstream sstr;
-					sstr << " Magnitudes: ";
-					sstr << magSum;
-					sendStringStream(&sstr);
-                    octavePower[i] = sqrtf(magSum*2.0f);
+                    float y = s + (filtered * GAINCORRECTION - s) * spatialblend;
+                    outbuffer[n * 2 + c] = y;
+                    if (reverb != NULL)
+                        reverb[n * 2 + c] += y * reverbmix;
                 }
-				
-                
-                if(treeInit){//============
-					std::vector<float> imp = calcImpResponse(m, s, octavePower, data);
-					for (int n = 0; n < HRTFLEN * 2; n++) {
-						impulse[n].re = imp[n];
-						impulse[n].im = 0.0f;//===========
-					}
-				}
-                
-				FFT::Forward(impulse, HRTFLEN * 2, false);
-				for (int n = 0; n < HRTFLEN * 2; n++)
-					UnityComplexNumber::Mul<float, float, float>(ch.x[n], ch.h[n], ch.xh[n]);*/
-
-                FFT::Forward(ch.x, HRTFLEN * 2, false);
-                
-                for (int n = 0; n < HRTFLEN * 2; n++)
-                    UnityComplexNumber::Mul<float, float, float>(ch.xh[n], ch.h[n], ch.y[n]);
-                
-                FFT::Backward(ch.y, HRTFLEN * 2, false);
-                
-                for (int n = 0; n < HRTFLEN; n++)
+                data->itddelay[c] = itdtarget[c];
+            }
+            
+            if (!direct)
+            {
+                memcpy(fifo.input + fifo.pos * 2, inbuffer, sizeof(float) * numsamples * 2);
+                fifo.pos += numsamples;
+                if (fifo.pos == blocklength)
                 {
-                    float s = inbuffer[n * 2 + c] * stereopan;
-                    float y = s + (ch.y[n].re * GAINCORRECTION - s) * spatialblend;
-					o1 = data->data.Octave1[c].Process(y);
-					float o2 = data->data.Octave2[c].Process(y);
-					float o3 = data->data.Octave3[c].Process(y);
-					float o4 = data->data.Octave4[c].Process(y);
-					float o5 = data->data.Octave5[c].Process(y);
-					float o6 = data->data.Octave6[c].Process(y);
-					float o7 = data->data.Octave7[c].Process(y);
-					float o8 = data->data.Octave8[c].Process(y);
-					
-
-                    outbuffer[n * 2 + c] = y;
-                    reverb[n * 2 + c] += y * reverbmix;
+                    bool mono = IsMono(fifo.input, blocklength, spreadmatrix);
+                    const UnityComplexNumber* filtered = data->voices.Process(lengthindex, fifo.input, spreadmatrix, hrtf, mono, data->bands, data->data.octaverms);
+                    memcpy(fifo.output, filtered, sizeof(UnityComplexNumber) * blocklength);
+                    memcpy(fifo.dry, fifo.input, sizeof(float) * blocklength * 2);
+                    fifo.pos = 0;
                 }
-				// ============We have to change this for each octave==============
-				const float* src = inbuffer;
-				data->momentary.Feed(src, inchannels);
-				src += inchannels;
-				//======================================
-
-				float rmsData = data->momentary.rms[1];
-				std::stringstream sstr1;
-				sstr1 << "rms1: ";
-				sstr1 << (rmsData);
-				std::string s2 = sstr1.str();
-				DebugInUnity(std::string(s2));
             }
             
-            inbuffer += HRTFLEN * 2;
-            outbuffer += HRTFLEN * 2;
-            reverb += HRTFLEN * 2;
+            inbuffer += numsamples * 2;
+            outbuffer += numsamples * 2;
+            if (reverb != NULL)
+                reverb += numsamples * 2;
+            sampleOffset += numsamples;
         }
         
+        reverbsendbus.EndSend();
         return UNITY_AUDIODSP_OK;
     }
 }
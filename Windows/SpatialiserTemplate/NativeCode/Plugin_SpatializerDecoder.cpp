@@ -0,0 +1,139 @@
+// Binaural decoder for the shared ambisonic bus. Spatializer instances in the ambisonic render mode only encode their input
+// into a third-order field, and this effect renders the whole field with one set of HRTF filters per mixer block. The cost
+// per voice is then a handful of multiply-adds per frame instead of a convolution, which allows for hundreds of voices.
+
+#include "AudioPluginUtil.h"
+#include "hrtfUtil.h"
+
+SendBus ambisonicbus(SphericalHarmonics::MAXCHANNELS);
+
+namespace Spatializer
+{
+    const SHDecoderFilters& GetSHDecoderFilters();
+}
+
+namespace SpatializerDecoder
+{
+    const int NUMCHANNELS = SphericalHarmonics::MAXCHANNELS;
+    typedef FIRFilter<SHDecoderFilters::LENGTH> DecoderFilter;
+    const int CHUNK = DecoderFilter::CHUNK;
+
+    enum
+    {
+        P_ORDER,
+        P_NUM
+    };
+
+    struct EffectData
+    {
+        float p[P_NUM];
+        int capacity;                   // Frames that field can hold
+        float* field;                   // The bus for the current block, interleaved
+        float channel[CHUNK];
+        float filtered[CHUNK];
+        float ear[2][CHUNK];
+        DecoderFilter fir[2][NUMCHANNELS];
+    };
+
+    int InternalRegisterEffectDefinition(UnityAudioEffectDefinition& definition)
+    {
+        int numparams = P_NUM;
+        definition.paramdefs = new UnityAudioParameterDefinition[numparams];
+        RegisterParameter(definition, "Order", "", 1.0f, SphericalHarmonics::MAXORDER, SphericalHarmonics::MAXORDER, 1.0f, 1.0f, P_ORDER, "Ambisonic order that the bus is decoded with. Lower orders cost less and give less sharp source images");
+        return numparams;
+    }
+
+    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK CreateCallback(UnityAudioEffectState* state)
+    {
+        EffectData* effectdata = new EffectData;
+        memset(effectdata, 0, sizeof(EffectData));
+        state->effectdata = effectdata;
+        InitParametersFromDefinitions(InternalRegisterEffectDefinition, effectdata->p);
+        effectdata->capacity = ((int)state->dspbuffersize > CHUNK) ? (int)state->dspbuffersize : CHUNK;
+        effectdata->field = (float*)MemoryPool::Allocate(sizeof(float) * effectdata->capacity * NUMCHANNELS);
+        ambisonicbus.Reserve(state->dspbuffersize);
+        Spatializer::GetSHDecoderFilters();
+        return UNITY_AUDIODSP_OK;
+    }
+
+    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK ReleaseCallback(UnityAudioEffectState* state)
+    {
+        EffectData* data = state->GetEffectData<EffectData>();
+        MemoryPool::Free(data->field);
+        delete data;
+        return UNITY_AUDIODSP_OK;
+    }
+
+    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK SetFloatParameterCallback(UnityAudioEffectState* state, int index, float value)
+    {
+        EffectData* data = state->GetEffectData<EffectData>();
+        if (index >= P_NUM)
+            return UNITY_AUDIODSP_ERR_UNSUPPORTED;
+        data->p[index] = value;
+        return UNITY_AUDIODSP_OK;
+    }
+
+    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK GetFloatParameterCallback(UnityAudioEffectState* state, int index, float* value, char *valuestr)
+    {
+        EffectData* data = state->GetEffectData<EffectData>();
+        if (index >= P_NUM)
+            return UNITY_AUDIODSP_ERR_UNSUPPORTED;
+        if (value != NULL)
+            *value = data->p[index];
+        if (valuestr != NULL)
+            valuestr[0] = 0;
+        return UNITY_AUDIODSP_OK;
+    }
+
+    int UNITY_AUDIODSP_CALLBACK GetFloatBufferCallback(UnityAudioEffectState* state, const char* name, float* buffer, int numsamples)
+    {
+        return UNITY_AUDIODSP_OK;
+    }
+
+    UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK ProcessCallback(UnityAudioEffectState* state, float* inbuffer, float* outbuffer, unsigned int length, int inchannels, int outchannels)
+    {
+        memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
+        if (inchannels != 2 || outchannels != 2)
+            return UNITY_AUDIODSP_OK;
+
+        EffectData* data = state->GetEffectData<EffectData>();
+
+        // The channels of a lower order are a prefix of the third-order field, and their filters do not depend on the order
+        const SHDecoderFilters& filters = Spatializer::GetSHDecoderFilters();
+        const int numchannels = SphericalHarmonics::GetNumChannels((int)FastClip(data->p[P_ORDER], 1.0f, SphericalHarmonics::MAXORDER));
+
+        // field holds the block size announced at creation. Longer blocks are received in pieces of that size, the bus keeps
+        // the rest of each send for the next piece.
+        for (int start = 0; start < (int)length; start += data->capacity)
+        {
+            const int piece = ((int)length - start < data->capacity) ? ((int)length - start) : data->capacity;
+            memset(data->field, 0, sizeof(float) * piece * NUMCHANNELS);
+            ambisonicbus.Receive(state->currdsptick + start, data->field, piece);
+            for (int offset = 0; offset < piece; offset += CHUNK)
+            {
+                const int num = (piece - offset < CHUNK) ? (piece - offset) : CHUNK;
+                const float* field = data->field + offset * NUMCHANNELS;
+                memset(data->ear, 0, sizeof(data->ear));
+                for (int k = 0; k < numchannels; k++)
+                {
+                    for (int n = 0; n < num; n++)
+                        data->channel[n] = field[n * NUMCHANNELS + k];
+                    for (int c = 0; c < 2; c++)
+                    {
+                        data->fir[c][k].Process(data->channel, data->filtered, num, filters.Get(c, k));
+                        for (int n = 0; n < num; n++)
+                            data->ear[c][n] += data->filtered[n];
+                    }
+                }
+                float* out = outbuffer + (start + offset) * 2;
+                for (int n = 0; n < num; n++)
+                {
+                    out[n * 2] += data->ear[0][n];
+                    out[n * 2 + 1] += data->ear[1][n];
+                }
+            }
+        }
+
+        return UNITY_AUDIODSP_OK;
+    }
+}
@@ -2,44 +2,70 @@
 
 #include "AudioPluginUtil.h"
 
-float reverbmixbuffer[65536] = { 0 };
+SendBus reverbsendbus;
+
+// Decay times of the low, mid and high band estimated from the ray-traced room by the spatializer, published only as a
+// complete set
+SharedValues<FeedbackDelayNetwork::NUMBANDS> reverbroomdecay;
 
 namespace SpatializerReverb
 {
     const int MAXTAPS = 1024;
+    const int CHUNK = 256;
+    const float MAXDELAYTIME = 5.0f;
 
     enum
     {
         P_DELAYTIME,
         P_DIFFUSION,
+        P_ENGINE,
+        P_DECAYLOW,
+        P_DECAYMID,
+        P_DECAYHIGH,
+        P_ROOMDECAY,
         P_NUM
     };
 
     struct InstanceChannel
     {
-        struct Tap
-        {
-            int pos;
-            float amp;
-        };
+        // Written forwards. The first CHUNK samples are mirrored past the end of the buffer,
+        // so that any run of up to CHUNK samples can be read without wrapping around.
         struct Delay
         {
-            enum { MASK = 0xFFFFF };
             int writepos;
-            inline void Write(float x)
+            int mask;
+            float* data;
+
+            // Room for delays of up to maxdelay samples. A whole chunk is written before it is read, so the power-of-two
+            // size has to cover the delay plus one chunk.
+            void Init(int maxdelay)
             {
-                writepos = (writepos + MASK) & MASK;
-                data[writepos] = x;
+                int size = 1;
+                while (size < maxdelay + CHUNK)
+                    size *= 2;
+                MemoryPool::Free(data);
+                data = (float*)MemoryPool::Allocate(sizeof(float) * (size + CHUNK));
+                mask = size - 1;
+                writepos = 0;
             }
 
-            inline float Read(int delay) const
+            void Cleanup()
             {
-                return data[(writepos + delay) & MASK];
+                MemoryPool::Free(data);
+                data = NULL;
             }
 
-            float data[MASK + 1];
+            inline void Write(float x)
+            {
+                data[writepos] = x;
+                if (writepos < CHUNK)
+                    data[writepos + mask + 1] = x;
+                writepos = (writepos + 1) & mask;
+            }
         };
-        Tap taps[1024];
+        int tappos[MAXTAPS]; // In samples, ascending
+        float tapamp[MAXTAPS];
+        int tapoffset[MAXTAPS]; // Read offsets into the delay line for the current chunk
         Delay delay;
     };
 
@@ -47,6 +73,11 @@ namespace SpatializerReverb
     {
         float p[P_NUM];
         Random random;
+        float tapdelaytime; // Delay time and tap count that the current taps were generated for
+        int numtaps;
+        float output[CHUNK];
+        float samplerate;   // Sample rate that the delay lines are sized for
+        FeedbackDelayNetwork fdn;
         InstanceChannel ch[2];
     };
 
@@ -54,24 +85,47 @@ namespace SpatializerReverb
     {
         int numparams = P_NUM;
         definition.paramdefs = new UnityAudioParameterDefinition[numparams];
-        RegisterParameter(definition, "Delay Time", "", 0.0f, 5.0f, 2.0f, 1.0f, 1.0f, P_DELAYTIME, "Delay time in seconds");
+        RegisterParameter(definition, "Delay Time", "", 0.0f, MAXDELAYTIME, 2.0f, 1.0f, 1.0f, P_DELAYTIME, "Delay time in seconds");
         RegisterParameter(definition, "Diffusion", "%", 0.0f, 1.0f, 0.5f, 100.0f, 1.0f, P_DIFFUSION, "Diffusion amount");
+        RegisterParameter(definition, "Engine", "", 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, P_ENGINE, "Late reverb engine: 0 = velvet noise, 1 = feedback delay network");
+        RegisterParameter(definition, "Decay Low", "s", 0.1f, 20.0f, 2.0f, 1.0f, 1.0f, P_DECAYLOW, "Decay time below 350 Hz (feedback delay network only)");
+        RegisterParameter(definition, "Decay Mid", "s", 0.1f, 20.0f, 1.5f, 1.0f, 1.0f, P_DECAYMID, "Decay time between 350 Hz and 2.8 kHz (feedback delay network only)");
+        RegisterParameter(definition, "Decay High", "s", 0.1f, 20.0f, 0.8f, 1.0f, 1.0f, P_DECAYHIGH, "Decay time above 2.8 kHz (feedback delay network only)");
+        RegisterParameter(definition, "Room Decay", "", 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, P_ROOMDECAY, "Use the decay times of the ray-traced room instead of the decay parameters when available");
         return numparams;
     }
 
+    static std::atomic<int> numinstances(0);
+
+    // Sizes the velvet-noise delay lines for the longest delay time at the given sample rate
+    static void InitDelays(EffectData* data, float samplerate)
+    {
+        data->samplerate = samplerate;
+        for (int c = 0; c < 2; c++)
+            data->ch[c].delay.Init((int)(MAXDELAYTIME * samplerate + 1.0f) + 1);
+    }
+
     UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK CreateCallback(UnityAudioEffectState* state)
     {
         EffectData* effectdata = new EffectData;
         memset(effectdata, 0, sizeof(EffectData));
         state->effectdata = effectdata;
         InitParametersFromDefinitions(InternalRegisterEffectDefinition, effectdata->p);
+        effectdata->fdn.Init((float)state->samplerate);
+        InitDelays(effectdata, (float)state->samplerate);
+        reverbsendbus.Reserve(state->dspbuffersize);
+        numinstances++;
         return UNITY_AUDIODSP_OK;
     }
 
     UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK ReleaseCallback(UnityAudioEffectState* state)
     {
         EffectData* data = state->GetEffectData<EffectData>();
+        data->fdn.Cleanup();
+        for (int c = 0; c < 2; c++)
+            data->ch[c].delay.Cleanup();
         delete data;
+        numinstances--;
         return UNITY_AUDIODSP_OK;
     }
 
@@ -101,6 +155,38 @@ namespace SpatializerReverb
         return UNITY_AUDIODSP_OK;
     }
 
+    // The taps only depend on the delay time and the diffusion, so they are only regenerated when one of these
+    // (or the sample rate that the delay time is given in) changes.
+    static void UpdateTaps(EffectData* data, float delaytime, int numtaps)
+    {
+        if (delaytime == data->tapdelaytime && numtaps == data->numtaps)
+            return;
+
+        data->tapdelaytime = delaytime;
+        data->numtaps = numtaps;
+        data->random.Seed(0);
+
+        for (int c = 0; c < 2; c++)
+        {
+            InstanceChannel& ch = data->ch[c];
+
+            // Positions are accumulated, so the taps come out sorted
+            float decay = powf(0.01f, 1.0f / (float)numtaps);
+            float p = 0.0f, amp = (decay - 1.0f) / (powf(decay, numtaps + 1) - 1.0f);
+            for (int k = 0; k < numtaps; k++)
+            {
+                p += data->random.GetFloat(0.0f, 100.0f);
+                ch.tappos[k] = p;
+                ch.tapamp[k] = amp;
+                amp *= decay;
+            }
+
+            float scale = delaytime / p;
+            for (int k = 0; k < numtaps; k++)
+                ch.tappos[k] *= scale;
+        }
+    }
+
     UNITY_AUDIODSP_RESULT UNITY_AUDIODSP_CALLBACK ProcessCallback(UnityAudioEffectState* state, float* inbuffer, float* outbuffer, unsigned int length, int inchannels, int outchannels)
     {
         if (inchannels != 2 || outchannels != 2)
@@ -111,54 +197,63 @@ namespace SpatializerReverb
 
         EffectData* data = state->GetEffectData<EffectData>();
 
+        // Both engines work in place on the sum of the input and the sends
+        memcpy(outbuffer, inbuffer, length * outchannels * sizeof(float));
+        reverbsendbus.Receive(state->currdsptick, outbuffer, length);
+
+        if (data->p[P_ENGINE] >= 0.5f)
+        {
+            if (data->fdn.samplerate != (float)state->samplerate)
+                data->fdn.Init((float)state->samplerate);
+
+            float t60[FeedbackDelayNetwork::NUMBANDS] = { data->p[P_DECAYLOW], data->p[P_DECAYMID], data->p[P_DECAYHIGH] };
+            if (data->p[P_ROOMDECAY] >= 0.5f)
+                reverbroomdecay.Read(t60);
+            data->fdn.SetDecayTimes(t60);
+
+            data->fdn.Process(outbuffer, outbuffer, length);
+            return UNITY_AUDIODSP_OK;
+        }
+
+        if (data->samplerate != (float)state->samplerate)
+            InitDelays(data, (float)state->samplerate);
+
         const float delaytime = data->p[P_DELAYTIME] * state->samplerate + 1.0f;
         const int numtaps = (int)(data->p[P_DIFFUSION] * (MAXTAPS - 2) + 1);
 
-        data->random.Seed(0);
+        UpdateTaps(data, delaytime, numtaps);
 
+        // The input is written a chunk at a time, after which all taps are accumulated over the chunk at once
         for (int c = 0; c < 2; c++)
         {
             InstanceChannel& ch = data->ch[c];
-            const InstanceChannel::Tap* tap_end = ch.taps + numtaps;
-
-            float decay = powf(0.01f, 1.0f / (float)numtaps);
-            float p = 0.0f, amp = (decay - 1.0f) / (powf(decay, numtaps + 1) - 1.0f);
-            InstanceChannel::Tap* tap = ch.taps;
-            while (tap != tap_end)
-            {
-                p += data->random.GetFloat(0.0f, 100.0f);
-                tap->pos = p;
-                tap->amp = amp;
-                amp *= decay;
-                ++tap;
-            }
-
-            float scale = delaytime / p;
-            tap = ch.taps;
-            while (tap != tap_end)
+            for (int offset = 0; offset < length; offset += CHUNK)
             {
-                tap->pos *= scale;
-                ++tap;
-            }
+                const int num = (length - offset < CHUNK) ? (length - offset) : CHUNK;
+                const int readpos = ch.delay.writepos;
+                for (int n = 0; n < num; n++)
+                    ch.delay.Write(outbuffer[(offset + n) * 2 + c]);
 
-            for (int n = 0; n < length; n++)
-            {
-                ch.delay.Write(inbuffer[n * 2 + c] + reverbmixbuffer[n * 2 + c]);
+                for (int k = 0; k < numtaps; k++)
+                    ch.tapoffset[k] = (readpos - ch.tappos[k]) & ch.delay.mask;
 
-                float s = 0.0f;
-                const InstanceChannel::Tap* tap = ch.taps;
-                while (tap != tap_end)
-                {
-                    s += ch.delay.Read(tap->pos) * tap->amp;
-                    ++tap;
-                }
+                FIR::SparseCorrelate(ch.delay.data, ch.tapoffset, ch.tapamp, data->output, num, numtaps);
 
-                outbuffer[n * 2 + c] = s;
+                for (int n = 0; n < num; n++)
+                    outbuffer[(offset + n) * 2 + c] = data->output[n];
             }
         }
 
-        memset(reverbmixbuffer, 0, sizeof(reverbmixbuffer));
-
         return UNITY_AUDIODSP_OK;
     }
+
+    // Memory held by all reverb instances (including the feedback delay networks) and the pooled memory kept for reuse
+    extern "C" UNITY_AUDIODSP_EXPORT_API void getReverbMemoryStats(int* instances, long long* bytesused, long long* bytespooled)
+    {
+        size_t used, pooled;
+        MemoryPool::GetStats(used, pooled);
+        *instances = numinstances;
+        *bytesused = (long long)(used + numinstances * sizeof(EffectData));
+        *bytespooled = (long long)pooled;
+    }
 }
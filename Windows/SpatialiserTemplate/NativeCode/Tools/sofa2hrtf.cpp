@@ -0,0 +1,159 @@
+// Offline converter from SOFA (AES69) HRIR files to the binary HRTF dataset format used by the spatializer.
+//
+// Usage: sofa2hrtf <input.sofa> <output.hrtf>
+//
+// The measured directions are resampled onto the spatializer's HRTF grid by picking the nearest measurement for every
+// grid cell. Everything the plugin renders from the HRIRs is then derived exactly as the plugin would derive it (see
+// HRTFDataset), so the output file can be memory-mapped by loadHRTFDataset() without further processing.
+//
+// SOFA files are netCDF-4 files. Building needs the netCDF C library and AudioPluginUtil.cpp for the FFT code, compiled
+// without the effect definitions so that none of the plugins have to be linked:
+//   Windows: cl /O2 /EHsc /I.. /DENABLE_EFFECTS=0 sofa2hrtf.cpp ..\AudioPluginUtil.cpp netcdf.lib
+//   macOS/Linux: c++ -std=c++11 -O2 -I.. -DENABLE_EFFECTS=0 sofa2hrtf.cpp ../AudioPluginUtil.cpp -lnetcdf -lpthread
+
+#include "hrtfUtil.h"
+#include <netcdf.h>
+#include <string>
+#include <vector>
+
+static bool ReadVariable(int ncid, const char* name, std::vector<double>& values)
+{
+    int varid, ndims, dimids[NC_MAX_VAR_DIMS];
+    if (nc_inq_varid(ncid, name, &varid) != NC_NOERR || nc_inq_varndims(ncid, varid, &ndims) != NC_NOERR)
+        return false;
+    nc_inq_vardimid(ncid, varid, dimids);
+    size_t size = 1;
+    for (int n = 0; n < ndims; n++)
+    {
+        size_t len;
+        nc_inq_dimlen(ncid, dimids[n], &len);
+        size *= len;
+    }
+    values.resize(size);
+    return nc_get_var_double(ncid, varid, &values[0]) == NC_NOERR;
+}
+
+static bool ReadDimension(int ncid, const char* name, size_t& len)
+{
+    int dimid;
+    return nc_inq_dimid(ncid, name, &dimid) == NC_NOERR && nc_inq_dimlen(ncid, dimid, &len) == NC_NOERR;
+}
+
+static bool IsCartesian(int ncid, const char* name)
+{
+    int varid;
+    size_t len;
+    if (nc_inq_varid(ncid, name, &varid) != NC_NOERR || nc_inq_attlen(ncid, varid, "Type", &len) != NC_NOERR)
+        return false;
+    std::string type(len, ' ');
+    nc_get_att_text(ncid, varid, "Type", &type[0]);
+    return type.compare(0, 9, "cartesian") == 0;
+}
+
+// Unit vector in the SOFA coordinate system (x front, y left, z up) from azimuth (counter-clockwise) and elevation in degrees
+static void ToVector(double azimuth, double elevation, double* v)
+{
+    double a = azimuth * kPI_double / 180.0, e = elevation * kPI_double / 180.0;
+    v[0] = cos(e) * cos(a);
+    v[1] = cos(e) * sin(a);
+    v[2] = sin(e);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <input.sofa> <output.hrtf>\n", argv[0]);
+        return 1;
+    }
+    const int hrirlength = HRTFDataset::MAXLENGTH;
+
+    int ncid;
+    if (nc_open(argv[1], NC_NOWRITE, &ncid) != NC_NOERR)
+    {
+        printf("Could not open %s\n", argv[1]);
+        return 1;
+    }
+
+    size_t nummeasurements, numreceivers, numsamples;
+    std::vector<double> ir, positions, samplerate;
+    if (!ReadDimension(ncid, "M", nummeasurements) || !ReadDimension(ncid, "R", numreceivers) || !ReadDimension(ncid, "N", numsamples) ||
+        !ReadVariable(ncid, "Data.IR", ir) || !ReadVariable(ncid, "SourcePosition", positions) || !ReadVariable(ncid, "Data.SamplingRate", samplerate))
+    {
+        printf("%s is not a SimpleFreeFieldHRIR file\n", argv[1]);
+        nc_close(ncid);
+        return 1;
+    }
+    bool cartesian = IsCartesian(ncid, "SourcePosition");
+    nc_close(ncid);
+
+    if (numreceivers != 2)
+    {
+        printf("Expected 2 receivers, found %d\n", (int)numreceivers);
+        return 1;
+    }
+    if (samplerate[0] != 44100.0)
+        printf("Warning: HRIRs are sampled at %g Hz and are not resampled\n", samplerate[0]);
+    if (numsamples > (size_t)hrirlength)
+        printf("Warning: HRIRs are truncated from %d to %d samples\n", (int)numsamples, hrirlength);
+
+    std::vector<double> directions(nummeasurements * 3);
+    for (size_t m = 0; m < nummeasurements; m++)
+    {
+        double* v = &directions[m * 3];
+        const double* p = &positions[m * 3];
+        if (cartesian)
+        {
+            double len = sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]) + 1.0e-12;
+            v[0] = p[0] / len;
+            v[1] = p[1] / len;
+            v[2] = p[2] / len;
+        }
+        else
+            ToVector(p[0], p[1], v);
+    }
+
+    // Lay out the nearest measurements as uniform rings in the same format as the compiled-in table and let the
+    // dataset do the transforms. The plugin measures azimuth clockwise, SOFA counter-clockwise.
+    std::vector<float> table;
+    for (int c = 0; c < 2; c++)
+    {
+        for (int e = 0; e < HRTFGrid::NUMELEVATIONS; e++)
+        {
+            float elevation = HRTFGrid::GetElevationStart() + e * HRTFGrid::GetElevationStep();
+            table.push_back((float)HRTFGrid::NUMAZIMUTHS);
+            for (int a = 0; a < HRTFGrid::NUMAZIMUTHS; a++)
+                table.push_back(a * HRTFGrid::GetAzimuthStep());
+            for (int a = 0; a < HRTFGrid::NUMAZIMUTHS; a++)
+            {
+                double v[3];
+                ToVector(-a * HRTFGrid::GetAzimuthStep(), elevation, v);
+                size_t nearest = 0;
+                double best = -2.0;
+                for (size_t m = 0; m < nummeasurements; m++)
+                {
+                    const double* d = &directions[m * 3];
+                    double dot = v[0] * d[0] + v[1] * d[1] + v[2] * d[2];
+                    if (dot > best)
+                    {
+                        best = dot;
+                        nearest = m;
+                    }
+                }
+                const double* h = &ir[(nearest * numreceivers + c) * numsamples];
+                for (int n = 0; n < hrirlength; n++)
+                    table.push_back((n < (int)numsamples) ? (float)h[n] : 0.0f);
+            }
+        }
+    }
+
+    HRTFDataset dataset;
+    dataset.Build(&table[0], std::thread::hardware_concurrency());
+    if (!dataset.Save(argv[2], (int)samplerate[0]))
+    {
+        printf("Could not write %s\n", argv[2]);
+        return 1;
+    }
+    printf("Wrote %s (%d measurements, %d-tap HRIRs)\n", argv[2], (int)nummeasurements, hrirlength);
+    return 0;
+}
@@ -0,0 +1,1096 @@
+#pragma once
+
+#include "AudioPluginUtil.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+
+#if !UNITY_WIN
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file. Pages are shared between all processes that map the same file.
+class MappedFile
+{
+public:
+    inline MappedFile() : base(NULL), size(0)
+#if UNITY_WIN
+        , file(INVALID_HANDLE_VALUE), mapping(NULL)
+#endif
+    {
+    }
+
+    inline ~MappedFile() { Close(); }
+
+    bool Open(const char* path)
+    {
+        Close();
+#if UNITY_WIN
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER filesize;
+        if (!GetFileSizeEx(file, &filesize) || filesize.QuadPart == 0)
+        {
+            Close();
+            return false;
+        }
+        size = (size_t)filesize.QuadPart;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL)
+            base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            size = (size_t)st.st_size;
+            base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (base == MAP_FAILED)
+                base = NULL;
+        }
+        close(fd);
+#endif
+        if (base == NULL)
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+#if UNITY_WIN
+        if (base != NULL)
+            UnmapViewOfFile(base);
+        if (mapping != NULL)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (base != NULL)
+            munmap(base, size);
+#endif
+        base = NULL;
+        size = 0;
+    }
+
+    inline const unsigned char* GetData() const { return (const unsigned char*)base; }
+    inline size_t GetSize() const { return size; }
+
+protected:
+    void* base;
+    size_t size;
+#if UNITY_WIN
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+};
+
+// Header of the binary HRTF dataset format (see HRTFDataset). All fields are little-endian.
+// The header is followed by numsections HRTFFileSection entries.
+struct HRTFFileHeader
+{
+    unsigned int magic;            // HRTFFILE_MAGIC
+    unsigned int version;          // HRTFFILE_VERSION
+    unsigned int hrirlength;       // Length of the measured HRIRs, the longest grid
+    unsigned int numchannels;
+    unsigned int numelevations;
+    unsigned int numazimuths;
+    float elevationstart;          // Degrees
+    float elevationstep;           // Degrees
+    unsigned int numsections;
+    unsigned int reserved0;
+    unsigned int samplerate;       // Sample rate of the source HRIRs in Hz (informational)
+    unsigned int reserved[5];
+};
+
+// Block of floats in the layout of the class it is mapped into (HRTFGrid, HRIRGrid or SHDecoderFilters)
+struct HRTFFileSection
+{
+    unsigned int type;             // HRTFSECTION_*
+    unsigned int length;           // HRIR length of grids, onsets and HRIRs, order of the decoder
+    unsigned int offset;           // Bytes from the start of the file, a multiple of HRTFFILE_ALIGNMENT
+    unsigned int size;             // Bytes
+};
+
+enum
+{
+    HRTFFILE_MAGIC = 0x46545248,   // "HRTF"
+    HRTFFILE_VERSION = 3,
+    HRTFFILE_ALIGNMENT = 64
+};
+
+enum
+{
+    HRTFSECTION_SPECTRA,
+    HRTFSECTION_ONSETS,
+    HRTFSECTION_HRIRS,
+    HRTFSECTION_DECODER
+};
+
+// HRTF set resampled onto a uniform azimuth/elevation grid.
+// The measured data comes as one ring of HRIRs per elevation with a varying number of azimuths per ring, which makes
+// lookups a linear search. On the grid every lookup is a direct index computation and the four neighbouring cells are
+// blended in a single pass. Each cell holds one complex spectrum of specsize bins in split form (real parts followed by
+// imaginary parts), so cells are contiguous blocks of specsize * 2 floats.
+class HRTFGrid
+{
+public:
+    enum { NUMELEVATIONS = 14 };   // Rings from -40 to 90 degrees in steps of 10 degrees, as in hrtfSrcData
+    enum { NUMAZIMUTHS = 72 };     // 5 degree resolution, which matches the densest ring of the source data
+
+    int specsize;
+    const float* data;             // Either the owned buffer or a view into a mapped dataset file
+    const float* onsets;           // Onset time in samples per cell for minimum-phase grids, NULL otherwise
+
+protected:
+    float* buffer;
+    float* onsetbuffer;
+
+public:
+    inline HRTFGrid() : specsize(0), data(NULL), onsets(NULL), buffer(NULL), onsetbuffer(NULL) {}
+    inline ~HRTFGrid() { delete[] buffer; delete[] onsetbuffer; }
+
+    static inline float GetElevationStart() { return -40.0f; }
+    static inline float GetElevationStep() { return 10.0f; }
+    static inline float GetAzimuthStep() { return 360.0f / (float)NUMAZIMUTHS; }
+
+    inline int GetCellSize() const { return specsize * 2; }
+
+    inline int GetDataSize() const { return 2 * NUMELEVATIONS * NUMAZIMUTHS * GetCellSize(); }
+
+    static inline int GetNumCells() { return 2 * NUMELEVATIONS * NUMAZIMUTHS; }
+
+    inline const float* GetCell(int channel, int elevation, int azimuth) const
+    {
+        return data + GetCellOffset(channel, elevation, azimuth);
+    }
+
+    // Builds the grid from the compiled-in table. Per channel and elevation ring the layout of src is:
+    // number of angles, the angles in ascending degrees and then one HRIR of hrirlength samples per angle.
+    // The HRIRs are placed in the second half of a zero-padded transform of specsize bins (see ProcessCallback).
+    // Rings are independent, so they are distributed over numthreads worker threads.
+    void Build(const float* src, int hrirlength, int numthreads)
+    {
+        Allocate(hrirlength);
+
+        const float* rings[2 * NUMELEVATIONS];
+        for (int r = 0; r < 2 * NUMELEVATIONS; r++)
+        {
+            rings[r] = src;
+            int numangles = (int)src[0];
+            src += 1 + numangles * (1 + hrirlength);
+        }
+
+        std::vector<UnityComplexNumber> h(specsize);
+
+        if (numthreads > 2 * NUMELEVATIONS)
+            numthreads = 2 * NUMELEVATIONS;
+        if (numthreads <= 1)
+        {
+            BuildRings(rings, 0, 1, &h[0]);
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < numthreads; t++)
+            workers.push_back(std::thread([this, &rings, t, numthreads]()
+            {
+                std::vector<UnityComplexNumber> h(specsize);
+                BuildRings(rings, t, numthreads, &h[0]);
+            }));
+        BuildRings(rings, 0, numthreads, &h[0]);
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+    }
+
+    // Uses GetDataSize() floats of spectra and, for minimum-phase grids, GetNumCells() floats of onsets in place.
+    // They have to stay valid for as long as the grid is used.
+    void Map(int hrirlength, const float* spectra, const float* _onsets)
+    {
+        delete[] buffer;
+        delete[] onsetbuffer;
+        buffer = NULL;
+        onsetbuffer = NULL;
+        specsize = hrirlength * 2;
+        data = spectra;
+        onsets = _onsets;
+    }
+
+    // Indices (elevation * NUMAZIMUTHS + azimuth) of the four cells surrounding a direction in degrees and their bilinear weights
+    static inline void GetNeighbours(float azimuth, float elevation, int* cells, float* weights)
+    {
+        float e = FastClip((elevation - GetElevationStart()) / GetElevationStep(), 0.0f, (float)(NUMELEVATIONS - 1));
+        int e1 = (int)e;
+        int e2 = (e1 < NUMELEVATIONS - 1) ? (e1 + 1) : e1;
+        float fe = e - (float)e1;
+
+        float a = azimuth / GetAzimuthStep();
+        float af = floorf(a);
+        float fa = a - af;
+        int a1 = (int)af % NUMAZIMUTHS;
+        if (a1 < 0)
+            a1 += NUMAZIMUTHS;
+        int a2 = (a1 + 1) % NUMAZIMUTHS;
+
+        cells[0] = e1 * NUMAZIMUTHS + a1;
+        cells[1] = e1 * NUMAZIMUTHS + a2;
+        cells[2] = e2 * NUMAZIMUTHS + a1;
+        cells[3] = e2 * NUMAZIMUTHS + a2;
+        weights[0] = (1.0f - fe) * (1.0f - fa);
+        weights[1] = (1.0f - fe) * fa;
+        weights[2] = fe * (1.0f - fa);
+        weights[3] = fe * fa;
+    }
+
+    // Bilinear interpolation between the four grid cells surrounding the given direction (in degrees).
+    // The result is written as one split spectrum of specsize bins.
+    inline void GetHRTF(int channel, float azimuth, float elevation, float* result) const
+    {
+        int cells[4];
+        float weights[4];
+        GetNeighbours(azimuth, elevation, cells, weights);
+        const float* base = data + channel * NUMELEVATIONS * NUMAZIMUTHS * GetCellSize();
+        const float* src[4] = { base + cells[0] * GetCellSize(), base + cells[1] * GetCellSize(), base + cells[2] * GetCellSize(), base + cells[3] * GetCellSize() };
+        SplitComplex::Blend4(src, weights, result, GetCellSize());
+    }
+
+    // Interaural time difference for minimum-phase grids: delay in samples to apply to the given ear after filtering
+    inline float GetDelay(int channel, float azimuth, float elevation) const
+    {
+        if (onsets == NULL)
+            return 0.0f;
+        int cells[4];
+        float weights[4];
+        GetNeighbours(azimuth, elevation, cells, weights);
+        float onset[2];
+        for (int c = 0; c < 2; c++)
+        {
+            const float* o = onsets + c * NUMELEVATIONS * NUMAZIMUTHS;
+            onset[c] = o[cells[0]] * weights[0] + o[cells[1]] * weights[1] + o[cells[2]] * weights[2] + o[cells[3]] * weights[3];
+        }
+        return onset[channel] - FastMin(onset[0], onset[1]);
+    }
+
+    // Derives a shorter grid from a full-length one: every HRIR is converted to minimum phase and truncated to hrirlength
+    // samples. The time of arrival that the conversion removes is kept per cell in onsets and reapplied as a delay, so
+    // that the interaural time difference survives the truncation.
+    void BuildMinimumPhase(const HRTFGrid& source, int hrirlength, int numthreads)
+    {
+        Allocate(hrirlength);
+        onsetbuffer = new float[GetNumCells()];
+        onsets = onsetbuffer;
+
+        const int cepstrumsize = source.specsize * 2;
+        std::vector<UnityComplexNumber> h(cepstrumsize);
+
+        const int numcells = 2 * NUMELEVATIONS * NUMAZIMUTHS;
+        if (numthreads > numcells)
+            numthreads = numcells;
+        if (numthreads <= 1)
+        {
+            BuildMinimumPhaseCells(source, 0, 1, &h[0]);
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < numthreads; t++)
+            workers.push_back(std::thread([this, &source, t, numthreads, cepstrumsize]()
+            {
+                std::vector<UnityComplexNumber> h(cepstrumsize);
+                BuildMinimumPhaseCells(source, t, numthreads, &h[0]);
+            }));
+        BuildMinimumPhaseCells(source, 0, numthreads, &h[0]);
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+    }
+
+protected:
+    inline int GetCellOffset(int channel, int elevation, int azimuth) const
+    {
+        return ((channel * NUMELEVATIONS + elevation) * NUMAZIMUTHS + azimuth) * GetCellSize();
+    }
+
+    void Allocate(int hrirlength)
+    {
+        delete[] onsetbuffer;
+        onsetbuffer = NULL;
+        onsets = NULL;
+        specsize = hrirlength * 2;
+        delete[] buffer;
+        buffer = new float[GetDataSize()];
+        data = buffer;
+    }
+
+    // Transforms every numthreads-th ring starting at first and resamples it onto the grid
+    void BuildRings(const float* const* rings, int first, int numthreads, UnityComplexNumber* h)
+    {
+        const int hrirlength = specsize / 2;
+        for (int r = first; r < 2 * NUMELEVATIONS; r += numthreads)
+        {
+            const float* src = rings[r];
+            int numangles = (int)(*src++);
+            const float* angles = src;
+            src += numangles;
+
+            // Transform the measured ring first, then resample it to the uniform azimuth spacing
+            float* ring = new float[numangles * GetCellSize()];
+            for (int a = 0; a < numangles; a++)
+            {
+                memset(h, 0, sizeof(UnityComplexNumber) * specsize);
+                for (int n = 0; n < hrirlength; n++)
+                    h[n + hrirlength].re = src[n];
+                src += hrirlength;
+                FFT::Forward(h, specsize, false);
+                float* cell = ring + a * GetCellSize();
+                SplitComplex::Deinterleave(h, cell, cell + specsize, specsize);
+            }
+
+            for (int a = 0; a < NUMAZIMUTHS; a++)
+                ResampleRing(ring, angles, numangles, a * GetAzimuthStep(), buffer + GetCellOffset(r / NUMELEVATIONS, r % NUMELEVATIONS, a));
+
+            delete[] ring;
+        }
+    }
+
+    // Converts every numthreads-th cell of source starting at first. h must hold source.specsize * 2 elements.
+    void BuildMinimumPhaseCells(const HRTFGrid& source, int first, int numthreads, UnityComplexNumber* h)
+    {
+        const int sourcelength = source.specsize / 2;
+        const int hrirlength = specsize / 2;
+        const int cepstrumsize = source.specsize * 2;
+        const int fadelength = hrirlength / 8;
+        std::vector<float> hrir(sourcelength);
+        for (int cell = first; cell < 2 * NUMELEVATIONS * NUMAZIMUTHS; cell += numthreads)
+        {
+            // Recover the HRIR, which sits in the second half of the source transform
+            const float* src = source.data + cell * source.GetCellSize();
+            SplitComplex::Interleave(src, src + source.specsize, h, source.specsize);
+            FFT::Backward(h, source.specsize, false);
+            float peak = 0.0f;
+            for (int n = 0; n < sourcelength; n++)
+            {
+                hrir[n] = h[n + sourcelength].re;
+                peak = FastMax(peak, fabsf(hrir[n]));
+            }
+
+            // Onset: first crossing of -20 dB relative to the peak, interpolated between samples
+            float threshold = peak * 0.1f, onset = 0.0f;
+            for (int n = 0; n < sourcelength; n++)
+            {
+                if (fabsf(hrir[n]) >= threshold)
+                {
+                    float prev = (n > 0) ? fabsf(hrir[n - 1]) : 0.0f;
+                    onset = (float)n - (fabsf(hrir[n]) - threshold) / (fabsf(hrir[n]) - prev + 1.0e-20f);
+                    break;
+                }
+            }
+            onsetbuffer[cell] = FastMax(onset, 0.0f);
+
+            // Minimum phase by folding the real cepstrum. The transform is twice the HRIR length to limit cepstral aliasing.
+            memset(h, 0, sizeof(UnityComplexNumber) * cepstrumsize);
+            for (int n = 0; n < sourcelength; n++)
+                h[n].re = hrir[n];
+            FFT::Forward(h, cepstrumsize, false);
+            for (int n = 0; n < cepstrumsize; n++)
+            {
+                h[n].re = logf(FastMax(sqrtf(h[n].Magnitude2()), 1.0e-9f));
+                h[n].im = 0.0f;
+            }
+            FFT::Backward(h, cepstrumsize, false);
+            for (int n = 1; n < cepstrumsize / 2; n++)
+            {
+                h[n].re *= 2.0f;
+                h[n + cepstrumsize / 2].re = 0.0f;
+            }
+            for (int n = 0; n < cepstrumsize; n++)
+                h[n].im = 0.0f;
+            FFT::Forward(h, cepstrumsize, false);
+            for (int n = 0; n < cepstrumsize; n++)
+            {
+                float mag = expf(h[n].re), phase = h[n].im;
+                h[n].re = mag * cosf(phase);
+                h[n].im = mag * sinf(phase);
+            }
+            FFT::Backward(h, cepstrumsize, false);
+            for (int n = 0; n < hrirlength; n++)
+            {
+                float fade = (n < hrirlength - fadelength) ? 1.0f : 0.5f + 0.5f * cosf(kPI * (float)(n - (hrirlength - fadelength) + 1) / (float)(fadelength + 1));
+                hrir[n] = h[n].re * fade;
+            }
+
+            memset(h, 0, sizeof(UnityComplexNumber) * specsize);
+            for (int n = 0; n < hrirlength; n++)
+                h[n + hrirlength].re = hrir[n];
+            FFT::Forward(h, specsize, false);
+            float* dst = buffer + cell * GetCellSize();
+            SplitComplex::Deinterleave(h, dst, dst + specsize, specsize);
+        }
+    }
+
+    // Linear interpolation along a measured ring, wrapping around at 360 degrees
+    void ResampleRing(const float* ring, const float* angles, int numangles, float angle, float* dst) const
+    {
+        int index2 = 0;
+        while (index2 < numangles && angles[index2] <= angle)
+            index2++;
+        int index1 = (index2 + numangles - 1) % numangles;
+        index2 %= numangles;
+
+        float span = angles[index2] - angles[index1];
+        float offset = angle - angles[index1];
+        if (span <= 0.0f)
+            span += 360.0f;
+        if (offset < 0.0f)
+            offset += 360.0f;
+        float f = (numangles > 1) ? (offset / span) : 0.0f;
+
+        const float* h1 = ring + index1 * GetCellSize();
+        const float* h2 = ring + index2 * GetCellSize();
+        for (int n = 0; n < GetCellSize(); n++)
+            dst[n] = h1[n] + (h2[n] - h1[n]) * f;
+    }
+};
+
+// Short time-domain impulse responses taken from a minimum-phase grid, for filtering without transforms.
+// The responses are stored in reverse order as FIRFilter expects them.
+class HRIRGrid
+{
+public:
+    int length;
+    const float* data;             // Either the owned buffer or a view into a mapped dataset file
+
+protected:
+    float* buffer;
+
+public:
+    inline HRIRGrid() : length(0), data(NULL), buffer(NULL) {}
+    inline ~HRIRGrid() { delete[] buffer; }
+
+    inline int GetDataSize() const { return 2 * HRTFGrid::NUMELEVATIONS * HRTFGrid::NUMAZIMUTHS * length; }
+
+    void Build(const HRTFGrid& source, int _length)
+    {
+        length = _length;
+        delete[] buffer;
+        buffer = new float[GetDataSize()];
+        data = buffer;
+
+        const int sourcelength = source.specsize / 2;
+        const int fadelength = length / 8;
+        std::vector<UnityComplexNumber> h(source.specsize);
+        for (int cell = 0; cell < 2 * HRTFGrid::NUMELEVATIONS * HRTFGrid::NUMAZIMUTHS; cell++)
+        {
+            const float* src = source.data + cell * source.GetCellSize();
+            SplitComplex::Interleave(src, src + source.specsize, &h[0], source.specsize);
+            FFT::Backward(&h[0], source.specsize, false);
+            float* dst = buffer + cell * length;
+            for (int n = 0; n < length; n++)
+            {
+                float x = (n < sourcelength) ? h[n + sourcelength].re : 0.0f;
+                float fade = (n < length - fadelength) ? 1.0f : 0.5f + 0.5f * cosf(kPI * (float)(n - (length - fadelength) + 1) / (float)(fadelength + 1));
+                dst[length - 1 - n] = x * fade;
+            }
+        }
+    }
+
+    inline void GetHRIR(int channel, float azimuth, float elevation, float* result) const
+    {
+        int cells[4];
+        float weights[4];
+        HRTFGrid::GetNeighbours(azimuth, elevation, cells, weights);
+        const float* base = data + channel * HRTFGrid::NUMELEVATIONS * HRTFGrid::NUMAZIMUTHS * length;
+        const float* src[4] = { base + cells[0] * length, base + cells[1] * length, base + cells[2] * length, base + cells[3] * length };
+        SplitComplex::Blend4(src, weights, result, length);
+    }
+
+    // Uses GetDataSize() floats of responses in place, which have to stay valid for as long as the grid is used
+    void Map(int _length, const float* responses)
+    {
+        delete[] buffer;
+        buffer = NULL;
+        length = _length;
+        data = responses;
+    }
+};
+
+// Binaural decoding filters for an ambisonic field (see SphericalHarmonics): the HRIRs of all grid cells projected onto the
+// spherical harmonics up to the given order. A plane wave encoded with SphericalHarmonics::Evaluate and filtered with these
+// responses yields the order-limited approximation of the HRIR pair of its direction. The minimum-phase HRIRs are delayed by
+// the interaural time difference of their cell before the projection, so the decoded field keeps the ITD at low frequencies.
+// The truncation loses mostly high frequencies, so the filters are scaled to the mean power of the HRIRs over the grid.
+// Each cell stands for its part of the ring band of the sphere; the region below the lowest ring is not covered by the grid.
+// The responses are stored in reverse order as FIRFilter expects them.
+class SHDecoderFilters
+{
+public:
+    enum { LENGTH = 64 };
+
+    int order;
+    const float* data;             // LENGTH samples per ear and channel, ear-major; owned or mapped like HRIRGrid::data
+
+protected:
+    float* buffer;
+
+public:
+    inline SHDecoderFilters() : order(0), data(NULL), buffer(NULL) {}
+    inline ~SHDecoderFilters() { delete[] buffer; }
+
+    inline int GetDataSize() const { return 2 * SphericalHarmonics::GetNumChannels(order) * LENGTH; }
+
+    // grid is the minimum-phase grid that hrir was built from. The ITD is clamped to the LENGTH - hrir.length samples that
+    // are left after the HRIR.
+    void Build(const HRTFGrid& grid, const HRIRGrid& hrir, int _order)
+    {
+        order = _order;
+        const int numchannels = SphericalHarmonics::GetNumChannels(order);
+        const int numcells = HRTFGrid::NUMELEVATIONS * HRTFGrid::NUMAZIMUTHS;
+        const float maxdelay = (float)(LENGTH - hrir.length - 1);
+        std::vector<float> sum(2 * numchannels * LENGTH, 0.0f);
+        double hrirpower = 0.0;
+        for (int cell = 0; cell < numcells; cell++)
+        {
+            float sh[SphericalHarmonics::MAXCHANNELS];
+            const float weight = GetCell(cell, sh);
+            for (int c = 0; c < 2; c++)
+            {
+                float delay = 0.0f;
+                if (grid.onsets != NULL)
+                    delay = FastClip(grid.onsets[c * numcells + cell] - FastMin(grid.onsets[cell], grid.onsets[numcells + cell]), 0.0f, maxdelay);
+                const int offset = (int)delay;
+                const float frac = delay - (float)offset;
+                const float* h = hrir.data + (c * numcells + cell) * hrir.length;
+                for (int n = 0; n < hrir.length; n++)
+                    hrirpower += weight * h[n] * h[n];
+                for (int k = 0; k < numchannels; k++)
+                {
+                    float* dst = &sum[(c * numchannels + k) * LENGTH] + offset;
+                    const float g = weight * sh[k];
+                    for (int n = 0; n < hrir.length; n++)
+                    {
+                        const float x = g * h[hrir.length - 1 - n];
+                        dst[n] += x * (1.0f - frac);
+                        dst[n + 1] += x * frac;
+                    }
+                }
+            }
+        }
+
+        // Power of the decoded responses for the same directions
+        double decodedpower = 0.0;
+        for (int cell = 0; cell < numcells; cell++)
+        {
+            float sh[SphericalHarmonics::MAXCHANNELS];
+            const float weight = GetCell(cell, sh);
+            for (int c = 0; c < 2; c++)
+            {
+                for (int n = 0; n < LENGTH; n++)
+                {
+                    float y = 0.0f;
+                    for (int k = 0; k < numchannels; k++)
+                        y += sh[k] * sum[(c * numchannels + k) * LENGTH + n];
+                    decodedpower += weight * y * y;
+                }
+            }
+        }
+        const float scale = (decodedpower > 0.0) ? (float)sqrt(hrirpower / decodedpower) : 1.0f;
+
+        delete[] buffer;
+        buffer = new float[GetDataSize()];
+        data = buffer;
+        for (int f = 0; f < 2 * numchannels; f++)
+            for (int n = 0; n < LENGTH; n++)
+                buffer[f * LENGTH + LENGTH - 1 - n] = sum[f * LENGTH + n] * scale;
+    }
+
+    // Uses GetDataSize() floats of filters in place, which have to stay valid for as long as the decoder is used
+    void Map(int _order, const float* filters)
+    {
+        delete[] buffer;
+        buffer = NULL;
+        order = _order;
+        data = filters;
+    }
+
+    inline const float* Get(int ear, int channel) const
+    {
+        return data + (ear * SphericalHarmonics::GetNumChannels(order) + channel) * LENGTH;
+    }
+
+protected:
+    // Evaluates the spherical harmonics for the direction of a grid cell and returns the fraction of the sphere it stands for
+    float GetCell(int cell, float* sh) const
+    {
+        static const float kDeg2Rad = kPI / 180.0f;
+        const float halfstep = 0.5f * HRTFGrid::GetElevationStep() * kDeg2Rad;
+        float elevation = (HRTFGrid::GetElevationStart() + (cell / HRTFGrid::NUMAZIMUTHS) * HRTFGrid::GetElevationStep()) * kDeg2Rad;
+        float azimuth = (cell % HRTFGrid::NUMAZIMUTHS) * HRTFGrid::GetAzimuthStep() * kDeg2Rad;
+        SphericalHarmonics::Evaluate(order, cosf(elevation) * sinf(azimuth), sinf(elevation), cosf(elevation) * cosf(azimuth), sh);
+        float top = FastMin(elevation + halfstep, 0.5f * kPI);
+        return 0.5f * (sinf(top) - sinf(elevation - halfstep)) / (float)HRTFGrid::NUMAZIMUTHS;
+    }
+};
+
+// Everything that is rendered from one HRTF set: the grid of the measured HRIRs, minimum-phase grids of the shorter lengths,
+// the direct path HRIRs taken from the shortest of those and the binaural decoder of the ambisonic field. Deriving them
+// takes a few hundred transforms per cell, so it is done once, by sofa2hrtf or for the cache of the compiled-in table, and
+// saved as aligned sections of one file (see HRTFFileHeader). Load maps that file and uses every section in place.
+class HRTFDataset
+{
+public:
+    enum { NUMLENGTHS = 4 };
+    enum { MAXLENGTH = 512 };      // Length of the measured HRIRs; every further grid is half as long as the one before
+    enum { DIRECTLENGTH = 32 };    // Length of the direct path HRIRs
+
+    HRTFGrid grid[NUMLENGTHS];
+    HRIRGrid hrir;
+    SHDecoderFilters decoder;
+
+protected:
+    MappedFile file;
+
+public:
+    static inline int GetLength(int n) { return MAXLENGTH >> n; }
+
+    // Derives everything from a table in the layout of HRTFGrid::Build
+    void Build(const float* src, int numthreads)
+    {
+        grid[0].Build(src, GetLength(0), numthreads);
+        for (int n = 1; n < NUMLENGTHS; n++)
+            grid[n].BuildMinimumPhase(grid[0], GetLength(n), numthreads);
+        hrir.Build(grid[NUMLENGTHS - 1], DIRECTLENGTH);
+        decoder.Build(grid[NUMLENGTHS - 1], hrir, SphericalHarmonics::MAXORDER);
+        file.Close();
+    }
+
+    bool Save(const char* path, int samplerate = 44100) const
+    {
+        HRTFFileSection sections[MAXSECTIONS];
+        const float* contents[MAXSECTIONS];
+        int numsections = GetSections(sections, contents);
+        FILE* f = fopen(path, "wb");
+        if (f == NULL)
+            return false;
+        HRTFFileHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = HRTFFILE_MAGIC;
+        header.version = HRTFFILE_VERSION;
+        header.hrirlength = GetLength(0);
+        header.numchannels = 2;
+        header.numelevations = HRTFGrid::NUMELEVATIONS;
+        header.numazimuths = HRTFGrid::NUMAZIMUTHS;
+        header.elevationstart = HRTFGrid::GetElevationStart();
+        header.elevationstep = HRTFGrid::GetElevationStep();
+        header.numsections = numsections;
+        header.samplerate = samplerate;
+        bool ok =
+            fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(sections, sizeof(HRTFFileSection), numsections, f) == (size_t)numsections;
+        size_t pos = sizeof(header) + numsections * sizeof(HRTFFileSection);
+        unsigned char padding[HRTFFILE_ALIGNMENT] = { 0 };
+        for (int i = 0; ok && i < numsections; i++)
+        {
+            ok =
+                fwrite(padding, 1, sections[i].offset - pos, f) == sections[i].offset - pos &&
+                fwrite(contents[i], 1, sections[i].size, f) == sections[i].size;
+            pos = sections[i].offset + sections[i].size;
+        }
+        fclose(f);
+        return ok;
+    }
+
+    // Maps a dataset file read-only. Loading costs no more than validating the header and the section table.
+    // On failure the dataset is left empty.
+    bool Load(const char* path)
+    {
+        Clear();
+        if (!file.Open(path))
+            return false;
+        const HRTFFileHeader* header = (const HRTFFileHeader*)file.GetData();
+        if (file.GetSize() < sizeof(HRTFFileHeader) ||
+            header->magic != HRTFFILE_MAGIC || header->version != HRTFFILE_VERSION ||
+            header->hrirlength != (unsigned int)GetLength(0) || header->numchannels != 2 ||
+            header->numelevations != HRTFGrid::NUMELEVATIONS || header->numazimuths != HRTFGrid::NUMAZIMUTHS ||
+            header->elevationstart != HRTFGrid::GetElevationStart() || header->elevationstep != HRTFGrid::GetElevationStep() ||
+            header->numsections > MAXSECTIONS ||
+            sizeof(HRTFFileHeader) + header->numsections * sizeof(HRTFFileSection) > file.GetSize())
+        {
+            file.Close();
+            return false;
+        }
+
+        const float* spectra[NUMLENGTHS];
+        const float* onsets[NUMLENGTHS];
+        bool ok = true;
+        for (int n = 0; n < NUMLENGTHS; n++)
+        {
+            spectra[n] = FindSection(header, HRTFSECTION_SPECTRA, GetLength(n), (size_t)HRTFGrid::GetNumCells() * GetLength(n) * 4);
+            onsets[n] = (n > 0) ? FindSection(header, HRTFSECTION_ONSETS, GetLength(n), HRTFGrid::GetNumCells()) : NULL;
+            ok = ok && spectra[n] != NULL && (n == 0 || onsets[n] != NULL);
+        }
+        const float* responses = FindSection(header, HRTFSECTION_HRIRS, DIRECTLENGTH, (size_t)HRTFGrid::GetNumCells() * DIRECTLENGTH);
+        const float* filters = FindSection(header, HRTFSECTION_DECODER, SphericalHarmonics::MAXORDER, 2 * SphericalHarmonics::MAXCHANNELS * SHDecoderFilters::LENGTH);
+        if (!ok || responses == NULL || filters == NULL)
+        {
+            file.Close();
+            return false;
+        }
+
+        for (int n = 0; n < NUMLENGTHS; n++)
+            grid[n].Map(GetLength(n), spectra[n], onsets[n]);
+        hrir.Map(DIRECTLENGTH, responses);
+        decoder.Map(SphericalHarmonics::MAXORDER, filters);
+        return true;
+    }
+
+protected:
+    enum { MAXSECTIONS = NUMLENGTHS * 2 + 2 };
+
+    static inline unsigned int Align(size_t offset)
+    {
+        return (unsigned int)((offset + HRTFFILE_ALIGNMENT - 1) & ~(size_t)(HRTFFILE_ALIGNMENT - 1));
+    }
+
+    static inline void AddSection(HRTFFileSection* sections, const float** contents, int& num, int type, int length, const float* data, int numfloats)
+    {
+        sections[num].type = type;
+        sections[num].length = length;
+        sections[num].offset = 0;
+        sections[num].size = numfloats * sizeof(float);
+        contents[num++] = data;
+    }
+
+    // Lists the sections in file order, placed one after the other behind the section table
+    int GetSections(HRTFFileSection* sections, const float** contents) const
+    {
+        int num = 0;
+        for (int n = 0; n < NUMLENGTHS; n++)
+        {
+            AddSection(sections, contents, num, HRTFSECTION_SPECTRA, GetLength(n), grid[n].data, grid[n].GetDataSize());
+            if (grid[n].onsets != NULL)
+                AddSection(sections, contents, num, HRTFSECTION_ONSETS, GetLength(n), grid[n].onsets, HRTFGrid::GetNumCells());
+        }
+        AddSection(sections, contents, num, HRTFSECTION_HRIRS, hrir.length, hrir.data, hrir.GetDataSize());
+        AddSection(sections, contents, num, HRTFSECTION_DECODER, decoder.order, decoder.data, decoder.GetDataSize());
+        unsigned int offset = Align(sizeof(HRTFFileHeader) + num * sizeof(HRTFFileSection));
+        for (int i = 0; i < num; i++)
+        {
+            sections[i].offset = offset;
+            offset = Align(offset + sections[i].size);
+        }
+        return num;
+    }
+
+    // Returns the section of the given type and length, or NULL if it is missing or does not hold numfloats floats
+    const float* FindSection(const HRTFFileHeader* header, int type, int length, size_t numfloats) const
+    {
+        const HRTFFileSection* sections = (const HRTFFileSection*)(header + 1);
+        for (unsigned int i = 0; i < header->numsections; i++)
+        {
+            const HRTFFileSection& section = sections[i];
+            if (section.type != (unsigned int)type || section.length != (unsigned int)length)
+                continue;
+            if (section.size != numfloats * sizeof(float) || (section.offset % HRTFFILE_ALIGNMENT) != 0 ||
+                (size_t)section.offset + section.size > file.GetSize())
+                return NULL;
+            return (const float*)(file.GetData() + section.offset);
+        }
+        return NULL;
+    }
+
+    void Clear()
+    {
+        for (int n = 0; n < NUMLENGTHS; n++)
+            grid[n].Map(0, NULL, NULL);
+        hrir.Map(0, NULL);
+        decoder.Map(0, NULL);
+        file.Close();
+    }
+};
+
+// Interpolated HRTF pairs for quantized directions, shared by all voices.
+// Slots are filled lazily on first use: the filling thread takes an entry from a preallocated pool, interpolates both ears
+// from the grid and publishes the entry with a compare-and-swap, so readers never lock. If two threads race for the same
+// slot the loser's pool entry is handed back for reuse. Once every pool entry is in use, a miss unpublishes the least
+// recently used entry and falls back to the nearest grid cell. Entries are only looked up through a Reader, which announces
+// the epoch it started in for as long as the caller uses the entries it got; unpublishing an entry advances the epoch, and
+// the entry is refilled only once no Reader from that epoch or before is left.
+class HRTFCache
+{
+public:
+    enum { AZIMUTHCELLS = 180 };   // 2 degree cells
+    enum { ELEVATIONCELLS = 66 };  // 2 degree cells from -40 to 90 degrees
+    enum { NUMSLOTS = AZIMUTHCELLS * ELEVATIONCELLS };
+    enum { MAXREADERS = 64 };      // Readers at the same time, further ones get the grid entries, which are never refilled
+    enum { FREE = -1, CLAIMED = -2, RETIRING = -3 };
+
+    struct Entry
+    {
+        const float* spectrum[2];  // Split spectrum per ear, HRTFGrid::GetCellSize() floats each
+        float delay[2];            // Interaural time difference per ear in samples (zero unless the grid is minimum-phase)
+        std::atomic<int> slot;     // Slot the entry is published in, or FREE, CLAIMED or RETIRING
+        std::atomic<unsigned> lastused;  // Miss count at the last lookup that returned the entry
+        std::atomic<unsigned> retired;   // Epoch the entry was unpublished in
+    };
+
+    // Entries returned by Get stay valid until the reader goes out of scope, which is meant to be the end of the callback
+    class Reader
+    {
+    public:
+        Reader(HRTFCache* _cache) : cache(_cache), index(-1)
+        {
+            if (cache != NULL)
+                index = cache->BeginRead();
+        }
+
+        ~Reader()
+        {
+            if (index >= 0)
+                cache->readers[index].store(0, std::memory_order_release);
+        }
+
+        // Returns the HRTF pair for the given direction (in degrees)
+        const Entry* Get(float azimuth, float elevation)
+        {
+            return cache->Get(azimuth, elevation, index >= 0);
+        }
+
+    protected:
+        HRTFCache* cache;
+        int index;
+    };
+
+protected:
+    const HRTFGrid* grid;
+    std::atomic<Entry*> slots[NUMSLOTS];
+    std::atomic<int> numused;
+    std::atomic<unsigned> misses;
+    std::atomic<unsigned> epoch;
+    std::atomic<unsigned> readers[MAXREADERS]; // Epoch each active reader started in, 0 if the reader slot is unused
+    int capacity;
+    Entry* pool;
+    float* pooldata;
+    Entry* gridentries;
+
+public:
+    HRTFCache() : grid(NULL), numused(0), misses(0), epoch(1), capacity(0), pool(NULL), pooldata(NULL), gridentries(NULL)
+    {
+        for (int n = 0; n < NUMSLOTS; n++)
+            slots[n].store(NULL, std::memory_order_relaxed);
+        for (int n = 0; n < MAXREADERS; n++)
+            readers[n].store(0, std::memory_order_relaxed);
+    }
+
+    ~HRTFCache()
+    {
+        delete[] pool;
+        delete[] pooldata;
+        delete[] gridentries;
+    }
+
+    void Init(const HRTFGrid& _grid, int _capacity)
+    {
+        grid = &_grid;
+        capacity = _capacity;
+        numused.store(0, std::memory_order_relaxed);
+        misses.store(0, std::memory_order_relaxed);
+        for (int n = 0; n < NUMSLOTS; n++)
+            slots[n].store(NULL, std::memory_order_relaxed);
+
+        delete[] pool;
+        delete[] pooldata;
+        pool = new Entry[capacity];
+        pooldata = new float[capacity * 2 * grid->GetCellSize()];
+        for (int n = 0; n < capacity; n++)
+        {
+            // Entries that were never handed out belong to numused, not to the free list
+            pool[n].spectrum[0] = pooldata + (n * 2 + 0) * grid->GetCellSize();
+            pool[n].spectrum[1] = pooldata + (n * 2 + 1) * grid->GetCellSize();
+            pool[n].slot.store(CLAIMED, std::memory_order_relaxed);
+            pool[n].lastused.store(0, std::memory_order_relaxed);
+            pool[n].retired.store(0, std::memory_order_relaxed);
+        }
+
+        delete[] gridentries;
+        gridentries = new Entry[HRTFGrid::NUMELEVATIONS * HRTFGrid::NUMAZIMUTHS];
+        for (int e = 0; e < HRTFGrid::NUMELEVATIONS; e++)
+        {
+            for (int a = 0; a < HRTFGrid::NUMAZIMUTHS; a++)
+            {
+                Entry& entry = gridentries[e * HRTFGrid::NUMAZIMUTHS + a];
+                entry.spectrum[0] = grid->GetCell(0, e, a);
+                entry.spectrum[1] = grid->GetCell(1, e, a);
+                entry.delay[0] = grid->GetDelay(0, a * HRTFGrid::GetAzimuthStep(), HRTFGrid::GetElevationStart() + e * HRTFGrid::GetElevationStep());
+                entry.delay[1] = grid->GetDelay(1, a * HRTFGrid::GetAzimuthStep(), HRTFGrid::GetElevationStart() + e * HRTFGrid::GetElevationStep());
+            }
+        }
+    }
+
+    inline int GetNumUsed() const
+    {
+        return numused.load(std::memory_order_relaxed);
+    }
+
+protected:
+    // Returns the index of the reader slot taken, or -1 if all are in use
+    int BeginRead()
+    {
+        const unsigned current = epoch.load();
+        for (int n = 0; n < MAXREADERS; n++)
+        {
+            unsigned expected = 0;
+            if (readers[n].load(std::memory_order_relaxed) == 0 && readers[n].compare_exchange_strong(expected, current))
+                return n;
+        }
+        return -1;
+    }
+
+    // Oldest epoch an active reader started in
+    unsigned GetOldestReader() const
+    {
+        const unsigned current = epoch.load();
+        unsigned oldest = current;
+        for (int n = 0; n < MAXREADERS; n++)
+        {
+            unsigned e = readers[n].load();
+            if (e != 0 && (int)(current - e) > (int)(current - oldest))
+                oldest = e;
+        }
+        return oldest;
+    }
+
+    const Entry* Get(float azimuth, float elevation, bool protect)
+    {
+        const float azimuthstep = 360.0f / (float)AZIMUTHCELLS;
+        const float elevationstep = (HRTFGrid::GetElevationStep() * (HRTFGrid::NUMELEVATIONS - 1)) / (float)(ELEVATIONCELLS - 1);
+
+        int a = (int)floorf(azimuth / azimuthstep + 0.5f) % AZIMUTHCELLS;
+        if (a < 0)
+            a += AZIMUTHCELLS;
+        int e = (int)floorf(FastClip((elevation - HRTFGrid::GetElevationStart()) / elevationstep, 0.0f, (float)(ELEVATIONCELLS - 1)) + 0.5f);
+
+        float cellazimuth = a * azimuthstep;
+        float cellelevation = HRTFGrid::GetElevationStart() + e * elevationstep;
+        if (!protect)
+            return GetNearestGridEntry(cellazimuth, cellelevation);
+
+        const int slotindex = e * AZIMUTHCELLS + a;
+        std::atomic<Entry*>& slot = slots[slotindex];
+        Entry* entry = slot.load();
+        if (entry != NULL)
+        {
+            entry->lastused.store(misses.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            return entry;
+        }
+
+        entry = Claim();
+        if (entry == NULL)
+            return GetNearestGridEntry(cellazimuth, cellelevation);
+
+        grid->GetHRTF(0, cellazimuth, cellelevation, const_cast<float*>(entry->spectrum[0]));
+        grid->GetHRTF(1, cellazimuth, cellelevation, const_cast<float*>(entry->spectrum[1]));
+        entry->delay[0] = grid->GetDelay(0, cellazimuth, cellelevation);
+        entry->delay[1] = grid->GetDelay(1, cellazimuth, cellelevation);
+
+        // The entry only becomes a candidate for unpublishing once it is published
+        Entry* expected = NULL;
+        if (!slot.compare_exchange_strong(expected, entry))
+        {
+            // Nobody else has seen the entry, so it can be reused right away
+            entry->retired.store(0, std::memory_order_relaxed);
+            entry->slot.store(FREE, std::memory_order_release);
+            return expected;
+        }
+        entry->slot.store(slotindex, std::memory_order_release);
+        return entry;
+    }
+
+    // Takes a pool entry that was never used while there are any, otherwise a free entry that no reader can still be
+    // using. If there is no free entry at all, the least recently used one is unpublished for a later miss to take.
+    // Returns NULL if no entry can be taken now.
+    Entry* Claim()
+    {
+        const unsigned now = misses.fetch_add(1, std::memory_order_relaxed) + 1;
+        int n = numused.load(std::memory_order_relaxed);
+        while (n < capacity)
+        {
+            if (numused.compare_exchange_weak(n, n + 1, std::memory_order_relaxed))
+            {
+                pool[n].lastused.store(now, std::memory_order_relaxed);
+                return &pool[n];
+            }
+        }
+
+        const unsigned oldestreader = GetOldestReader();
+        bool anyfree = false;
+        int victim = -1, victimslot = -1;
+        int oldest = 0;
+        for (int i = 0; i < capacity; i++)
+        {
+            Entry& entry = pool[i];
+            int s = entry.slot.load(std::memory_order_acquire);
+            if (s == FREE)
+            {
+                anyfree = true;
+                int expected = FREE;
+                if (entry.slot.compare_exchange_strong(expected, CLAIMED, std::memory_order_acquire, std::memory_order_relaxed))
+                {
+                    // Readers that started before the entry was unpublished may still be using it
+                    if ((int)(oldestreader - entry.retired.load(std::memory_order_relaxed)) > 0)
+                    {
+                        entry.lastused.store(now, std::memory_order_relaxed);
+                        return &entry;
+                    }
+                    entry.slot.store(FREE, std::memory_order_release);
+                }
+            }
+            else if (s >= 0)
+            {
+                // A concurrent lookup can stamp an entry with a later miss count than now, that entry is the youngest
+                int age = (int)(now - entry.lastused.load(std::memory_order_relaxed));
+                if (age > oldest)
+                {
+                    oldest = age;
+                    victim = i;
+                    victimslot = s;
+                }
+            }
+        }
+
+        if (!anyfree && victim >= 0)
+        {
+            // Another thread may be unpublishing the same entry, only one of them wins it
+            Entry& entry = pool[victim];
+            int expected = victimslot;
+            if (entry.slot.compare_exchange_strong(expected, RETIRING, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                Entry* published = &entry;
+                slots[victimslot].compare_exchange_strong(published, NULL);
+                entry.retired.store(epoch.fetch_add(1), std::memory_order_relaxed);
+                entry.slot.store(FREE, std::memory_order_release);
+            }
+        }
+        return NULL;
+    }
+
+    inline const Entry* GetNearestGridEntry(float azimuth, float elevation) const
+    {
+        int e = (int)floorf((elevation - HRTFGrid::GetElevationStart()) / HRTFGrid::GetElevationStep() + 0.5f);
+        int a = (int)floorf(azimuth / HRTFGrid::GetAzimuthStep() + 0.5f) % HRTFGrid::NUMAZIMUTHS;
+        return &gridentries[e * HRTFGrid::NUMAZIMUTHS + a];
+    }
+};